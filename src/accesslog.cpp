@@ -0,0 +1,359 @@
+#include "accesslog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+using namespace std;
+
+
+// Entries each thread can have waiting to be written
+#define RING_SIZE 512
+
+// How often the writer thread empties the rings
+#define WRITE_INTERVAL_MS 100
+
+
+/**
+ * A queued line, kept in fixed size buffers so queueing never allocates.
+ * Longer values are cut short.
+ */
+struct LogEntry {
+    bool isAccess;
+    time_t time;
+    const char* route;
+    int statusCode;
+    size_t bytes;
+    unsigned long latencyUs;
+    char method[8];
+    char client[48];
+    char stationId[64];
+    char text[400];     // The request target, or the message
+};
+
+
+/**
+ * Entries queued by one thread.  Only that thread moves head and only the
+ * writer thread moves tail, so no lock is needed.  released is set when
+ * the thread exits, and the ring is given to another thread once the
+ * writer has emptied it.
+ */
+struct LogRing {
+    LogEntry entries[RING_SIZE];
+    atomic<size_t> head;
+    atomic<size_t> tail;
+    atomic<bool> released;
+
+    LogRing() : head(0), tail(0), released(false) {}
+};
+
+
+static atomic<bool> writerRunning(false);
+static atomic<bool> accessLogOn(false);
+
+// The rings of running threads (and of exited threads that still have
+// entries waiting), and the emptied rings of exited threads
+static mutex ringsLock;
+static vector<LogRing*> rings;
+static vector<LogRing*> freeRings;
+
+// Held while emptying the rings
+static mutex drainLock;
+
+static string accessLogFile;
+static size_t maxLogBytes;
+static unsigned int keepLogFiles;
+static FILE* pAccessLog = NULL;
+static size_t accessLogBytes = 0;
+
+
+/**
+ * Holds the current thread's ring, and gives it back when the thread exits
+ */
+struct RingHolder {
+    LogRing* pRing;
+
+    RingHolder() : pRing(NULL) {}
+
+    ~RingHolder() {
+        if (pRing != NULL) {
+            pRing->released.store(true, memory_order_release);
+        }
+    }
+};
+
+
+static LogRing& threadRing() {
+    static thread_local RingHolder holder;
+    if (holder.pRing == NULL) {
+        lock_guard<mutex> guard(ringsLock);
+        if (!freeRings.empty()) {
+            holder.pRing = freeRings.back();
+            freeRings.pop_back();
+            holder.pRing->released.store(false, memory_order_relaxed);
+        }
+        else {
+            holder.pRing = new LogRing();
+        }
+        rings.push_back(holder.pRing);
+    }
+    return *holder.pRing;
+}
+
+
+static void copyString(char* dest, size_t size, const string& src) {
+    size_t len = min(src.size(), size - 1);
+    memcpy(dest, src.data(), len);
+    dest[len] = '\0';
+}
+
+
+/**
+ * Returns the next free entry in the current thread's ring, or NULL
+ * if it is full.  The entry is queued with commit().
+ */
+static LogEntry* reserve(LogRing& ring) {
+    size_t head = ring.head.load(memory_order_relaxed);
+    if (head - ring.tail.load(memory_order_acquire) >= RING_SIZE) {
+        countEvent(LOG_DROPPED);
+        return NULL;
+    }
+    return &ring.entries[head % RING_SIZE];
+}
+
+
+static void commit(LogRing& ring) {
+    ring.head.store(ring.head.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+
+
+void logAccess(const AccessLogEntry& access) {
+    if (!accessLogOn.load(memory_order_relaxed)) {
+        return;
+    }
+
+    LogRing& ring = threadRing();
+    LogEntry* pEntry = reserve(ring);
+    if (pEntry == NULL) {
+        return;
+    }
+
+    pEntry->isAccess = true;
+    pEntry->time = time(NULL);
+    pEntry->route = access.route;
+    pEntry->statusCode = access.statusCode;
+    pEntry->bytes = access.bytes;
+    pEntry->latencyUs = access.latencyUs;
+    copyString(pEntry->method, sizeof(pEntry->method), access.method);
+    copyString(pEntry->client, sizeof(pEntry->client), access.client);
+    copyString(pEntry->stationId, sizeof(pEntry->stationId), access.stationId);
+    copyString(pEntry->text, sizeof(pEntry->text), access.target);
+    commit(ring);
+}
+
+
+
+bool accessLogEnabled() {
+    return accessLogOn.load(memory_order_relaxed);
+}
+
+
+
+void logMessage(const string& message) {
+    if (!writerRunning.load()) {
+        // One write, so lines from different threads do not interleave
+        cerr << (message + "\n");
+        return;
+    }
+
+    LogRing& ring = threadRing();
+    LogEntry* pEntry = reserve(ring);
+    if (pEntry == NULL) {
+        return;
+    }
+
+    pEntry->isAccess = false;
+    copyString(pEntry->text, sizeof(pEntry->text), message);
+    commit(ring);
+}
+
+
+
+static void formatAccess(const LogEntry& entry, string& out) {
+    struct tm tm;
+    gmtime_r(&entry.time, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+    char line[sizeof(entry.text) + 256];
+    snprintf(line, sizeof(line), "%s - - [%s] \"%s %s HTTP/1.1\" %d %zu route=%s station=\"%s\" ms=%.3f\n",
+             entry.client[0] != '\0' ? entry.client : "-", when, entry.method, entry.text,
+             entry.statusCode, entry.bytes, entry.route, entry.stationId, entry.latencyUs / 1000.0);
+    out += line;
+}
+
+
+
+/**
+ * Starts a new access log, keeping the old ones as .1, .2, ...
+ */
+static void rotateAccessLog() {
+    fclose(pAccessLog);
+
+    for (unsigned int n = keepLogFiles; n > 1; n--) {
+        string from = accessLogFile + "." + to_string(n - 1);
+        string to = accessLogFile + "." + to_string(n);
+        rename(from.c_str(), to.c_str());
+    }
+    if (keepLogFiles > 0) {
+        rename(accessLogFile.c_str(), (accessLogFile + ".1").c_str());
+    }
+    else {
+        remove(accessLogFile.c_str());
+    }
+
+    pAccessLog = fopen(accessLogFile.c_str(), "a");
+    if (pAccessLog == NULL) {
+        cerr << ("Could not reopen access log " + accessLogFile + "\n");
+    }
+    accessLogBytes = 0;
+}
+
+
+
+/**
+ * Writes out everything queued in the rings, and moves the rings of
+ * exited threads to freeRings once they are empty.  The caller must hold
+ * drainLock.
+ */
+static void drainRings(string& accessBatch, string& messageBatch) {
+
+    vector<LogRing*> ringList;
+    {
+        lock_guard<mutex> guard(ringsLock);
+        ringList = rings;
+    }
+
+    vector<LogRing*> emptied;
+    for (LogRing* pRing : ringList) {
+        // Read released first, so an entry queued just before the thread
+        // exited is not missed.
+        bool released = pRing->released.load(memory_order_acquire);
+        size_t tail = pRing->tail.load(memory_order_relaxed);
+        size_t head = pRing->head.load(memory_order_acquire);
+        for (; tail != head; tail++) {
+            const LogEntry& entry = pRing->entries[tail % RING_SIZE];
+            if (entry.isAccess) {
+                formatAccess(entry, accessBatch);
+            }
+            else {
+                messageBatch += entry.text;
+                messageBatch += '\n';
+            }
+        }
+        pRing->tail.store(tail, memory_order_release);
+        if (released) {
+            emptied.push_back(pRing);
+        }
+    }
+
+    if (!emptied.empty()) {
+        lock_guard<mutex> guard(ringsLock);
+        for (LogRing* pRing : emptied) {
+            rings.erase(find(rings.begin(), rings.end(), pRing));
+            freeRings.push_back(pRing);
+        }
+    }
+
+    if (!messageBatch.empty()) {
+        fwrite(messageBatch.data(), 1, messageBatch.size(), stderr);
+        fflush(stderr);
+        messageBatch.clear();
+    }
+
+    if (!accessBatch.empty() && pAccessLog != NULL) {
+        fwrite(accessBatch.data(), 1, accessBatch.size(), pAccessLog);
+        fflush(pAccessLog);
+        accessLogBytes += accessBatch.size();
+        if (maxLogBytes > 0 && accessLogBytes >= maxLogBytes) {
+            rotateAccessLog();
+        }
+    }
+    // Dropped if the log could not be reopened after rotating
+    accessBatch.clear();
+}
+
+
+
+static void writerLoop() {
+
+    string accessBatch;
+    string messageBatch;
+
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(WRITE_INTERVAL_MS));
+
+        lock_guard<mutex> guard(drainLock);
+        if (!writerRunning.load()) {
+            // stopLogWriter() wrote out the rest
+            return;
+        }
+        drainRings(accessBatch, messageBatch);
+    }
+}
+
+
+
+void startLogWriter(const string& fileName, size_t maxBytes, unsigned int keepFiles) {
+    if (writerRunning.exchange(true)) {
+        return;
+    }
+
+    accessLogFile = fileName;
+    maxLogBytes = maxBytes;
+    keepLogFiles = keepFiles;
+    if (!accessLogFile.empty()) {
+        pAccessLog = fopen(accessLogFile.c_str(), "a");
+        if (pAccessLog == NULL) {
+            cerr << "Could not open access log " << accessLogFile << endl;
+        }
+        else {
+            fseek(pAccessLog, 0, SEEK_END);
+            accessLogBytes = ftell(pAccessLog);
+            accessLogOn.store(true);
+        }
+    }
+
+    thread(writerLoop).detach();
+    atexit(stopLogWriter);
+}
+
+
+
+void stopLogWriter() {
+    lock_guard<mutex> guard(drainLock);
+    if (!writerRunning.exchange(false)) {
+        return;
+    }
+    accessLogOn.store(false);
+
+    string accessBatch;
+    string messageBatch;
+    drainRings(accessBatch, messageBatch);
+
+    if (pAccessLog != NULL) {
+        fclose(pAccessLog);
+        pAccessLog = NULL;
+    }
+}
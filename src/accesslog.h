@@ -0,0 +1,92 @@
+#ifndef _accesslog_h_
+#define _accesslog_h_
+
+#include <string>
+
+/**
+  * accesslog.h
+  * -------------------------
+  * The access log, and other logging from request threads, written in
+  * the background so request threads never wait on file or stdio locks.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * Starts the background thread that writes the logs.  If accessLogFile is
+ * not empty, requests passed to logAccess() are written to it.  Once the
+ * file reaches maxBytes it is renamed to accessLogFile.1 (the older
+ * files moving up to .2, .3, and so on, keeping at most keepFiles of
+ * them) and a new one is started.
+ */
+extern void startLogWriter(const std::string& accessLogFile, size_t maxBytes, unsigned int keepFiles);
+
+
+/**
+ * Writes out everything still queued and stops the log writer.  Lines
+ * logged after this are written to stderr right away, and requests are
+ * no longer logged.  This is called at exit.
+ */
+extern void stopLogWriter();
+
+
+/**
+ * A request to be written to the access log
+ */
+struct AccessLogEntry {
+    std::string method;
+    std::string target;     // The path and query string
+    std::string client;     // The client's address
+    const char* route;      // The name the route is known by in /metrics
+    std::string stationId;  // The station the request was for (if any)
+    int statusCode;
+    size_t bytes;           // Size of the response body
+    unsigned long latencyUs;
+};
+
+
+/**
+ * Queues a request for the access log.  Lines are written in a format
+ * that extends the Common Log Format, so the log can also be used as
+ * XTWSD_WARMUP_FILE or replayed by load testing tools:
+ *
+ *   client - - [time] "GET /location/NOS:8722862?days=2 HTTP/1.1" 200 5310 route=/location/{stationId} station="NOS:8722862" ms=3.125
+ *
+ * Each thread queues into a ring buffer of its own, so this never takes a
+ * lock.  If the ring is full the entry is dropped and counted in /metrics.
+ */
+extern void logAccess(const AccessLogEntry& entry);
+
+
+/**
+ * Returns TRUE if requests are being written to an access log
+ */
+extern bool accessLogEnabled();
+
+
+/**
+ * Queues a line for stderr, the same way.  If the log writer has not been
+ * started, the line is written right away.
+ */
+extern void logMessage(const std::string& message);
+
+#endif
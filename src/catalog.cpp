@@ -0,0 +1,215 @@
+#include "catalog.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+#include "dataset.h"
+#include "json_fifo.h"
+#include "jsonxt.h"
+#include "lrucache.h"
+#include "metrics.h"
+#include "singleflight.h"
+#include "tidedb.h"
+#include "trace.h"
+#include "xtutil.h"
+
+using namespace std;
+using namespace libxtide;
+
+
+/**
+ * Serialized /locations listings. There are only six possible
+ * filter combinations per data version.
+ */
+static LruCache<string>& locationsCache() {
+    static LruCache<string> cache(12);
+    static bool registered = registerCache("locations", cache);
+    return cache;
+}
+
+
+/**
+ * Loaded stations, keyed by xtutil::stationCacheKey(). The size can be set
+ * with XTWSD_STATION_CACHE.  The cached stations are only ever copied,
+ * never predicted with, so any number of threads can share them.
+ */
+static LruCache<shared_ptr<Station>>& stationCache() {
+    static LruCache<shared_ptr<Station>> cache(xtutil::getEnvInt("XTWSD_STATION_CACHE", 256));
+    static bool registered = registerCache("station", cache);
+    return cache;
+}
+
+
+// Station loads in progress, keyed like the station cache
+static SingleFlight<shared_ptr<Station>> stationLoads;
+
+
+
+string getLocationsBody(const StationTypeFilter& filter, bool referenceOnly) {
+
+    string key = to_string(filter.getTypeNum());
+    key += referenceOnly ? ":ref:v" : ":all:v";
+    key += to_string(xtutil::dataVersion());
+
+    string body;
+    if (locationsCache().get(key, body)) {
+        return body;
+    }
+
+    json jLocs = json::array();
+
+    shared_ptr<Dataset> dataset = currentDataset();
+    StationIndex& stations = dataset->stations();
+
+    for (int s : dataset->stationsByName()) {
+        StationRef*  pRef = stations[s];
+        if (filter.qualifies(pRef)) {
+            if (!referenceOnly || pRef->isReferenceStation) {
+                json j = json({});
+                tojson(pRef, j);
+                jLocs += j;
+            }
+        }
+    }
+
+    body = jLocs.dump(-1, ' ', true);
+    locationsCache().put(key, body);
+    return body;
+}
+
+
+
+StationLease loadStation(int stationIndex) {
+
+    TraceSpan span(TRACE_LOAD);
+
+    string key = xtutil::stationCacheKey(stationIndex);
+
+    shared_ptr<Station> loaded;
+    if (!stationCache().get(key, loaded)) {
+        loaded = stationLoads.run(key, [stationIndex, &key] {
+            shared_ptr<Station> station;
+            {
+                ExternalTideDbSession session;
+                countEvent(STATION_LOAD);
+                station.reset(currentStations()[stationIndex]->load());
+            }
+            stationCache().put(key, station);
+            return station;
+        });
+    }
+
+    // Copying a loaded station is much cheaper than loading it, and
+    // leaves the cached one untouched.
+    return StationLease(loaded->clone());
+}
+
+
+
+/**
+ * Returns the files and directories libxtide reads harmonics from: the
+ * entries of HFILE_PATH, or of the first line of /etc/xtide.conf.
+ */
+static vector<string> harmonicsPath() {
+
+    string path;
+    const char* hfilePath = getenv("HFILE_PATH");
+    if (hfilePath != NULL) {
+        path = hfilePath;
+    }
+    else {
+        ifstream conf("/etc/xtide.conf");
+        getline(conf, path);
+    }
+
+    vector<string> entries;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find(':', start);
+        if (end == string::npos) {
+            end = path.size();
+        }
+        if (end > start) {
+            entries.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return entries;
+}
+
+
+
+vector<HarmonicsFileInfo> getHarmonicsFiles() {
+
+    vector<HarmonicsFileInfo> files;
+    map<string, size_t> positions;
+
+    StationIndex& stations = currentStations();
+    for (unsigned long s = 0; s < stations.size(); s++) {
+        StationRef*  pRef = stations[s];
+        string fileName = pRef->harmonicsFileName.aschar();
+        auto it = positions.find(fileName);
+        if (it == positions.end()) {
+            positions[fileName] = files.size();
+            HarmonicsFileInfo info = { pRef->harmonicsFileName, 1 };
+            files.push_back(info);
+        }
+        else {
+            files[it->second].stationCount++;
+        }
+    }
+
+    // The station index is sorted by name, so put the files back in the
+    // order of the path entry they came from (by name within a directory).
+    vector<string> entries = harmonicsPath();
+    auto rank = [&entries](const HarmonicsFileInfo& file) -> size_t {
+        string fileName = file.fileName.aschar();
+        for (size_t e = 0; e < entries.size(); e++) {
+            const string& entry = entries[e];
+            if (fileName == entry ||
+                (fileName.compare(0, entry.size(), entry) == 0 &&
+                 (entry.back() == '/' || fileName[entry.size()] == '/'))) {
+                return e;
+            }
+        }
+        return entries.size();
+    };
+    stable_sort(files.begin(), files.end(), [&rank](const HarmonicsFileInfo& a, const HarmonicsFileInfo& b) {
+        size_t rankA = rank(a);
+        size_t rankB = rank(b);
+        return rankA < rankB || (rankA == rankB && strcmp(a.fileName.aschar(), b.fileName.aschar()) < 0);
+    });
+
+    return files;
+}
+
+
+
+static Dstr findWriteHarmonicsFile() {
+
+    vector<HarmonicsFileInfo> files = getHarmonicsFiles();
+    if (files.empty()) {
+        return Dstr();
+    }
+
+    const char* writeFile = getenv("XTWSD_WRITE_FILE");
+    if (writeFile != NULL) {
+        for (auto& file : files) {
+            if (file.fileName == writeFile) {
+                return file.fileName;
+            }
+        }
+        std::cerr << "XTWSD_WRITE_FILE " << writeFile << " is not a harmonics file in use - using "
+                  << files[0].fileName.aschar() << std::endl;
+    }
+
+    return files[0].fileName;
+}
+
+
+
+const Dstr& getWriteHarmonicsFile() {
+    static Dstr writeFile = findWriteHarmonicsFile();
+    return writeFile;
+}
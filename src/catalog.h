@@ -0,0 +1,141 @@
+#ifndef _catalog_h_
+#define _catalog_h_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "_libxtide.h"
+
+/**
+  * catalog.h
+  * -------------------------
+  * Access to the station catalog: filtering, the cached /locations
+  * listing, and a cache of loaded Station objects.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * For responses that have an optional filter based on tide only stations or
+ * current only stations...
+ */
+class StationTypeFilter {
+
+    public:
+        StationTypeFilter(std::string strFilter) {
+            if (strFilter == "tide") {
+                typeNum = 1;
+            }
+            else if (strFilter == "current") {
+                typeNum = 2;
+            }
+            else {
+                typeNum = 0;
+            }
+        }
+
+        bool qualifies(libxtide::StationRef* pRef) const {
+            switch (typeNum) {
+                case 0:
+                    return true;
+
+                case 1:
+                    return !pRef->isCurrent;
+
+                case 2:
+                    return pRef->isCurrent;
+            }
+
+            return false;
+        }
+
+        int getTypeNum() const { return typeNum; }
+
+    private:
+       int typeNum;
+};
+
+
+
+/**
+ * Returns the serialized json /locations listing for the stations that
+ * pass filter (and, if referenceOnly is set, are reference stations).
+ * Listings are cached until the data version changes.
+ */
+extern std::string getLocationsBody(const StationTypeFilter& filter, bool referenceOnly);
+
+
+
+/**
+ * A Station of the caller's own, for as long as the lease is held.
+ * Station objects keep internal state while predicting, so requests never
+ * share one: each gets a copy of the station in the station cache.
+ */
+class StationLease {
+
+    public:
+        explicit StationLease(libxtide::Station* pStation) : station(pStation) {}
+
+        libxtide::Station* get() { return station.get(); }
+
+        libxtide::Station* operator->() { return station.get(); }
+
+    private:
+        std::unique_ptr<libxtide::Station> station;
+};
+
+
+/**
+ * Returns a copy of the station at stationIndex, loading it into the
+ * station cache if it is not already there.  Concurrent requests for a
+ * station that is not cached share one load.
+ */
+extern StationLease loadStation(int stationIndex);
+
+
+
+/**
+ * One of the harmonics files the catalog was built from
+ */
+struct HarmonicsFileInfo {
+    Dstr fileName;
+    int stationCount;
+};
+
+
+/**
+ * Returns every harmonics file in the catalog, in the order they are listed
+ * in HFILE_PATH (or /etc/xtide.conf).  Files read from a directory in the
+ * path are in name order.
+ */
+extern std::vector<HarmonicsFileInfo> getHarmonicsFiles();
+
+
+/**
+ * Returns the harmonics file new stations are added to.  This is the file
+ * named by XTWSD_WRITE_FILE, or the first harmonics file if that is not set
+ * (or does not name one of the files in the catalog).
+ */
+extern const Dstr& getWriteHarmonicsFile();
+
+#endif
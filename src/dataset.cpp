@@ -0,0 +1,540 @@
+#include "dataset.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <vector>
+
+#include "accesslog.h"
+#include "catalog.h"
+#include "harmrecord.h"
+#include "tidedb.h"
+#include "xtutil.h"
+
+using namespace std;
+using namespace libxtide;
+
+
+/**
+ * Data versions start from the time the server started, so the versions
+ * a client saw before a restart are older than any it sees after it.
+ * The low 20 bits leave room for a million changes a second, and the
+ * result stays below 2^53, so clients that keep numbers as doubles
+ * (JavaScript) still see it exactly.
+ */
+static unsigned long firstVersion() {
+    unsigned long now = (unsigned long) time(NULL);
+    return (sizeof(unsigned long) >= 8) ? (now << 20) : now;
+}
+
+static atomic<unsigned long> lastVersion(firstVersion());
+static atomic<unsigned long> lastGeneration(0);
+
+// The current dataset. Always accessed with atomic_load/atomic_store.
+static shared_ptr<Dataset> current;
+static once_flag currentInit;
+
+// The dataset pinned by the current thread (if any)
+static thread_local shared_ptr<Dataset> pinned;
+
+
+
+// Deletes the StationRefs of a dataset when the last copy of it goes
+static void deleteStationRefs(vector<StationRef*>* pRefs) {
+    for (StationRef* pRef : *pRefs) {
+        delete pRef;
+    }
+    delete pRefs;
+}
+
+
+Dataset::Dataset(StationIndex* pStations, bool ownsStations) :
+    version(nextVersion()),
+    pStations(pStations),
+    ownsIndex(ownsStations),
+    generation(++lastGeneration),
+    recordCount(0) {
+
+    baseVersion = version.load();
+    referencesVersion = baseVersion;
+
+    if (ownsStations) {
+        vector<StationRef*>* pRefs = new vector<StationRef*>();
+        for (unsigned long s = 0; s < pStations->size(); s++) {
+            pRefs->push_back((*pStations)[s]);
+        }
+        pOwnedRefs = shared_ptr<vector<StationRef*>>(pRefs, deleteStationRefs);
+    }
+}
+
+
+/**
+ * Returns how many stations can be added to copies of a dataset before
+ * its lookups are rebuilt instead of shared.  Stations added since the
+ * name order and record lookups were built are sorted and searched on
+ * every call, so this keeps that about as cheap as one lookup in a map.
+ */
+static size_t overlayLimit(size_t stationCount) {
+    return max((size_t) 256, (size_t) sqrt((double) stationCount));
+}
+
+
+Dataset::Dataset(Dataset& from, StationIndex* pStations) :
+    version(from.version.load()),
+    pStations(pStations),
+    ownsIndex(true),
+    generation(from.generation),
+    pOwnedRefs(from.pOwnedRefs),
+    recordCount(0) {
+
+    if (!pOwnedRefs) {
+        pOwnedRefs = shared_ptr<vector<StationRef*>>(new vector<StationRef*>(), deleteStationRefs);
+    }
+
+    size_t limit = overlayLimit(pStations->size());
+
+    {
+        lock_guard<mutex> guard(from.idsLock);
+        pIds = from.pIds;
+        addedIds = from.addedIds;
+    }
+    if (addedIds.byId.size() > limit) {
+        // Fold the added ids into new shared lookups.  This is the one
+        // part of copying that is proportional to the number of stations,
+        // and it only happens once every limit stations.
+        StationIds* pFolded = new StationIds(*pIds);
+        for (auto& added : addedIds.byId) {
+            pFolded->byId[added.first] = added.second;
+        }
+        for (auto& added : addedIds.byIndex) {
+            pFolded->byIndex[added.first] = added.second;
+        }
+        pIds.reset(pFolded);
+        addedIds = StationIds();
+    }
+
+    {
+        lock_guard<mutex> guard(from.changesLock);
+        baseVersion = from.baseVersion;
+        stationVersions = from.stationVersions;
+        referencesVersion = from.referencesVersion;
+    }
+
+    // The name order and record lookups are cheap to build again when
+    // they are next needed, so once they leave out too many stations they
+    // are simply dropped.
+    {
+        lock_guard<mutex> guard(from.orderLock);
+        if (from.pOrder && pStations->size() - from.pOrder->size() <= limit) {
+            pOrder = from.pOrder;
+        }
+    }
+
+    lock_guard<mutex> guard(from.recordLock);
+    if (from.pRecordMap && pStations->size() - from.recordCount <= limit) {
+        pRecordMap = from.pRecordMap;
+        recordCount = from.recordCount;
+    }
+}
+
+
+Dataset::~Dataset() {
+    if (ownsIndex) {
+        delete pStations;
+    }
+}
+
+
+shared_ptr<Dataset> Dataset::copy() {
+    StationIndex* pCopy = new StationIndex();
+    pCopy->reserve(pStations->size() + 1);
+    for (unsigned long s = 0; s < pStations->size(); s++) {
+        pCopy->push_back((*pStations)[s]);
+    }
+    return shared_ptr<Dataset>(new Dataset(*this, pCopy));
+}
+
+
+unsigned long Dataset::nextVersion() {
+    return ++lastVersion;
+}
+
+
+
+void Dataset::publishChanges(const vector<string>& stationIds, bool referencesChanged) {
+    {
+        // Record the stations before publishing the version, so anyone who
+        // sees the new version also sees what changed in it.
+        lock_guard<mutex> guard(changesLock);
+        unsigned long changeVersion = nextVersion();
+        for (const string& stationId : stationIds) {
+            stationVersions[stationId] = changeVersion;
+        }
+        if (referencesChanged) {
+            referencesVersion = changeVersion;
+        }
+        version = changeVersion;
+    }
+    notifyChange();
+}
+
+
+
+bool Dataset::changesSince(unsigned long since, vector<string>& stationIds) {
+    if (since < baseVersion || since > version.load()) {
+        return false;
+    }
+
+    lock_guard<mutex> guard(changesLock);
+    for (auto& change : stationVersions) {
+        if (change.second > since) {
+            stationIds.push_back(change.first);
+        }
+    }
+    return true;
+}
+
+
+
+unsigned long Dataset::stationVersion(const string& stationId, bool isReference) {
+    lock_guard<mutex> guard(changesLock);
+
+    unsigned long stationVersion = baseVersion;
+    auto it = stationVersions.find(stationId);
+    if (it != stationVersions.end()) {
+        stationVersion = it->second;
+    }
+    if (!isReference) {
+        stationVersion = max(stationVersion, referencesVersion);
+    }
+    return stationVersion;
+}
+
+
+
+bool Dataset::ByName::operator()(int a, int b) const {
+    int cmp = strcmp((*pStations)[a]->name.aschar(), (*pStations)[b]->name.aschar());
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+
+
+int Dataset::addStation(StationRef* pRef, const string& stationId) {
+    pStations->push_back(pRef);
+    pOwnedRefs->push_back(pRef);
+
+    int stationIndex = pStations->size() - 1;
+    pRef->rootStationIndexIndex = stationIndex;
+
+    // The name order and record lookups pick up the new station on their
+    // own, since it is past the end of what they cover.
+    lock_guard<mutex> guard(idsLock);
+    if (pIds) {
+        addedIds.byId[stationId] = stationIndex;
+        addedIds.byIndex[stationIndex] = stationId;
+    }
+    return stationIndex;
+}
+
+
+
+bool Dataset::hasIds() {
+    lock_guard<mutex> guard(idsLock);
+    return (bool) pIds;
+}
+
+
+void Dataset::setIds(shared_ptr<const StationIds> pNewIds) {
+    lock_guard<mutex> guard(idsLock);
+    if (!pIds) {
+        pIds = pNewIds;
+    }
+}
+
+
+int Dataset::idStation(const string& stationId) {
+    lock_guard<mutex> guard(idsLock);
+    auto it = addedIds.byId.find(stationId);
+    if (it != addedIds.byId.end()) {
+        return it->second;
+    }
+    if (pIds) {
+        it = pIds->byId.find(stationId);
+        if (it != pIds->byId.end()) {
+            return it->second;
+        }
+    }
+    return -1;
+}
+
+
+const string* Dataset::stationId(int stationIndex) {
+    lock_guard<mutex> guard(idsLock);
+    auto it = addedIds.byIndex.find(stationIndex);
+    if (it != addedIds.byIndex.end()) {
+        return &it->second;
+    }
+    if (pIds) {
+        it = pIds->byIndex.find(stationIndex);
+        if (it != pIds->byIndex.end()) {
+            return &it->second;
+        }
+    }
+    return NULL;
+}
+
+
+
+vector<int> Dataset::stationsByName() {
+    ByName byName = { pStations };
+
+    shared_ptr<const vector<int>> pSorted;
+    {
+        lock_guard<mutex> guard(orderLock);
+        if (!pOrder) {
+            vector<int>* pNewOrder = new vector<int>(pStations->size());
+            for (int s = 0; s < (int) pStations->size(); s++) {
+                (*pNewOrder)[s] = s;
+            }
+            // libxtide sorted the stations when it loaded them, so this
+            // is nearly sorted already.
+            sort(pNewOrder->begin(), pNewOrder->end(), byName);
+            pOrder.reset(pNewOrder);
+        }
+        pSorted = pOrder;
+    }
+
+    if (pSorted->size() == pStations->size()) {
+        return *pSorted;
+    }
+
+    // Merge in the stations added since the order was built
+    vector<int> added;
+    for (int s = pSorted->size(); s < (int) pStations->size(); s++) {
+        added.push_back(s);
+    }
+    sort(added.begin(), added.end(), byName);
+
+    vector<int> order;
+    order.reserve(pStations->size());
+    merge(pSorted->begin(), pSorted->end(), added.begin(), added.end(), back_inserter(order), byName);
+    return order;
+}
+
+
+
+int Dataset::recordStation(const Dstr& harmonicsFileName, uint32_t recordNumber) {
+    shared_ptr<const map<RecordKey, int>> pRecords;
+    size_t covered;
+    {
+        lock_guard<mutex> guard(recordLock);
+        if (!pRecordMap) {
+            map<RecordKey, int>* pNewRecordMap = new map<RecordKey, int>();
+            for (int s = 0; s < (int) pStations->size(); s++) {
+                StationRef* pRef = (*pStations)[s];
+                (*pNewRecordMap)[RecordKey(pRef->harmonicsFileName.aschar(), pRef->recordNumber)] = s;
+            }
+            pRecordMap.reset(pNewRecordMap);
+            recordCount = pStations->size();
+        }
+        pRecords = pRecordMap;
+        covered = recordCount;
+    }
+
+    // Stations added since the map was built win, as they would have in
+    // the map.
+    for (size_t s = pStations->size(); s > covered; s--) {
+        StationRef* pRef = (*pStations)[s - 1];
+        if (pRef->recordNumber == recordNumber &&
+            strcmp(pRef->harmonicsFileName.aschar(), harmonicsFileName.aschar()) == 0) {
+            return s - 1;
+        }
+    }
+
+    auto it = pRecords->find(RecordKey(harmonicsFileName.aschar(), recordNumber));
+    return (it != pRecords->end()) ? it->second : -1;
+}
+
+
+
+shared_ptr<Dataset> currentDataset() {
+    if (pinned) {
+        return pinned;
+    }
+
+    call_once(currentInit, [] {
+        // The first dataset is the one libxtide loaded, which it owns
+        atomic_store(&current, make_shared<Dataset>(&Global::stationIndex(), false));
+    });
+    return atomic_load(&current);
+}
+
+
+void makeCurrent(shared_ptr<Dataset> dataset) {
+    atomic_store(&current, dataset);
+}
+
+
+StationIndex& currentStations() {
+    if (pinned) {
+        return pinned->stations();
+    }
+    // The current dataset is only replaced while holding the tide database
+    // lock.  Unpinned callers (startup and the harmonics writer) run
+    // before a reload can happen or hold that lock themselves, and the
+    // writer pins the copy it adds stations to.
+    return currentDataset()->stations();
+}
+
+
+
+DatasetPin::DatasetPin() : previous(pinned) {
+    pinned = currentDataset();
+}
+
+
+DatasetPin::DatasetPin(shared_ptr<Dataset> dataset) : previous(pinned) {
+    pinned = dataset;
+}
+
+
+DatasetPin::~DatasetPin() {
+    pinned = previous;
+}
+
+
+
+static mutex changeLock;
+static condition_variable changed;
+
+void notifyChange() {
+    lock_guard<mutex> guard(changeLock);
+    changed.notify_all();
+}
+
+
+
+shared_ptr<Dataset> waitForChange(unsigned long since, unsigned int timeoutMs) {
+
+    // Make sure the initial dataset has been set up
+    DatasetPin pin;
+
+    unique_lock<mutex> guard(changeLock);
+    // A version newer than the current one came from some other run of
+    // the server, so it counts as a change too.
+    changed.wait_for(guard, chrono::milliseconds(timeoutMs), [since] {
+        return atomic_load(&current)->version.load() != since;
+    });
+    return atomic_load(&current);
+}
+
+
+
+/**
+ * Reads files into a new dataset and builds its id lookups.  The tide
+ * database is locked for one file (or record) at a time, so requests and
+ * the harmonics writer are only held up briefly.  NULL is returned (with
+ * a reason in error) if a file could not be read.
+ */
+static shared_ptr<Dataset> readDataset(const vector<HarmonicsFileInfo>& files, string& error) {
+
+    StationIndex* pNewStations = new StationIndex();
+    for (auto& file : files) {
+        // libxtide reads the file through libtcd on its own
+        ExternalTideDbSession session;
+
+        // libxtide gives up on the whole process if it can not read a
+        // harmonics file, so make sure it can first.
+        if (!open_tide_db(file.fileName.aschar())) {
+            error = "Could not open harmonics file ";
+            error += file.fileName.aschar();
+            delete pNewStations;
+            return shared_ptr<Dataset>();
+        }
+        close_tide_db();
+
+        pNewStations->addHarmonicsFile(file.fileName);
+    }
+    pNewStations->sort();
+    pNewStations->setRootStationIndexIndices();
+
+    shared_ptr<Dataset> dataset = make_shared<Dataset>(pNewStations, true);
+    {
+        // Build the id lookups before anyone else can see the new dataset
+        DatasetPin pin(dataset);
+        xtutil::preloadContextMap();
+    }
+    return dataset;
+}
+
+
+
+/**
+ * How many times a reload reads the harmonics files while changes are
+ * still being written to them.  The last time, writers are kept out
+ * until it is done.
+ */
+#define MAX_RELOAD_READS 3
+
+
+static mutex reloadLock;
+
+bool reloadDataset(string& error) {
+
+    unique_lock<mutex> guard(reloadLock, try_to_lock);
+    if (!guard.owns_lock()) {
+        error = "A reload is already running";
+        return false;
+    }
+
+    // (This also makes sure the initial dataset has been set up, so it
+    // can not replace ours later.)
+    vector<HarmonicsFileInfo> files = getHarmonicsFiles();
+
+    logMessage("Reloading harmonics data...");
+
+    shared_ptr<Dataset> dataset;
+    for (int read = 1; !dataset; read++) {
+        unique_ptr<ExternalTideDbSession> pWritersOut;
+        if (read == MAX_RELOAD_READS) {
+            pWritersOut.reset(new ExternalTideDbSession());
+        }
+
+        // Forget the old files, and note the version they are read at
+        unsigned long readVersion;
+        {
+            ExternalTideDbSession session;
+            TideDbSession::reset();
+            readVersion = atomic_load(&current)->version.load();
+        }
+
+        shared_ptr<Dataset> loaded = readDataset(files, error);
+        if (!loaded) {
+            return false;
+        }
+
+        // A change written while the files were being read may be only
+        // partly in the new dataset, so then they are read again.  Writers
+        // make their changes current while holding the tide database lock,
+        // so none can land between this check and the swap.
+        ExternalTideDbSession session;
+        if (atomic_load(&current)->version.load() == readVersion) {
+            makeCurrent(loaded);
+            clearHarmonicsRecords();
+            TideDbSession::reset();
+            dataset = loaded;
+        }
+        else {
+            logMessage("Harmonics data changed during the reload. Reading it again...");
+        }
+    }
+    notifyChange();
+
+    logMessage("Reloaded " + to_string(dataset->stations().size()) + " stations (data version " +
+               to_string(dataset->version.load()) + ").");
+    return true;
+}
@@ -0,0 +1,297 @@
+#ifndef _dataset_h_
+#define _dataset_h_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "_libxtide.h"
+
+/**
+  * dataset.h
+  * -------------------------
+  * The loaded harmonics data, and replacing it while the server is running.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * The maps between station ids and station indexes of a dataset
+ */
+struct StationIds {
+    std::map<std::string, int> byId;
+    std::map<int, std::string> byIndex;
+};
+
+
+
+/**
+ * One generation of the harmonics data: the station index read from the
+ * harmonics files, plus the id lookups built from it.  A reload creates
+ * a new Dataset and makes it current; requests that started on the old one
+ * keep using it (see DatasetPin) and it is freed when the last of them
+ * finishes.
+ * <p>
+ * The station index of a dataset other threads can see never changes.
+ * The harmonics writer adds stations to a copy() instead, and makes the
+ * copy current once the stations are written.  A copy shares the lookups
+ * of the dataset it was made from, and keeps the stations added since in
+ * small lookups of its own, so making one does not copy every map.
+ */
+class Dataset {
+
+    public:
+        /**
+         * Wraps pStations.  If ownsStations is set, the index and its
+         * StationRefs are deleted once neither this Dataset nor any copy
+         * of it is left.
+         */
+        Dataset(libxtide::StationIndex* pStations, bool ownsStations);
+
+        ~Dataset();
+
+        libxtide::StationIndex& stations() { return *pStations; }
+
+        /**
+         * Counts the datasets loaded since startup.  The first is 1.  A
+         * copy() has the generation of the dataset it was made from.
+         */
+        unsigned long getGeneration() const { return generation; }
+
+        /**
+         * The version of this dataset's data (see xtutil::dataVersion()).
+         * Versions are unique across datasets.
+         */
+        std::atomic<unsigned long> version;
+
+        /**
+         * Returns a data version that has never been used before.
+         */
+        static unsigned long nextVersion();
+
+        /**
+         * Moves this dataset to a new data version, recording that the
+         * specified stations were added or changed in it, and wakes up
+         * anyone in waitForChange().  Set referencesChanged if any of them
+         * is an existing reference station, since subordinate stations
+         * are computed from those.
+         */
+        void publishChanges(const std::vector<std::string>& stationIds, bool referencesChanged = false);
+
+        /**
+         * Fills stationIds with the ids of the stations that have changed
+         * since data version since.  FALSE is returned if since is older
+         * than this dataset, or newer than its current version (a version
+         * from before the server was restarted), in which case everything
+         * must be treated as changed.
+         */
+        bool changesSince(unsigned long since, std::vector<std::string>& stationIds);
+
+        /**
+         * Returns the data version in which the specified station last
+         * changed.  For a subordinate station, changes to reference stations
+         * count too.  Results computed from the station stay valid for as
+         * long as this stays the same.
+         */
+        unsigned long stationVersion(const std::string& stationId, bool isReference);
+
+        /**
+         * Returns a new dataset with the same stations, id lookups and
+         * data version as this one, for adding stations to.  The station
+         * index itself (one pointer per station) is copied, but the
+         * lookups are shared until the copies have added enough stations
+         * that rebuilding them is worth it.
+         */
+        std::shared_ptr<Dataset> copy();
+
+        /**
+         * Appends pRef to the end of the station index, makes it known by
+         * its id, and returns its station index.  Stations already in the
+         * index keep their indexes.  Only call this on a copy() that has
+         * not been made current yet.  The dataset takes ownership of pRef.
+         */
+        int addStation(libxtide::StationRef* pRef, const std::string& stationId);
+
+        /**
+         * Returns the indexes of all stations, sorted by station name.
+         */
+        std::vector<int> stationsByName();
+
+        /**
+         * Returns the index of the station stored in the specified record
+         * of a harmonics file, or -1 if there is none.
+         */
+        int recordStation(const libxtide::Dstr& harmonicsFileName, uint32_t recordNumber);
+
+        /**
+         * Returns TRUE once setIds() has been called.  The id lookups are
+         * built on first use by xtutil::getStationIndex() and friends.
+         */
+        bool hasIds();
+
+        /**
+         * Sets the id lookups of this dataset's stations, unless another
+         * thread got there first.
+         */
+        void setIds(std::shared_ptr<const StationIds> pIds);
+
+        /**
+         * Returns the index of the station with the specified id, or -1
+         * if there is none.
+         */
+        int idStation(const std::string& stationId);
+
+        /**
+         * Returns the id of the specified station, or NULL if it does not
+         * have one.  The id lasts as long as the dataset does.
+         */
+        const std::string* stationId(int stationIndex);
+
+    private:
+        libxtide::StationIndex* pStations;
+        bool ownsIndex;
+        unsigned long generation;
+
+        // The StationRefs to delete once this dataset and all copies of
+        // it are gone. NULL for the index libxtide loaded, which it owns.
+        std::shared_ptr<std::vector<libxtide::StationRef*>> pOwnedRefs;
+
+        // The version this dataset was loaded as, the version in which
+        // each station changed since then, and the last version in which
+        // an existing reference station changed.
+        unsigned long baseVersion;
+        std::mutex changesLock;
+        std::map<std::string, unsigned long> stationVersions;
+        unsigned long referencesVersion;
+
+        // Orders station indexes by station name
+        struct ByName {
+            libxtide::StationIndex* pStations;
+            bool operator()(int a, int b) const;
+        };
+
+        // The id lookups.  pIds never changes once it is set, so copies
+        // share it; the ids of the stations a copy adds go in addedIds.
+        std::mutex idsLock;
+        std::shared_ptr<const StationIds> pIds;
+        StationIds addedIds;
+
+        // Station indexes in name order, built on first use.  Shared with
+        // copies, so it may leave out the stations added after it was
+        // built.  stationsByName() merges those in.
+        std::mutex orderLock;
+        std::shared_ptr<const std::vector<int>> pOrder;
+
+        // Station indexes by harmonics file and record number, built on
+        // first use.  Like pOrder it only covers the first recordCount
+        // stations, and the rest are searched one by one.
+        typedef std::pair<std::string, uint32_t> RecordKey;
+        std::mutex recordLock;
+        std::shared_ptr<const std::map<RecordKey, int>> pRecordMap;
+        size_t recordCount;
+
+        // Used by copy()
+        Dataset(Dataset& from, libxtide::StationIndex* pStations);
+
+        Dataset(const Dataset&) = delete;
+        Dataset& operator=(const Dataset&) = delete;
+};
+
+
+
+/**
+ * Returns the dataset the current thread is working with: the one pinned
+ * by a DatasetPin if there is one, otherwise the current one.
+ */
+extern std::shared_ptr<Dataset> currentDataset();
+
+
+/**
+ * Makes dataset the current one.  Requests that are already running
+ * stay on the dataset they pinned.  Callers must hold the tide database
+ * lock.
+ */
+extern void makeCurrent(std::shared_ptr<Dataset> dataset);
+
+
+/**
+ * Shorthand for currentDataset()->stations().  Use this in place of
+ * libxtide's Global::stationIndex().
+ */
+extern libxtide::StationIndex& currentStations();
+
+
+
+/**
+ * Keeps the current thread on one dataset for as long as the pin is held,
+ * even if a reload makes a new dataset current in the meantime.  Requests
+ * pin the dataset when they start.
+ */
+class DatasetPin {
+
+    public:
+        DatasetPin();
+
+        explicit DatasetPin(std::shared_ptr<Dataset> dataset);
+
+        ~DatasetPin();
+
+    private:
+        std::shared_ptr<Dataset> previous;
+
+        DatasetPin(const DatasetPin&) = delete;
+        DatasetPin& operator=(const DatasetPin&) = delete;
+};
+
+
+
+/**
+ * Wakes up everyone waiting in waitForChange().  Called whenever the data
+ * version changes.
+ */
+extern void notifyChange();
+
+
+/**
+ * Waits up to timeoutMs milliseconds for the data version to move past
+ * since, because of a write or a reload.  Returns the dataset that is
+ * current when the wait ends (ignoring any DatasetPin).
+ */
+extern std::shared_ptr<Dataset> waitForChange(unsigned long since, unsigned int timeoutMs);
+
+
+
+/**
+ * Reads the harmonics files again into a new dataset, builds its id
+ * lookups, and then makes it current.  Requests already running finish
+ * on the old dataset.  The tide database is only locked for a file at a
+ * time while reading, and while swapping the datasets.  FALSE is returned
+ * (with a reason in error) if the files could not be read or a reload is
+ * already running.
+ */
+extern bool reloadDataset(std::string& error);
+
+#endif
@@ -0,0 +1,35 @@
+#include "diagnostics.h"
+
+#include "accesslog.h"
+
+using namespace std;
+
+
+// The innermost capture on this thread, or NULL
+static thread_local DiagnosticCapture* pCurrentCapture = NULL;
+
+
+DiagnosticCapture::DiagnosticCapture() : pPrevious(pCurrentCapture), errors(0) {
+    pCurrentCapture = this;
+}
+
+
+DiagnosticCapture::~DiagnosticCapture() {
+    pCurrentCapture = pPrevious;
+}
+
+
+
+void diagnostic(const string& message, bool isError) {
+    DiagnosticCapture* pCapture = pCurrentCapture;
+    if (pCapture != NULL) {
+        pCapture->captured += message;
+        pCapture->captured += '\n';
+        if (isError) {
+            pCapture->errors++;
+        }
+    }
+    else {
+        logMessage(message);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef _diagnostics_h_
+#define _diagnostics_h_
+
+#include <string>
+
+/**
+  * diagnostics.h
+  * -------------------------
+  * Per thread collection of error messages.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * Collects the messages passed to diagnostic() by the current thread for
+ * as long as it exists, so they can be returned to the client that caused
+ * them.  Other threads (and their logging) are not affected.  Captures may
+ * be nested, in which case the innermost one gets the messages.
+ */
+class DiagnosticCapture {
+
+    public:
+        DiagnosticCapture();
+
+        ~DiagnosticCapture();
+
+        /**
+         * Returns the messages collected so far, one per line
+         */
+        const std::string& getCapture() const { return captured; }
+
+        /**
+         * Returns TRUE if any of the messages collected is an error
+         */
+        bool hasErrors() const { return errors > 0; }
+
+    private:
+        friend void diagnostic(const std::string& message, bool isError);
+
+        DiagnosticCapture* pPrevious;
+        std::string captured;
+        int errors;
+
+        DiagnosticCapture(const DiagnosticCapture&) = delete;
+        DiagnosticCapture& operator=(const DiagnosticCapture&) = delete;
+};
+
+
+/**
+ * Reports a message.  It goes to the current thread's DiagnosticCapture if
+ * there is one, otherwise to stderr.
+ */
+extern void diagnostic(const std::string& message, bool isError = true);
+
+#endif
@@ -0,0 +1,159 @@
+#include "harmrecord.h"
+
+#include <map>
+
+#include "dataset.h"
+#include "lrucache.h"
+#include "metrics.h"
+#include "tidedb.h"
+#include "xtutil.h"
+
+using namespace std;
+using namespace libxtide;
+
+
+/**
+ * Decoded records keyed by harmonics file and record number.  Writers
+ * invalidate individual records, so the key does not include the data
+ * version.
+ */
+static LruCache<shared_ptr<const HarmonicsRecord>>& recordCache() {
+    static LruCache<shared_ptr<const HarmonicsRecord>> cache(xtutil::getEnvInt("XTWSD_HARMONICS_CACHE", 4096));
+    static bool registered = registerCache("harmonics", cache);
+    return cache;
+}
+
+
+// Interned constituent names, one table per harmonics file. Guarded by the
+// tide database lock (only touched inside a TideDbSession).
+static map<string, shared_ptr<const vector<string>>> constituentTables;
+
+
+static string recordKey(const Dstr& harmonicsFileName, int recordNumber) {
+    string key = harmonicsFileName.aschar();
+    key += ":";
+    key += to_string(recordNumber);
+    return key;
+}
+
+
+/**
+ * Returns the constituent names of the open harmonics file. Must be called
+ * inside a TideDbSession for that file.
+ */
+static shared_ptr<const vector<string>> getConstituentNames(const Dstr& harmonicsFileName, TideDbSession& session) {
+    string fileName = harmonicsFileName.aschar();
+    auto it = constituentTables.find(fileName);
+    if (it != constituentTables.end()) {
+        return it->second;
+    }
+
+    shared_ptr<vector<string>> names = make_shared<vector<string>>();
+    int count = session.header().constituents;
+    names->reserve(count);
+    for (int c = 0; c < count; c++) {
+        names->push_back(get_constituent(c));
+    }
+
+    constituentTables[fileName] = names;
+    return names;
+}
+
+
+static string safeString(const NV_CHAR* str) {
+    return str == NULL ? string() : string(str);
+}
+
+
+
+static shared_ptr<const HarmonicsRecord> decode(TIDE_RECORD& rec, TideDbSession& session, const Dstr& harmonicsFileName) {
+
+    shared_ptr<HarmonicsRecord> hr = make_shared<HarmonicsRecord>();
+
+    hr->header = rec.header;
+
+    hr->country = safeString(get_country(rec.country));
+    hr->source = rec.source;
+    hr->comments = rec.comments;
+    hr->notes = rec.notes;
+    hr->stationIdContext = rec.station_id_context;
+    hr->stationId = rec.station_id;
+
+    hr->directionUnits = safeString(get_dir_units(rec.direction_units));
+    hr->minDirection = rec.min_direction;
+    hr->maxDirection = rec.max_direction;
+    hr->levelUnits = safeString(get_level_units(rec.level_units));
+
+    hr->datumOffset = rec.datum_offset;
+    hr->datum = safeString(get_datum(rec.datum));
+    hr->zoneOffset = rec.zone_offset;
+    hr->confidence = rec.confidence;
+
+    if (rec.header.record_type == REFERENCE_STATION) {
+        int count = session.header().constituents;
+        for (int c = 0; c < count; c++) {
+            if (rec.amplitude[c] != 0.0 || rec.epoch[c] != 0.0) {
+                HarmonicConstituent hc;
+                hc.id = c;
+                hc.amp = rec.amplitude[c];
+                hc.epoch = rec.epoch[c];
+                hr->constituents.push_back(hc);
+            }
+        }
+        hr->constituents.shrink_to_fit();
+    }
+
+    hr->minTimeAdd = rec.min_time_add;
+    hr->minLevelAdd = rec.min_level_add;
+    hr->minLevelMultiply = rec.min_level_multiply;
+    hr->maxTimeAdd = rec.max_time_add;
+    hr->maxLevelAdd = rec.max_level_add;
+    hr->maxLevelMultiply = rec.max_level_multiply;
+    hr->floodBegins = rec.flood_begins;
+    hr->ebbBegins = rec.ebb_begins;
+
+    hr->constituentNames = getConstituentNames(harmonicsFileName, session);
+
+    return hr;
+}
+
+
+
+shared_ptr<const HarmonicsRecord> getHarmonicsRecord(int stationIndex) {
+
+    StationRef*  pRef = currentStations()[stationIndex];
+    string key = recordKey(pRef->harmonicsFileName, pRef->recordNumber);
+
+    shared_ptr<const HarmonicsRecord> hr;
+    if (recordCache().get(key, hr)) {
+        return hr;
+    }
+
+    TideDbSession session(pRef->harmonicsFileName);
+    if (session.isOpen()) {
+        TIDE_RECORD rec;
+        countEvent(TCD_READ);
+        if (read_tide_record(pRef->recordNumber, &rec) != -1) {
+            hr = decode(rec, session, pRef->harmonicsFileName);
+
+            // Still holding the session, so a writer can not have
+            // invalidated this record since we read it.
+            recordCache().put(key, hr);
+        }
+    }
+
+    return hr;
+}
+
+
+
+void invalidateHarmonicsRecord(const Dstr& harmonicsFileName, int recordNumber) {
+    recordCache().erase(recordKey(harmonicsFileName, recordNumber));
+}
+
+
+
+void clearHarmonicsRecords() {
+    recordCache().clear();
+    constituentTables.clear();
+}
@@ -0,0 +1,124 @@
+#ifndef _harmrecord_h_
+#define _harmrecord_h_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "_libxtide.h"
+
+/**
+  * harmrecord.h
+  * -------------------------
+  * Decoded, cached copies of harmonics database records.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * One non-zero harmonic constituent of a reference station. id is the
+ * constituent's number in the harmonics file.
+ */
+struct HarmonicConstituent {
+    NV_U_INT16 id;
+    NV_FLOAT32 amp;
+    NV_FLOAT32 epoch;
+};
+
+
+
+/**
+ * The parts of a TIDE_RECORD that xtwsd publishes, with the enumerated
+ * values already looked up.  A full TIDE_RECORD carries an amplitude and
+ * epoch for every constituent in the file, most of which are zero.  Only
+ * the non-zero ones are kept here, in file order, so anything that walks
+ * the harmonics (the json output, or a predictor) skips the empty slots.
+ */
+struct HarmonicsRecord {
+    TIDE_STATION_HEADER header;
+
+    std::string country;
+    std::string source;
+    std::string comments;
+    std::string notes;
+    std::string stationIdContext;
+    std::string stationId;
+
+    std::string directionUnits;
+    NV_INT32 minDirection;
+    NV_INT32 maxDirection;
+    std::string levelUnits;
+
+    // Reference stations
+    NV_FLOAT32 datumOffset;
+    std::string datum;
+    NV_INT32 zoneOffset;
+    NV_U_BYTE confidence;
+    std::vector<HarmonicConstituent> constituents;
+
+    // Subordinate stations
+    NV_INT32 minTimeAdd;
+    NV_FLOAT32 minLevelAdd;
+    NV_FLOAT32 minLevelMultiply;
+    NV_INT32 maxTimeAdd;
+    NV_FLOAT32 maxLevelAdd;
+    NV_FLOAT32 maxLevelMultiply;
+    NV_INT32 floodBegins;
+    NV_INT32 ebbBegins;
+
+    /**
+     * Constituent names of the harmonics file this record came from,
+     * indexed by HarmonicConstituent::id.  The table is shared by every
+     * record from the same file.
+     */
+    std::shared_ptr<const std::vector<std::string>> constituentNames;
+
+    const std::string& constituentName(const HarmonicConstituent& c) const {
+        return (*constituentNames)[c.id];
+    }
+};
+
+
+
+/**
+ * Returns the decoded harmonics record of the specified station, reading it
+ * from the harmonics file if it is not already cached.  NULL is returned if
+ * the record can not be read.  The number of cached records can be set with
+ * XTWSD_HARMONICS_CACHE.
+ */
+extern std::shared_ptr<const HarmonicsRecord> getHarmonicsRecord(int stationIndex);
+
+
+/**
+ * Drops the cached copy of the specified record.  Call this (with the tide
+ * database session still held) after the record has been written.
+ */
+extern void invalidateHarmonicsRecord(const Dstr& harmonicsFileName, int recordNumber);
+
+
+/**
+ * Drops every cached record, for when the harmonics files are reloaded.
+ * Must be called with the tide database session held.
+ */
+extern void clearHarmonicsRecords();
+
+#endif
@@ -0,0 +1,283 @@
+#include "harmwriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "accesslog.h"
+#include "jsonxt.h"
+
+using namespace std;
+
+
+HarmonicsWriter::HarmonicsWriter(const string& journalFileName) :
+    journalFileName(journalFileName),
+    stopping(false) {
+
+    fd = open(journalFileName.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        cerr << "Could not open journal " << journalFileName << " - changes will not be journaled" << endl;
+    }
+
+    writer = thread(&HarmonicsWriter::writerLoop, this);
+}
+
+
+HarmonicsWriter::~HarmonicsWriter() {
+    {
+        lock_guard<mutex> guard(queueLock);
+        stopping = true;
+    }
+    queueReady.notify_all();
+    writer.join();
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+
+
+int HarmonicsWriter::readJournal(const string& journalFileName, vector<json>& list) {
+
+    vector<string> lines;
+    vector<int> lineNumbers;
+    ifstream in(journalFileName);
+    string line;
+    int lineNum = 0;
+    while (getline(in, line)) {
+        lineNum++;
+        if (line.find_first_not_of(" \t\r") != string::npos) {
+            lines.push_back(line);
+            lineNumbers.push_back(lineNum);
+        }
+    }
+
+    int skipped = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        try {
+            list.push_back(json::parse(lines[i]));
+        }
+        catch (nlohmann::detail::parse_error& err) {
+            if (i + 1 < lines.size()) {
+                // Appends are rolled back when they fail, so this is not
+                // a torn write - the journal has been damaged.  Keep going
+                // so the definitions after it are not lost.
+                logMessage("Skipping bad line " + to_string(lineNumbers[i]) + " of journal " + journalFileName + ": " + err.what());
+                skipped++;
+            }
+            // else a torn last line from a crash during append. It was
+            // never synced, so it was never acknowledged either.
+        }
+    }
+    return skipped;
+}
+
+
+
+int HarmonicsWriter::replay() {
+
+    vector<json> list;
+    readJournal(journalFileName, list);
+
+    if (list.empty()) {
+        return 0;
+    }
+
+    cerr << "Replaying " << list.size() << " journaled station definitions...";
+    try {
+        json results;
+        bool synced = setStationsHarmonicsFromJson(list, results);
+        cerr << results["written"].get<int>() << " written." << endl;
+
+        if (synced) {
+            truncate();
+        }
+    }
+    catch (std::exception& ex) {
+        // Starting without the journaled changes beats not starting at all.
+        // The journal is kept so the definitions can be looked at.
+        cerr << "failed." << endl;
+        logMessage("Could not replay journal " + journalFileName + ": " + ex.what());
+    }
+    return list.size();
+}
+
+
+
+void HarmonicsWriter::write(vector<json>& list, json& results) {
+
+    Request request = { &list, &results, false };
+
+    unique_lock<mutex> guard(queueLock);
+    queue.push_back(&request);
+    queueReady.notify_one();
+
+    requestDone.wait(guard, [&request] { return request.done; });
+}
+
+
+
+void HarmonicsWriter::writerLoop() {
+
+    while (true) {
+        vector<Request*> batch;
+        {
+            unique_lock<mutex> guard(queueLock);
+            queueReady.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+
+            // Everything that piled up while the last batch was being
+            // written goes in this one.
+            batch.assign(queue.begin(), queue.end());
+            queue.clear();
+        }
+
+        if (append(batch)) {
+            // Keep the journal until the database is safely on disk
+            if (apply(batch)) {
+                truncate();
+            }
+        }
+        else {
+            for (Request* pRequest : batch) {
+                (*pRequest->pResults)["statusCode"] = 500;
+                (*pRequest->pResults)["message"] = "Could not write to the journal";
+            }
+        }
+
+        {
+            lock_guard<mutex> guard(queueLock);
+            for (Request* pRequest : batch) {
+                pRequest->done = true;
+            }
+        }
+        requestDone.notify_all();
+    }
+}
+
+
+
+/**
+ * Appends every station definition in batch to the journal and waits for
+ * it to reach the disk.
+ */
+bool HarmonicsWriter::append(const vector<Request*>& batch) {
+
+    if (fd < 0) {
+        return true;
+    }
+
+    string data;
+    for (Request* pRequest : batch) {
+        for (json& j : *pRequest->pList) {
+            data += j.dump();
+            data += "\n";
+        }
+    }
+
+    // Only the writer thread appends, so this is where the batch starts
+    off_t start = lseek(fd, 0, SEEK_END);
+    if (start < 0) {
+        return false;
+    }
+
+    const char* p = data.data();
+    size_t remaining = data.size();
+    while (remaining > 0) {
+        ssize_t n = ::write(fd, p, remaining);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rollback(start);
+            return false;
+        }
+        p += n;
+        remaining -= n;
+    }
+
+    if (fdatasync(fd) != 0) {
+        rollback(start);
+        return false;
+    }
+    return true;
+}
+
+
+
+/**
+ * Removes a failed append from the journal, so a partly written line does
+ * not end up in front of the next batch.
+ */
+void HarmonicsWriter::rollback(off_t start) {
+    if (ftruncate(fd, start) != 0) {
+        logMessage("Could not roll back journal " + journalFileName);
+    }
+}
+
+
+
+/**
+ * Writes all of the requests in batch to the database in one pass, then
+ * hands each request its share of the results.  Returns FALSE if the
+ * database could not be synced.
+ */
+bool HarmonicsWriter::apply(const vector<Request*>& batch) {
+
+    vector<json> list;
+    for (Request* pRequest : batch) {
+        list.insert(list.end(), pRequest->pList->begin(), pRequest->pList->end());
+    }
+
+    json combined;
+    bool synced;
+    try {
+        synced = setStationsHarmonicsFromJson(list, combined);
+    }
+    catch (std::exception& ex) {
+        logMessage(string("Could not write station definitions: ") + ex.what());
+        for (Request* pRequest : batch) {
+            (*pRequest->pResults)["statusCode"] = 500;
+            (*pRequest->pResults)["message"] = string("Could not write station definitions: ") + ex.what();
+        }
+        return false;
+    }
+    json& statuses = combined["results"];
+
+    size_t next = 0;
+    for (Request* pRequest : batch) {
+        json& results = *pRequest->pResults;
+        json mine = json::array();
+        int written = 0;
+        for (size_t i = 0; i < pRequest->pList->size(); i++) {
+            json& status = statuses[next++];
+            if (status["statusCode"].get<int>() == 200) {
+                written++;
+            }
+            mine += status;
+        }
+
+        results["statusCode"] = (written == (int) pRequest->pList->size()) ? 200 : 400;
+        results["version"] = combined["version"];
+        results["written"] = written;
+        results["failed"] = (int) pRequest->pList->size() - written;
+        results["results"] = mine;
+    }
+    return synced;
+}
+
+
+
+void HarmonicsWriter::truncate() {
+    if (fd >= 0) {
+        if (ftruncate(fd, 0) != 0) {
+            logMessage("Could not truncate journal " + journalFileName);
+        }
+    }
+}
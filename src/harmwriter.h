@@ -0,0 +1,122 @@
+#ifndef _harmwriter_h_
+#define _harmwriter_h_
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json_fifo.h"
+
+/**
+  * harmwriter.h
+  * -------------------------
+  * The single, journaled write path for changes to the harmonics database.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * Every change to the harmonics database goes through one writer thread.
+ * The writer takes all of the requests that are waiting, appends their
+ * station definitions to a journal file and syncs it, then writes them to
+ * the database as one batch (see setStationsHarmonicsFromJson()).  Once
+ * the database has been flushed and synced the journal is emptied again.
+ *
+ * If xtwsd dies part way through a batch, the definitions are still in the
+ * journal and replay() writes them again on the next start.  Writing a
+ * definition twice is harmless: updates just write the same values, and
+ * an add that already made it fails as a duplicate.
+ *
+ * The journal only protects against losing changes, not against a damaged
+ * harmonics file.  libtcd rewrites the file in place, so a crash or power
+ * loss in the middle of that can leave it unreadable, and replaying the
+ * journal can not repair it.  Keep a backup of the harmonics file.
+ */
+class HarmonicsWriter {
+
+    public:
+        /**
+         * Uses journalFileName as the journal.  If the journal can not be
+         * opened, changes are written straight to the database.
+         */
+        explicit HarmonicsWriter(const std::string& journalFileName);
+
+        ~HarmonicsWriter();
+
+        /**
+         * Writes any station definitions left in the journal by a previous
+         * run to the database.  Call this before the first write().  Returns
+         * the number of definitions that were replayed.
+         */
+        int replay();
+
+        /**
+         * Queues list for the writer thread and waits until it has been
+         * journaled and written.  results is populated as described in
+         * setStationsHarmonicsFromJson().
+         */
+        void write(std::vector<json>& list, json& results);
+
+        bool isJournaled() const { return fd >= 0; }
+
+        /**
+         * Reads every station definition in the journal journalFileName
+         * into list.  A last line that does not parse is the torn tail of
+         * an append that never finished, and is dropped quietly.  Any other
+         * line that does not parse is logged and skipped.  Returns the
+         * number of lines that were skipped.
+         */
+        static int readJournal(const std::string& journalFileName, std::vector<json>& list);
+
+    private:
+        struct Request {
+            std::vector<json>* pList;
+            json* pResults;
+            bool done;
+        };
+
+        std::string journalFileName;
+        int fd;
+
+        std::mutex queueLock;
+        std::condition_variable queueReady;
+        std::condition_variable requestDone;
+        std::deque<Request*> queue;
+        bool stopping;
+        std::thread writer;
+
+        void writerLoop();
+        bool append(const std::vector<Request*>& batch);
+        void rollback(off_t start);
+        bool apply(const std::vector<Request*>& batch);
+        void truncate();
+
+        HarmonicsWriter(const HarmonicsWriter&) = delete;
+        HarmonicsWriter& operator=(const HarmonicsWriter&) = delete;
+};
+
+#endif
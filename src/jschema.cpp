@@ -1,10 +1,27 @@
 #include "jschema.h"
 #include "_libxtide.h"
+#include "catalog.h"
+#include "dataset.h"
+#include "tidedb.h"
+#include "xtutil.h"
+#include <mutex>
 #include <tcd.h>
 
+using namespace std;
 using namespace libxtide;
 
 
+// The last schema served, the header signature it was built from, and
+// the data version the signature was last checked at. The header only
+// changes along with the data version, so the schema can be served
+// without touching the database until the version moves on.
+static mutex schemaLock;
+static string schemaSignature;
+static string schemaBody;
+static string schemaETag;
+static unsigned long schemaVersion = 0;
+
+
 json& addProperty(json& parent, const char* propertyName, const char* type,  const char* description = NULL) {
 
     json jprop;
@@ -116,10 +133,10 @@ const char *zone_offsetText = "This is the standard time to which epochs are adj
 
 void getJsonSchema(json& schema) {
 
-    StationIndex& stations = Global::stationIndex();
-    StationRef*  pRef = stations[0];
-    if (open_tide_db(pRef->harmonicsFileName.aschar())) {
-        auto db = get_tide_db_header();
+    // Describe the file new stations are written to
+    TideDbSession session(getWriteHarmonicsFile());
+    if (session.isOpen()) {
+        const DB_HEADER_PUBLIC& db = session.header();
 
         schema["$schema"] = "http://json-schema.org/draft-07/schema#";
         schema["type"] = "object";
@@ -214,12 +231,68 @@ void getJsonSchema(json& schema) {
 
 
         schema["additionalProperties"] = false;
-
-        close_tide_db();
     }
 
 }
 
 
 
+/**
+ * Returns a string that changes whenever anything the schema is built
+ * from changes: the file itself, its revision, or the size of one of the
+ * enum tables.  Adding station records does not change it.
+ */
+static string headerSignature(const Dstr& harmonicsFileName, const DB_HEADER_PUBLIC& db) {
+    string sig = harmonicsFileName.aschar();
+    sig += "|";
+    sig += db.version;
+    sig += "|" + to_string(db.major_rev) + "." + to_string(db.minor_rev);
+    sig += "|" + to_string(db.countries);
+    sig += "|" + to_string(db.tzfiles);
+    sig += "|" + to_string(db.level_unit_types);
+    sig += "|" + to_string(db.dir_unit_types);
+    sig += "|" + to_string(db.datum_types);
+    sig += "|" + to_string(db.constituents);
+    return sig;
+}
+
+
+
+bool getJsonSchemaBody(string& body, string& etag) {
 
+    unsigned long version = xtutil::dataVersion();
+    {
+        lock_guard<mutex> guard(schemaLock);
+        if (!schemaBody.empty() && schemaVersion == version) {
+            body = schemaBody;
+            etag = schemaETag;
+            return true;
+        }
+    }
+
+    TideDbSession session(getWriteHarmonicsFile());
+    if (!session.isOpen()) {
+        return false;
+    }
+
+    // A reloaded file may have new enum values with the same header counts
+    string sig = headerSignature(getWriteHarmonicsFile(), session.header());
+    sig += "|" + to_string(currentDataset()->getGeneration());
+
+    lock_guard<mutex> guard(schemaLock);
+    if (sig != schemaSignature) {
+        json schema;
+        getJsonSchema(schema);
+        if (schema.empty()) {
+            return false;
+        }
+        schemaBody = schema.dump(-1, ' ', true);
+        schemaETag = xtutil::makeETag(schemaBody);
+        schemaSignature = sig;
+    }
+    schemaVersion = version;
+
+    body = schemaBody;
+    etag = schemaETag;
+    return true;
+}
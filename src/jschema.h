@@ -2,6 +2,7 @@
 #define _jschema_H
 
 #include <memory>
+#include <string>
 #include "json_fifo.h"
 
 /**
@@ -43,4 +44,14 @@
 extern void getJsonSchema(json& schema);
 
 
+
+/**
+ * Returns the serialized JSON Schema in body along with its ETag.  The schema
+ * is built once and only rebuilt when the database header (and with it one of
+ * the enum tables the schema lists) changes.  FALSE is returned if the
+ * XTide data file can not be opened.
+ */
+extern bool getJsonSchemaBody(std::string& body, std::string& etag);
+
+
 #endif
\ No newline at end of file
@@ -1,9 +1,21 @@
 #include "jsonxt.h"
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
 #include <string>
-
+#include <vector>
+
+#include "accesslog.h"
+#include "catalog.h"
+#include "dataset.h"
+#include "diagnostics.h"
+#include "harmrecord.h"
+#include "metrics.h"
 #include "xtutil.h"
-#include "stdcapture.h"
+#include "tidedb.h"
+#include "workpool.h"
 
 using namespace std;
 using namespace libxtide;
@@ -98,22 +110,16 @@ void tojson(Station* pStat, StationRef* pRef, json& j) {
  * Populates the member j.constituents with
  * the constituent values from the specified tide record
  */
-void dumpHarmonicConstituents(TIDE_RECORD& rec, json& j) {
-
-   DB_HEADER_PUBLIC db = get_tide_db_header();
+void dumpHarmonicConstituents(const HarmonicsRecord& rec, json& j) {
 
    json clist = json::array();
 
-   for (int c = 0; c < db.constituents; c++) {
+   for (const HarmonicConstituent& c : rec.constituents) {
         json jc;
-        double amp = rec.amplitude[c];
-        double epoch = rec.epoch[c];
-        if (amp != 0.0 || epoch != 0.0) {
-            jc["name"] = get_constituent(c);
-            jc["amp"] = amp;
-            jc["epoch"] = epoch;
-            clist += jc;
-        }
+        jc["name"] = rec.constituentName(c);
+        jc["amp"] = c.amp;
+        jc["epoch"] = c.epoch;
+        clist += jc;
    }
 
    j["constituents"] = clist;
@@ -124,10 +130,10 @@ void dumpHarmonicConstituents(TIDE_RECORD& rec, json& j) {
  * Populates the json object j with harmonic data
  * from the tide record rec.
  */
-void dumpHarmonicType1(TIDE_RECORD& rec, json& j) {
-   j["datumOffset"] = rec.datum_offset;
-   j["datum"] = get_datum(rec.datum);
-   j["zoneOffset"] = rec.zone_offset;
+void dumpHarmonicType1(const HarmonicsRecord& rec, json& j) {
+   j["datumOffset"] = rec.datumOffset;
+   j["datum"] = rec.datum;
+   j["zoneOffset"] = rec.zoneOffset;
    j["confidence"] = rec.confidence;
 
    // These values are always zero in every XTide record
@@ -144,83 +150,124 @@ void dumpHarmonicType1(TIDE_RECORD& rec, json& j) {
  * Populates the json object j with tidal offset data
  * from the tide record rec.
  */
-void dumpHarmonicType2(StationRef* pRef, TIDE_RECORD& rec, json& j) {
+void dumpHarmonicType2(StationRef* pRef, const HarmonicsRecord& rec, json& j) {
 
     // For definitions of what these values mean, see https://flaterco.com/xtide/harmonics.html
-    j["minTimeAdd"] = rec.min_time_add;
-    j["minLevelAdd"] = rec.min_level_add;
-    j["minLevelMultiply"] = rec.min_level_multiply;
-    j["maxTimeAdd"] = rec.max_time_add;
-    j["maxLevelAdd"] = rec.max_level_add;
-    j["maxLevelMultiply"] = rec.max_level_multiply;
+    j["minTimeAdd"] = rec.minTimeAdd;
+    j["minLevelAdd"] = rec.minLevelAdd;
+    j["minLevelMultiply"] = rec.minLevelMultiply;
+    j["maxTimeAdd"] = rec.maxTimeAdd;
+    j["maxLevelAdd"] = rec.maxLevelAdd;
+    j["maxLevelMultiply"] = rec.maxLevelMultiply;
 
     if (pRef->isCurrent) {
-        j["floodBegins"] = rec.flood_begins;
-        j["ebbBegins"] = rec.ebb_begins;    
+        j["floodBegins"] = rec.floodBegins;
+        j["ebbBegins"] = rec.ebbBegins;    
     }
 }
 
 
 void getStationHarmonicsAsJson(int stationIndex, json& j) {
 
-    StationIndex& stations = Global::stationIndex();
+    StationIndex& stations = currentStations();
     StationRef*  pRef = stations[stationIndex];
-    if (open_tide_db(pRef->harmonicsFileName.aschar())) {
-        TIDE_RECORD rec;
-        if (read_tide_record(pRef->recordNumber, &rec) != -1) {
-
-            // Uncomment below to display tide data on stderr...
-            // dump_tide_record(&rec);
-
-            tojson(pRef, j);
-
-            j["notes"] = rec.notes;
-            j["comments"] = rec.comments;
-            j["country"] = get_country(rec.country);
-
-            // flow is a structure that exists only for non-tidal current stations
-            if (pRef->isCurrent) {
-                json flow;
-                flow["units"] = get_dir_units(rec.direction_units);
-                flow["ebbDirection"] = rec.min_direction;
-                flow["floodDirection"] = rec.max_direction;
-                j["flow"] = flow;
-            }
+    shared_ptr<const HarmonicsRecord> pRec = getHarmonicsRecord(stationIndex);
+    if (pRec) {
+        const HarmonicsRecord& rec = *pRec;
+
+        tojson(pRef, j);
+
+        j["notes"] = rec.notes;
+        j["comments"] = rec.comments;
+        j["country"] = rec.country;
+
+        // flow is a structure that exists only for non-tidal current stations
+        if (pRef->isCurrent) {
+            json flow;
+            flow["units"] = rec.directionUnits;
+            flow["ebbDirection"] = rec.minDirection;
+            flow["floodDirection"] = rec.maxDirection;
+            j["flow"] = flow;
+        }
 
-            j["levelUnits"] = get_level_units(rec.level_units);
+        j["levelUnits"] = rec.levelUnits;
 
-            json source;
-            source["name"] = rec.source;
-            source["context"] = rec.station_id_context;
-            source["stationId"] = rec.station_id;
-            j["source"] = source;
+        json source;
+        source["name"] = rec.source;
+        source["context"] = rec.stationIdContext;
+        source["stationId"] = rec.stationId;
+        j["source"] = source;
 
-            if (pRef->isReferenceStation) {
-                json ref;
-                dumpHarmonicType1(rec, ref);
-                j["harmonics"] = ref;
-            }
-            else {
-                json sub;
-                dumpHarmonicType2(pRef, rec, sub);
-                sub["referenceStationId"] = xtutil::getStationId(pRef->harmonicsFileName, rec.header.reference_station);
-                j["offsets"] = sub;
+        if (pRef->isReferenceStation) {
+            json ref;
+            dumpHarmonicType1(rec, ref);
+            j["harmonics"] = ref;
+        }
+        else {
+            json sub;
+            dumpHarmonicType2(pRef, rec, sub);
+            sub["referenceStationId"] = xtutil::getStationId(pRef->harmonicsFileName, rec.header.reference_station);
+            j["offsets"] = sub;
+        }
+    }
+
+}
+
+
+
+bool exportStationHarmonics(unsigned long since, size_t offset, size_t limit,
+                            string& out, HarmonicsExport& info) {
+
+    shared_ptr<Dataset> dataset = currentDataset();
+    StationIndex& stations = dataset->stations();
+
+    info.version = dataset->version.load();
+
+    vector<int> selected;
+    vector<string> changedIds;
+    // A since newer than the version being exported came from another run
+    // of the server, so it says nothing about what the client has.
+    info.full = (since == 0 || since > info.version || !dataset->changesSince(since, changedIds));
+    if (info.full) {
+        selected.reserve(stations.size());
+        for (unsigned long s = 0; s < stations.size(); s++) {
+            selected.push_back(s);
+        }
+    }
+    else {
+        for (const string& stationId : changedIds) {
+            int stationIndex = xtutil::getStationIndex(stationId);
+            if (xtutil::stationIndexValid(stationIndex)) {
+                selected.push_back(stationIndex);
             }
         }
+        sort(selected.begin(), selected.end());
+    }
 
-        // // For exploring the database, uncomment below and modify.
-        // for (int s = 0; s < stations.size(); s++) {
-        //     StationRef*  pRef = stations[s];
-        //     if (read_tide_record(pRef->recordNumber, &rec) != -1 &&
-        //         pRef->isCurrent && !pRef->isReferenceStation &&
-        //         (rec.ebb_begins != 2560 || rec.flood_begins != 2560) ) {
-        //         printf("Flow direction found for %d\n", s);
-        //     }
-        // } // for
+    info.total = selected.size();
+    info.count = 0;
 
-        close_tide_db();
+    size_t end = selected.size();
+    if (limit > 0 && offset + limit < end) {
+        end = offset + limit;
     }
 
+    for (size_t i = offset; i < end; i++) {
+        if (WorkPool::cancelled()) {
+            return false;
+        }
+
+        // One station at a time, so only the output grows with the export
+        json j;
+        getStationHarmonicsAsJson(selected[i], j);
+        if (!j.empty()) {
+            out += j.dump(-1, ' ', true);
+            out += '\n';
+            info.count++;
+        }
+    }
+
+    return true;
 }
 
 
@@ -238,7 +285,7 @@ NV_INT32 getEnumProperty(json& j, const char* propertyName, std::function<NV_INT
 
 int updateStationIndex(TIDE_RECORD& rec) {
 
-    int id = Global::stationIndex().size();
+    int id = currentStations().size();
 
 
 
@@ -258,259 +305,531 @@ string fmtString(const char* fmt, int num) {
 
 #include "jutil.hpp"
 
-bool setStationHarmonicsFromJson(json& j, json& status) {
 
-    StationIndex& stations = Global::stationIndex();
+/**
+ * A station definition decoded from json, ready to be written
+ */
+struct StationWrite {
+    TIDE_RECORD rec;
 
-    StationRef*  pRef = NULL;
-    int recordNum = -1;
-    int stationIndex = -1;
+    // The station being updated, or NULL for a new station
+    StationRef* pRef;
+    int stationIndex;
+    int recordNum;
 
-    if (j.count("index") && j["index"].is_number()) {
-        // An index was specified - this is possibly an update?
-        stationIndex = j["index"].get<int>();
-    }
+    // The file the record is written to
+    Dstr harmonicsFileName;
 
-    if (j.count("id")) {
-        stationIndex = xtutil::getStationIndex(j["id"].get<string>());
+    std::string stationId;
+    std::string refStationId;
+    std::string stationType;
+};
+
+
+
+/**
+ * Decodes and validates the station definition in j.  Existing records are
+ * read in first so that properties missing from j keep their old values.
+ * batchIds holds the ids of new stations that come before this one in the
+ * same batch (and so may be used as a reference station).  FALSE is
+ * returned (and status populated) if the definition can not be written.
+ */
+/**
+ * Returns TRUE if property is missing from j or is of the type that
+ * isType() checks for.  Otherwise error is set.
+ */
+static bool checkType(const json& j, const char* property, bool (json::*isType)() const,
+                      const char* typeName, const string& path, string& error) {
+    if (!j.count(property) || (j[property].*isType)()) {
+        return true;
     }
+    error = "The property '" + path + property + "' must be " + typeName;
+    return false;
+}
+
 
-    if (xtutil::stationIndexValid(stationIndex)) {
-        pRef = stations[stationIndex];
-        recordNum = pRef->recordNumber;
+static bool checkStrings(const json& j, const vector<const char*>& properties, const string& path, string& error) {
+    for (const char* property : properties) {
+        if (!checkType(j, property, &json::is_string, "a string", path, error)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    if (recordNum == -1) {
-        // Add new records to the first database file listed
-        pRef = stations[0];
+
+static bool checkObjects(const json& j, const vector<const char*>& properties, const string& path, string& error) {
+    for (const char* property : properties) {
+        if (!checkType(j, property, &json::is_object, "an object", path, error)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    if (open_tide_db(pRef->harmonicsFileName.aschar())) {
 
-        auto db = get_tide_db_header();
 
-        TIDE_RECORD rec;
+bool checkStationJson(const json& j, string& error) {
 
-        string stationId;
+    if (!j.is_object()) {
+        error = "A station definition must be an object";
+        return false;
+    }
 
-        // Initialize rec with old data, or blank for new records...
-        if (recordNum >= 0) {
-            if (read_tide_record(recordNum, &rec) == -1) {
-                status["statusCode"] = 500;
-                status["message"] = fmtString("Could not read tide record %d", stationIndex);
-                return false;
-            }
+    if (!checkStrings(j, { "id", "name", "comments", "notes", "timezone", "country", "levelUnits", "type" }, "", error) ||
+        !checkObjects(j, { "source", "position", "flow", "harmonics", "offsets" }, "", error)) {
+        return false;
+    }
+
+    if (j.count("source") && !checkStrings(j["source"], { "name", "context", "stationId" }, "source.", error)) {
+        return false;
+    }
+    if (j.count("flow") && !checkStrings(j["flow"], { "units" }, "flow.", error)) {
+        return false;
+    }
+    if (j.count("offsets") && !checkStrings(j["offsets"], { "referenceStationId" }, "offsets.", error)) {
+        return false;
+    }
+
+    if (j.count("harmonics")) {
+        const json& harm = j["harmonics"];
+        if (!checkStrings(harm, { "datum" }, "harmonics.", error) ||
+            !checkType(harm, "constituents", &json::is_array, "an array", "harmonics.", error)) {
+            return false;
         }
-        else {
-            memset(&rec, 0, sizeof(rec));
+        if (harm.count("constituents")) {
+            for (const json& cst : harm["constituents"]) {
+                if (!cst.is_object()) {
+                    error = "Each of 'harmonics.constituents' must be an object";
+                    return false;
+                }
+                if (!checkStrings(cst, { "name" }, "harmonics.constituents.", error)) {
+                    return false;
+                }
+            }
         }
+    }
 
-        rec.restriction = find_restriction("Public domain");
+    return true;
+}
 
-        setString(rec.header.name , sizeof(rec.header.name), j, "name");
-        rec.header.record_type = getBool(j, "referenceStation") ? TIDE_RECORD_TYPE::REFERENCE_STATION : TIDE_RECORD_TYPE::SUBORDINATE_STATION;
-        rec.header.tzfile = getEnumProperty(j, "timezone", find_tzfile);
-        rec.country = getEnumProperty(j, "country", find_country);
-        rec.level_units = getEnumProperty(j, "levelUnits", find_level_units);
-        setString(rec.comments , sizeof(rec.comments), j, "comments");
-        setString(rec.notes , sizeof(rec.notes), j, "notes");
 
 
-        if (j.count("source")) {
-            json& s = j["source"];
-            setString(rec.source, sizeof(rec.source), s, "name");
-            setString(rec.station_id_context, sizeof(rec.station_id_context), s, "context");
-            setString(rec.station_id, sizeof(rec.station_id), s, "stationId");
-            stationId = rec.station_id_context;
-            stationId += ":";
-            stationId += rec.station_id;
-        }
+static bool decodeStationJson(json& j, StationWrite& w, json& status, const set<string>& batchIds) {
+
+    StationIndex& stations = currentStations();
+
+    w.pRef = NULL;
+    w.recordNum = -1;
+    w.stationIndex = -1;
+
+    if (j.count("index") && j["index"].is_number()) {
+        // An index was specified - this is possibly an update?
+        w.stationIndex = j["index"].get<int>();
+    }
+
+    if (j.count("id")) {
+        w.stationIndex = xtutil::getStationIndex(j["id"].get<string>());
+    }
+
+    if (xtutil::stationIndexValid(w.stationIndex)) {
+        w.pRef = stations[w.stationIndex];
+        w.recordNum = w.pRef->recordNumber;
+        w.harmonicsFileName = w.pRef->harmonicsFileName;
+    }
+    else {
+        w.harmonicsFileName = getWriteHarmonicsFile();
+    }
+
+    TideDbSession session(w.harmonicsFileName);
+    if (!session.isOpen()) {
+        status["statusCode"] = 500;
+        status["message"] = "Could not open database";
+        return false;
+    }
+
+    TIDE_RECORD& rec = w.rec;
 
-        if (j.count("position")) {
-            json& pos = j["position"];
-            rec.header.latitude = getNum(pos, "lat");
-            rec.header.longitude = getNum(pos, "long");
+    // Initialize rec with old data, or blank for new records...
+    if (w.recordNum >= 0) {
+        countEvent(TCD_READ);
+        if (read_tide_record(w.recordNum, &rec) == -1) {
+            status["statusCode"] = 500;
+            status["message"] = fmtString("Could not read tide record %d", w.stationIndex);
+            return false;
         }
+    }
+    else {
+        memset(&rec, 0, sizeof(rec));
+    }
 
-        string stationType = getStr(j, "type");
+    rec.restriction = find_restriction("Public domain");
+
+    setString(rec.header.name , sizeof(rec.header.name), j, "name");
+    rec.header.record_type = getBool(j, "referenceStation") ? TIDE_RECORD_TYPE::REFERENCE_STATION : TIDE_RECORD_TYPE::SUBORDINATE_STATION;
+    rec.header.tzfile = getEnumProperty(j, "timezone", find_tzfile);
+    rec.country = getEnumProperty(j, "country", find_country);
+    rec.level_units = getEnumProperty(j, "levelUnits", find_level_units);
+    setString(rec.comments , sizeof(rec.comments), j, "comments");
+    setString(rec.notes , sizeof(rec.notes), j, "notes");
+
+
+    if (j.count("source")) {
+        json& s = j["source"];
+        setString(rec.source, sizeof(rec.source), s, "name");
+        setString(rec.station_id_context, sizeof(rec.station_id_context), s, "context");
+        setString(rec.station_id, sizeof(rec.station_id), s, "stationId");
+        w.stationId = rec.station_id_context;
+        w.stationId += ":";
+        w.stationId += rec.station_id;
+    }
 
-        if (stationType == "current") {
-            if (j.count("flow")) {
-                json& flow = j["flow"];
+    if (j.count("position")) {
+        json& pos = j["position"];
+        rec.header.latitude = getNum(pos, "lat");
+        rec.header.longitude = getNum(pos, "long");
+    }
 
-                rec.direction_units = getEnumProperty(flow, "units", find_dir_units);
-                rec.min_direction = getInt(flow, "ebbDirection");
-                rec.max_direction = getInt(flow, "floodDirection");
-            }
+    w.stationType = getStr(j, "type");
+
+    if (w.stationType == "current") {
+        if (j.count("flow")) {
+            json& flow = j["flow"];
+
+            rec.direction_units = getEnumProperty(flow, "units", find_dir_units);
+            rec.min_direction = getInt(flow, "ebbDirection");
+            rec.max_direction = getInt(flow, "floodDirection");
         }
-        else {
-            // Use the "NULL" values for tide stations
-            rec.min_direction = 361;
-            rec.max_direction = 361;
-        }
-
-        if (rec.header.record_type == TIDE_RECORD_TYPE::REFERENCE_STATION) {
-            rec.header.reference_station = -1;
-            // A reference station requires harmonics definitions
-            if (j.count("harmonics")) {
-                json& harm = j["harmonics"];
-                rec.confidence = getInt(harm, "confidence");
-                rec.datum = getEnumProperty(harm, "datum", find_datum);
-                rec.datum_offset = getNum(harm, "datumOffset");
-                rec.zone_offset = getInt(harm, "zoneOffset");
-                if (harm.count("constituents")) {
-                    json& csts = harm["constituents"];
-                    for (auto& cst : csts) {
-                        int i = getEnumProperty(cst, "name", find_constituent);
-                        if (i >= 0) {
-                            rec.amplitude[i] = getNum(cst, "amp");
-                            rec.epoch[i] = getNum(cst, "epoch");
-                        }
-                    } // for
-                }
-                else {
-                    status["statusCode"] = 400;
-                    status["message"] = "Reference stations must contain harmonics.constituents data";
-                    return false;
-                }
+    }
+    else {
+        // Use the "NULL" values for tide stations
+        rec.min_direction = 361;
+        rec.max_direction = 361;
+    }
+
+    if (rec.header.record_type == TIDE_RECORD_TYPE::REFERENCE_STATION) {
+        rec.header.reference_station = -1;
+        // A reference station requires harmonics definitions
+        if (j.count("harmonics")) {
+            json& harm = j["harmonics"];
+            rec.confidence = getInt(harm, "confidence");
+            rec.datum = getEnumProperty(harm, "datum", find_datum);
+            rec.datum_offset = getNum(harm, "datumOffset");
+            rec.zone_offset = getInt(harm, "zoneOffset");
+            if (harm.count("constituents")) {
+                json& csts = harm["constituents"];
+                for (auto& cst : csts) {
+                    int i = getEnumProperty(cst, "name", find_constituent);
+                    if (i >= 0) {
+                        rec.amplitude[i] = getNum(cst, "amp");
+                        rec.epoch[i] = getNum(cst, "epoch");
+                    }
+                } // for
             }
             else {
                 status["statusCode"] = 400;
-                status["message"] = "Reference stations must contain harmonics data";
+                status["message"] = "Reference stations must contain harmonics.constituents data";
                 return false;
             }
         }
         else {
-            // Subordinate stations requires "offsets"
-            if (j.count("offsets")) {
-                json& off = j["offsets"];
-
-                string refStationId = getStr(off, "referenceStationId");
-                int refStationNdx = xtutil::getStationIndex(refStationId);
-                rec.header.reference_station = refStationNdx;
-                rec.min_time_add = getInt(off, "minTimeAdd");
-                rec.min_level_add = getNum(off, "minLevelAdd");
-                rec.min_level_multiply = getNum(off, "minLevelMultiply");
-
-                rec.max_time_add = getInt(off, "maxTimeAdd");
-                rec.max_level_add = getNum(off, "maxLevelAdd");
-                rec.max_level_multiply = getNum(off, "maxLevelMultiply");
-
-                if (stationType == "current") {
-                    rec.flood_begins = getInt(off, "floodBegins");
-                    rec.ebb_begins = getInt(off, "ebbBegins");
-                }
-                else {
-                    // Use the "NULL" value for tide stations...
-                    rec.flood_begins = NULLSLACKOFFSET;
-                    rec.ebb_begins = NULLSLACKOFFSET;
-                }
-            }
-            else {
-                status["statusCode"] = 400;
-                status["message"] = "Subordinate stations must contain offsets data";
-                return false;
-            }
-        }
-
-        if (stationId.empty()) {
             status["statusCode"] = 400;
-            status["message"] = "The properties 'source.context' and 'source.stationId' must be set";
+            status["message"] = "Reference stations must contain harmonics data";
             return false;
         }
+    }
+    else {
+        // Subordinate stations requires "offsets"
+        if (j.count("offsets")) {
+            json& off = j["offsets"];
 
-        int preExistingIndex = xtutil::getStationIndex(stationId);
-
-        StdCapture captureOutput;
-        captureOutput.beginCapture();
-        if (recordNum >= 0) {
-            // Update an existing record...
-            if (stationIndex != preExistingIndex) {
+            w.refStationId = getStr(off, "referenceStationId");
+            if (batchIds.count(w.refStationId) == 0 &&
+                !xtutil::stationIndexValid(xtutil::getStationIndex(w.refStationId))) {
                 status["statusCode"] = 400;
-                string msg = stationId;
-                msg += " has a pre-existing index of ";
-                msg += to_string(preExistingIndex);
-                msg += " which does not match the specified index ";
-                msg += to_string(stationIndex);
-                status["message"] = msg;
+                status["message"] = "Unknown referenceStationId " + w.refStationId;
                 return false;
             }
 
-            if (update_tide_record(recordNum, &rec, &db)) {
-                status["statusCode"] = 200;
-                status["index"] = stationIndex;
-                close_tide_db();
+            rec.min_time_add = getInt(off, "minTimeAdd");
+            rec.min_level_add = getNum(off, "minLevelAdd");
+            rec.min_level_multiply = getNum(off, "minLevelMultiply");
+
+            rec.max_time_add = getInt(off, "maxTimeAdd");
+            rec.max_level_add = getNum(off, "maxLevelAdd");
+            rec.max_level_multiply = getNum(off, "maxLevelMultiply");
 
-                return true;
+            if (w.stationType == "current") {
+                rec.flood_begins = getInt(off, "floodBegins");
+                rec.ebb_begins = getInt(off, "ebbBegins");
             }
             else {
-                status["statusCode"] = 500;
-                string msg = fmtString("Could not update database record number %d:\n", recordNum);
-                msg += captureOutput.getCapture();
-                status["message"] = msg;
-                if (captureOutput.getCapture().find("error") != string::npos) {
-                    status["statusCode"] = 400;
-                }
-                return false;
+                // Use the "NULL" value for tide stations...
+                rec.flood_begins = NULLSLACKOFFSET;
+                rec.ebb_begins = NULLSLACKOFFSET;
             }
         }
         else {
-            // Add a new record...
+            status["statusCode"] = 400;
+            status["message"] = "Subordinate stations must contain offsets data";
+            return false;
+        }
+    }
+
+    if (w.stationId.empty()) {
+        status["statusCode"] = 400;
+        status["message"] = "The properties 'source.context' and 'source.stationId' must be set";
+        return false;
+    }
+
+    int preExistingIndex = xtutil::getStationIndex(w.stationId);
+
+    if (w.recordNum >= 0) {
+        // Update an existing record...
+        if (w.stationIndex != preExistingIndex) {
+            status["statusCode"] = 400;
+            string msg = w.stationId;
+            msg += " has a pre-existing index of ";
+            msg += to_string(preExistingIndex);
+            msg += " which does not match the specified index ";
+            msg += to_string(w.stationIndex);
+            status["message"] = msg;
+            return false;
+        }
+    }
+    else {
+        // Add a new record...
+        if (preExistingIndex != -1 || batchIds.count(w.stationId)) {
+            status["statusCode"] = 400;
+            string msg = "Station id ";
+            msg += w.stationId;
+            msg += " already exists in database";
             if (preExistingIndex != -1) {
-                status["statusCode"] = 400;
-                string msg = "Station id ";
-                msg += stationId;
-                msg += " already exists in database (index  ";
+                msg += " (index  ";
                 msg += to_string(preExistingIndex);
                 msg += "). Updates require 'index' property to be specifid";
-                status["message"] = msg;
-                return false;
             }
+            status["message"] = msg;
+            return false;
+        }
+    }
+
+    return true;
+}
 
-            if (add_tide_record(&rec, &db)) {
-                // Update libxtide's interal C++ structure for the newly added record...
-                StationRef *sr = new StationRef (pRef->harmonicsFileName,
-                                                db.number_of_records - 1,
-                                                rec.header.name,
-                                                ((rec.header.latitude != 0.0 || rec.header.longitude != 0.0) ?
-                                                Coordinates(rec.header.latitude, rec.header.longitude) : Coordinates()),
-                                                (char *)get_tzfile(rec.header.tzfile),
-                                                (rec.header.record_type == REFERENCE_STATION),
-                                                stationType == "current");
-
-                Global::stationIndex().push_back(sr);
-                Global::stationIndex().sort();
-                Global::stationIndex().setRootStationIndexIndices();
-                sr->rootStationIndexIndex = xtutil::getStationIndex(sr->harmonicsFileName, sr->recordNumber);
-
-                status["statusCode"] = 200;
-                status["index"] = sr->rootStationIndexIndex;
-
-                xtutil::invalidateContextMap();
-
-                close_tide_db();
-                return true;
+
+
+/**
+ * Writes a decoded station to its harmonics file.  New stations are added
+ * to the end of the station index of dataset (see Dataset::addStation()),
+ * so the index of every other station stays the same.  batchRecords maps
+ * the ids of stations added earlier in the same batch to their record
+ * numbers, and the new station is added to it.  The caller must flush the
+ * session after writing.
+ */
+static bool writeStation(StationWrite& w, json& status, map<string, int>& batchRecords,
+                         Dataset& dataset) {
+
+    TideDbSession session(w.harmonicsFileName);
+    if (!session.isOpen()) {
+        status["statusCode"] = 500;
+        status["message"] = "Could not open database";
+        return false;
+    }
+
+    DB_HEADER_PUBLIC db = session.header();
+    TIDE_RECORD& rec = w.rec;
+
+    if (rec.header.record_type != TIDE_RECORD_TYPE::REFERENCE_STATION) {
+        // libtcd refers to the reference station by its record number, so
+        // it has to be in the same harmonics file.
+        const char* refFileName = NULL;
+        auto it = batchRecords.find(w.refStationId);
+        if (it != batchRecords.end()) {
+            // Stations added in this batch went into the write file
+            rec.header.reference_station = it->second;
+            refFileName = getWriteHarmonicsFile().aschar();
+        }
+        else {
+            int refStationNdx = xtutil::getStationIndex(w.refStationId);
+            if (xtutil::stationIndexValid(refStationNdx)) {
+                StationRef* pRefStation = currentStations()[refStationNdx];
+                rec.header.reference_station = pRefStation->recordNumber;
+                refFileName = pRefStation->harmonicsFileName.aschar();
             }
             else {
-                status["statusCode"] = 500;
-                string msg = "Could not add new database record:\n";
-                msg += captureOutput.getCapture();
-                status["message"] = msg;
-                if (captureOutput.getCapture().find("error") != string::npos) {
-                    status["statusCode"] = 400;
-                }
-                return false;
+                rec.header.reference_station = -1;
             }
         }
 
-        close_tide_db();
+        if (refFileName != NULL && strcmp(refFileName, w.harmonicsFileName.aschar()) != 0) {
+            status["statusCode"] = 400;
+            status["message"] = "Reference station " + w.refStationId + " is in " + refFileName +
+                                ", but the station is in " + w.harmonicsFileName.aschar() +
+                                ". A station and its reference station must be in the same harmonics file.";
+            return false;
+        }
+    }
 
-        return true;
+    // Check the record ourselves first, so problems can be reported to the
+    // client. libtcd only prints them to stderr.
+    DiagnosticCapture diagnostics;
+    if (!checkTideRecord(rec, db)) {
+        status["statusCode"] = 400;
+        status["message"] = "Invalid station definition:\n" + diagnostics.getCapture();
+        return false;
+    }
+
+    if (w.recordNum >= 0) {
+        // Update an existing record...
+        if (update_tide_record(w.recordNum, &rec, &db)) {
+            session.setHeader(db);
+            invalidateHarmonicsRecord(w.harmonicsFileName, w.recordNum);
+            status["statusCode"] = 200;
+            status["index"] = w.stationIndex;
+            return true;
+        }
+        else {
+            status["statusCode"] = 500;
+            status["message"] = fmtString("Could not update database record number %d. See the server log for details.", w.recordNum);
+            return false;
+        }
     }
     else {
-        status["statusCode"] = 500;
-        status["message"] = "Could not open database";
-        return false;
+        // Add a new record...
+        if (add_tide_record(&rec, &db)) {
+            // Later stations in the batch may refer to this one
+            session.setHeader(db);
+
+            // Update libxtide's interal C++ structure for the newly added record...
+            w.recordNum = db.number_of_records - 1;
+            StationRef *sr = new StationRef (w.harmonicsFileName,
+                                            w.recordNum,
+                                            rec.header.name,
+                                            ((rec.header.latitude != 0.0 || rec.header.longitude != 0.0) ?
+                                            Coordinates(rec.header.latitude, rec.header.longitude) : Coordinates()),
+                                            (char *)get_tzfile(rec.header.tzfile),
+                                            (rec.header.record_type == REFERENCE_STATION),
+                                            w.stationType == "current");
+
+            // New stations go on the end, so no existing station's index
+            // changes.
+            int stationIndex = dataset.addStation(sr, w.stationId);
+            batchRecords[w.stationId] = w.recordNum;
+
+            status["statusCode"] = 200;
+            status["index"] = stationIndex;
+            return true;
+        }
+        else {
+            status["statusCode"] = 500;
+            status["message"] = "Could not add new database record. See the server log for details.";
+            return false;
+        }
+    }
+}
+
+
+
+bool setStationHarmonicsFromJson(json& j, json& status) {
+
+    vector<json> list;
+    list.push_back(j);
+
+    json results;
+    setStationsHarmonicsFromJson(list, results);
+
+    status = results["results"][0];
+    return status["statusCode"].get<int>() == 200;
+}
+
+
+
+bool setStationsHarmonicsFromJson(vector<json>& list, json& results) {
+
+    // Hold the database for the whole batch, so no one sees it half written
+    TideDbSession session(getWriteHarmonicsFile());
+
+    vector<StationWrite> writes(list.size());
+    vector<json> statuses(list.size());
+    vector<bool> valid(list.size());
+
+    // Validate everything before writing anything
+    set<string> batchIds;
+    for (size_t i = 0; i < list.size(); i++) {
+        string error;
+        if (!checkStationJson(list[i], error)) {
+            // Requests are checked before they are journaled, but a journal
+            // written by an older version may still hold bad definitions.
+            statuses[i]["statusCode"] = 400;
+            statuses[i]["message"] = error;
+            valid[i] = false;
+            continue;
+        }
+        try {
+            valid[i] = decodeStationJson(list[i], writes[i], statuses[i], batchIds);
+        }
+        catch (std::exception& ex) {
+            statuses[i]["statusCode"] = 400;
+            statuses[i]["message"] = string("Invalid station definition: ") + ex.what();
+            valid[i] = false;
+        }
+        if (valid[i] && writes[i].recordNum < 0) {
+            batchIds.insert(writes[i].stationId);
+        }
+    }
+
+    // Requests may be using the current dataset, so new stations go into
+    // a copy of it that is made current once the batch is written.
+    shared_ptr<Dataset> dataset = currentDataset();
+    for (size_t i = 0; i < list.size(); i++) {
+        if (valid[i] && writes[i].recordNum < 0) {
+            dataset = dataset->copy();
+            break;
+        }
+    }
+
+    map<string, int> batchRecords;
+    set<string> changedFiles;
+    vector<string> changedIds;
+    bool referencesChanged = false;
+    int written = 0;
+    {
+        DatasetPin pin(dataset);
+        for (size_t i = 0; i < list.size(); i++) {
+            if (valid[i]) {
+                if (writeStation(writes[i], statuses[i], batchRecords, *dataset)) {
+                    written++;
+                    changedIds.push_back(writes[i].stationId);
+                    changedFiles.insert(writes[i].harmonicsFileName.aschar());
+                    if (writes[i].pRef != NULL && writes[i].pRef->isReferenceStation) {
+                        referencesChanged = true;
+                    }
+                }
+            }
+        }
+    }
+
+    bool synced = true;
+    for (const string& fileName : changedFiles) {
+        TideDbSession fileSession(fileName.c_str());
+        if (!fileSession.flush()) {
+            logMessage("Could not sync " + fileName);
+            synced = false;
+        }
+    }
+
+    if (written > 0) {
+        if (dataset != currentDataset()) {
+            makeCurrent(dataset);
+        }
+        dataset->publishChanges(changedIds, referencesChanged);
     }
 
+    results["statusCode"] = (written == (int) list.size()) ? 200 : 400;
+    results["version"] = dataset->version.load();
+    results["written"] = written;
+    results["failed"] = (int) list.size() - written;
+    results["results"] = statuses;
+    return synced;
 }
@@ -2,6 +2,8 @@
 #define _jsonxt_H_
 
 #include <memory>
+#include <string>
+#include <vector>
 #include "json_fifo.h"
 
 #include "_libxtide.h"
@@ -91,6 +93,48 @@ extern void getStationHarmonicsAsJson(int stationId, json& j);
 
 
 
+/**
+ * Describes the result of exportStationHarmonics()
+ */
+struct HarmonicsExport {
+    // The data version the export was taken from
+    unsigned long version;
+
+    // TRUE if every station was selected, FALSE if only changed ones were
+    bool full;
+
+    // The number of stations selected, before offset and limit were applied
+    size_t total;
+
+    // The number of stations written
+    size_t count;
+};
+
+
+/**
+ * Appends the harmonics of every station to out as newline delimited json,
+ * one getStationHarmonicsAsJson() object per line, in station index order.
+ * If since is non-zero, only the stations that have changed since that data
+ * version are exported (unless since is older than the loaded data or
+ * newer than the current version, in which case every station is).  offset and limit select one page of the
+ * export; a limit of zero means no limit.  FALSE is returned if the work
+ * was cancelled part way through (see WorkPool::cancelled()).
+ */
+extern bool exportStationHarmonics(unsigned long since, size_t offset, size_t limit,
+                                   std::string& out, HarmonicsExport& info);
+
+
+
+/**
+ * Checks that every property of the station definition j that is present
+ * has the type setStationsHarmonicsFromJson() expects, so decoding it can
+ * not throw.  FALSE is returned with a message in error if one does not.
+ * This does not look at the database.
+ */
+extern bool checkStationJson(const json& j, std::string& error);
+
+
+
 /**
  * Attempts to add or update the XTide harmonics database using the tide station
  * definition stored in j.  TRUE is returned if the write was successful.  status
@@ -98,4 +142,17 @@ extern void getStationHarmonicsAsJson(int stationId, json& j);
  */
 extern bool setStationHarmonicsFromJson(json& j, json& status);
 
+
+
+/**
+ * Adds or updates every station definition in list in a single pass over
+ * the harmonics database.  All definitions are validated before any are
+ * written, and libxtide's station index is re-sorted only once at the end.
+ * results.results holds a status (as returned by setStationHarmonicsFromJson())
+ * for each entry in list, and results.statusCode is 200 only if every
+ * entry was written.  Returns FALSE if the changes could not be synced
+ * to disk.
+ */
+extern bool setStationsHarmonicsFromJson(std::vector<json>& list, json& results);
+
 #endif
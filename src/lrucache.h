@@ -0,0 +1,169 @@
+#ifndef _lrucache_h_
+#define _lrucache_h_
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+  * lrucache.h
+  * -------------------------
+  * A thread safe, size bounded, least recently used cache.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * Holds at most maxEntries values and, if maxBytes is not zero, at most
+ * maxBytes bytes of them (as told to put()). When full, adding a new value
+ * evicts the ones that were used least recently.
+ */
+template <typename V>
+class LruCache {
+
+    public:
+        LruCache(size_t maxEntries, size_t maxBytes = 0) :
+            maxEntries(maxEntries), maxBytes(maxBytes), bytes(0), hits(0), misses(0) {}
+
+        /**
+         * Copies the value stored under key into val.  Returns FALSE
+         * if there is no such value.
+         */
+        bool get(const std::string& key, V& val) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if (it == index.end()) {
+                misses++;
+                return false;
+            }
+            entries.splice(entries.begin(), entries, it->second);
+            val = it->second->val;
+            hits++;
+            return true;
+        }
+
+
+        /**
+         * Returns TRUE if a value is stored under key. Does not affect
+         * the key's place in line for eviction or the hit counts.
+         */
+        bool contains(const std::string& key) {
+            std::lock_guard<std::mutex> guard(lock);
+            return index.count(key) > 0;
+        }
+
+
+        /**
+         * Stores val under key.  valBytes is the size of val counted
+         * against maxBytes.  A value bigger than maxBytes on its own is
+         * not stored at all.
+         */
+        void put(const std::string& key, const V& val, size_t valBytes = 0) {
+            if (maxEntries == 0 || (maxBytes > 0 && valBytes > maxBytes)) {
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                bytes -= it->second->bytes;
+                it->second->val = val;
+                it->second->bytes = valBytes;
+                bytes += valBytes;
+                entries.splice(entries.begin(), entries, it->second);
+            }
+            else {
+                Entry entry = { key, val, valBytes };
+                entries.push_front(entry);
+                index[key] = entries.begin();
+                bytes += valBytes;
+            }
+
+            while (entries.size() > maxEntries || (maxBytes > 0 && bytes > maxBytes)) {
+                bytes -= entries.back().bytes;
+                index.erase(entries.back().key);
+                entries.pop_back();
+            }
+        }
+
+
+        void erase(const std::string& key) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                bytes -= it->second->bytes;
+                entries.erase(it->second);
+                index.erase(it);
+            }
+        }
+
+
+        void clear() {
+            std::lock_guard<std::mutex> guard(lock);
+            entries.clear();
+            index.clear();
+            bytes = 0;
+        }
+
+
+        size_t size() {
+            std::lock_guard<std::mutex> guard(lock);
+            return entries.size();
+        }
+
+        size_t getMaxEntries() { return maxEntries; }
+
+        size_t getBytes() {
+            std::lock_guard<std::mutex> guard(lock);
+            return bytes;
+        }
+
+        size_t getMaxBytes() { return maxBytes; }
+
+        unsigned long getHits() { return hits.load(); }
+
+        unsigned long getMisses() { return misses.load(); }
+
+    private:
+        struct Entry {
+            std::string key;
+            V val;
+            size_t bytes;
+        };
+        typedef std::list<Entry> EntryList;
+
+        size_t maxEntries;
+        size_t maxBytes;
+        size_t bytes;
+        std::mutex lock;
+        EntryList entries;
+        std::unordered_map<std::string, typename EntryList::iterator> index;
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+
+        LruCache(const LruCache&) = delete;
+        LruCache& operator=(const LruCache&) = delete;
+};
+
+#endif
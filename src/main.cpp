@@ -1,14 +1,38 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <signal.h>
+#include <unistd.h>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <nlohmann/json.hpp>
 #include <served/served.hpp>
 
 #include "_libxtide.h"
+#include "accesslog.h"
+#include "catalog.h"
+#include "dataset.h"
+#include "harmwriter.h"
 #include "nearstations.h"
 #include "xtutil.h"
 #include "jschema.h"
 #include "jsonxt.h"
+#include "metrics.h"
+#include "predict.h"
+#include "profiler.h"
+#include "ratelimit.h"
+#include "tidedb.h"
+#include "trace.h"
+#include "warmup.h"
+#include "workpool.h"
 
 using namespace std;
 using namespace libxtide;
@@ -49,48 +73,77 @@ using namespace libxtide;
 
 
 #define OK 200
+#define ACCEPTED 202
+#define NOT_MODIFIED 304
 #define BAD_REQUEST 400
+#define FORBIDDEN 403
+#define CONFLICT 409
+#define TOO_MANY_REQUESTS 429
 #define INTERNAL_SERVER_ERROR 500
+#define SERVICE_UNAVAILABLE 503
+
 
 /**
- * For responses that have an optional filter based on tide only stations or
- * current only stations...
+ * The Retry-After value (in seconds) sent when a request is turned away
+ * because its work pool is overloaded. Set with XTWSD_RETRY_AFTER.
  */
-class StationTypeFilter {
+static unsigned int retryAfterSecs = 5;
+
+
+/**
+ * All changes to the harmonics database are handed to this writer
+ */
+static HarmonicsWriter* pHarmonicsWriter = NULL;
 
-    public:
-        StationTypeFilter(string strFilter) {
-            if (strFilter == "tide") {
-                typeNum = 1;
-            }
-            else if (strFilter == "current") {
-                typeNum = 2;
-            }
-            else {
-                typeNum = 0;
-            }
-        }
 
-        bool qualifies(StationRef* pRef) {
-            switch (typeNum) {
-                case 0:
-                    return true;
+/**
+ * The longest a GET /changes request may wait. Set with XTWSD_CHANGES_MAX_WAIT.
+ */
+static unsigned int changesMaxWaitSecs = 60;
+
 
-                case 1:
-                    return !pRef->isCurrent;
+/**
+ * The request header that identifies a client for rate limiting, if
+ * clients are not to be told apart by address. Set with XTWSD_RATE_KEY_HEADER.
+ */
+static string rateKeyHeader;
 
-                case 2:
-                    return pRef->isCurrent;
-            } 
 
-            return false;
-        }
+/**
+ * Web server IO threads kept for the routes that do not run on a work
+ * pool (/tcd, /ready, /metrics, POST /admin/reload, ...)
+ */
+#define UNPOOLED_IO_THREADS 4
+
+
+/**
+ * The work pools whose queues are reported by GET /metrics
+ */
+static vector<WorkPool*> metricsPools;
+
 
-    private:
-       int typeNum;
+/**
+ * Thrown when a query or path parameter can not be read as the type the
+ * handler asked for.  The client is sent a 400.
+ */
+class BadParameter : public std::runtime_error {
+    public:
+        explicit BadParameter(const char* paramName) :
+            std::runtime_error(string("Invalid value for ") + paramName) {}
 };
 
 
+/**
+ * A scheduling class for routes. Each class has its own pool of threads
+ * and its own deadline for how long a request may take.  Routes in
+ * different classes never compete for pool threads, and since the web
+ * server's IO threads are sized by ioThreadCount(), not for IO threads
+ * either.
+ */
+struct RouteClass {
+    WorkPool* pPool;
+    unsigned int deadlineMs;
+};
 
 /**
  * Closes the specified session, returning the specified json
@@ -126,12 +179,201 @@ void returnbadstation(served::response& res, const string& stationId) {
 
 
 
+void returnbusy(served::response& res, const char* errorMsg) {
+
+     const string body = errorMsg;
+     res.set_status(SERVICE_UNAVAILABLE);
+     res.set_body(body);
+     res.set_header("Content-Type", "text/plain");
+     res.set_header("Retry-After", to_string(retryAfterSecs));
+}
+
+
+
+void returntoomany(served::response& res, unsigned int retryAfter) {
+
+     res.set_status(TOO_MANY_REQUESTS);
+     res.set_body("Too many requests - try again later");
+     res.set_header("Content-Type", "text/plain");
+     res.set_header("Retry-After", to_string(retryAfter));
+}
+
+
+
+/**
+ * Runs handler with a RequestTrace, then sends its stage timings in a
+ * Server-Timing header and writes it to the slow request log as needed.
+ * queued is when the request was handed to the work pool.
+ */
+void runTraced(const served::served_req_handler& handler, served::response& res, const served::request& req,
+               chrono::steady_clock::time_point queued) {
+
+    RequestTrace trace;
+    trace.add(TRACE_QUEUE, chrono::steady_clock::now() - queued);
+
+    handler(res, req);
+
+    if (serverTimingEnabled()) {
+        res.set_header("Server-Timing", trace.getServerTiming());
+    }
+    logIfSlow(trace, req.url().path());
+}
+
+
+
+/**
+ * Wraps handler so it runs on a thread from the route class's pool rather
+ * than on the web server's IO thread.  If the pool's queue is full, or the
+ * request can not be started before its deadline, a 503 is returned instead.
+ */
+served::served_req_handler onPool(const RouteClass& routeClass, served::served_req_handler handler) {
+
+    WorkPool* pPool = routeClass.pPool;
+    unsigned int deadlineMs = routeClass.deadlineMs;
+
+    return [pPool, deadlineMs, handler](served::response& res, const served::request& req) {
+
+        // Only look at the clock if someone wants the timings
+        bool traced = tracingEnabled();
+        chrono::steady_clock::time_point queued;
+        if (traced) {
+            queued = chrono::steady_clock::now();
+        }
+
+        // Finish on the data the request started with (see metered()),
+        // even if it is reloaded while we wait for a thread
+        shared_ptr<Dataset> dataset = currentDataset();
+
+        WorkPool::Result result = pPool->run([&handler, &res, &req, &dataset, traced, queued] {
+            DatasetPin pin(dataset);
+            if (traced) {
+                runTraced(handler, res, req, queued);
+            }
+            else {
+                handler(res, req);
+            }
+        }, deadlineMs);
+
+        switch (result) {
+            case WorkPool::COMPLETED:
+                break;
+
+            case WorkPool::REJECTED:
+                returnbusy(res, "Server is busy - try again later");
+                break;
+
+            case WorkPool::EXPIRED:
+            case WorkPool::CANCELLED:
+                returnbusy(res, "Request could not be completed in time - try again later");
+                break;
+        }
+    };
+}
+
+
+
+/**
+ * Returns the address of a request's client, without its port, so every
+ * connection from a client looks the same.  Requests from proxies named in
+ * XTWSD_TRUSTED_PROXIES are taken to be from the client in their
+ * X-Forwarded-For header (see clientAddress()).
+ */
+string requestClient(const served::request& req) {
+    const set<string>& trustedProxies = getTrustedProxies();
+    return clientAddress(req.source(),
+                         trustedProxies.empty() ? string() : req.header("X-Forwarded-For"),
+                         trustedProxies);
+}
+
+
+
+/**
+ * Returns the key a request's client is rate limited by: the value of the
+ * XTWSD_RATE_KEY_HEADER header if it has one, otherwise its address.
+ */
+string rateLimitKey(const served::request& req) {
+    if (!rateKeyHeader.empty()) {
+        string key = req.header(rateKeyHeader);
+        if (!key.empty()) {
+            return "key:" + key;
+        }
+    }
+    return requestClient(req);
+}
+
+
+
+/**
+ * Wraps handler so its requests are counted and timed as routeName
+ * (see GET /metrics) and written to the access log.  Clients that go
+ * over the route's rate limit (see ratelimit.h) are sent a 429 before
+ * handler is called.
+ */
+served::served_req_handler metered(const char* routeName, RateClass rateClass, served::served_req_handler handler) {
+
+    int routeId = registerRoute(routeName);
+    RateLimiter* pLimiter = getRateLimiter(routeName, rateClass);
+
+    return [routeId, routeName, pLimiter, handler](served::response& res, const served::request& req) {
+        RequestTimer timer(routeId);
+        unsigned int retryAfter = (pLimiter != NULL) ? pLimiter->admit(rateLimitKey(req)) : 0;
+        if (retryAfter > 0) {
+            returntoomany(res, retryAfter);
+        }
+        else {
+            // The response says which version of the data it was made from
+            DatasetPin pin;
+            res.set_header("X-Data-Version", to_string(xtutil::dataVersion()));
+            try {
+                handler(res, req);
+            }
+            catch (const BadParameter& err) {
+                returnerror(res, err.what(), BAD_REQUEST);
+            }
+            catch (const std::exception& err) {
+                logMessage("Request for " + req.url().URI() + " failed: " + err.what());
+                returnerror(res, "Internal server error");
+            }
+        }
+        timer.finish(res.status());
+
+        if (!accessLogEnabled()) {
+            return;
+        }
+        AccessLogEntry entry;
+        entry.method = served::method_to_string(req.method());
+        entry.target = req.url().URI();
+        entry.client = requestClient(req);
+        entry.route = routeName;
+        entry.stationId = req.params["stationId"];
+        entry.statusCode = res.status();
+        entry.bytes = res.body_size();
+        entry.latencyUs = timer.elapsedUs();
+        logAccess(entry);
+    };
+}
+
+
+
 int convert_to(std::string& val, int typeVal) {
     return stoi(val);
 }
 
 
 unsigned int convert_to(std::string& val, unsigned int typeVal) {
+    unsigned long converted = convert_to(val, (unsigned long) typeVal);
+    if (converted > UINT_MAX) {
+        throw std::out_of_range(val);
+    }
+    return converted;
+}
+
+
+unsigned long convert_to(std::string& val, unsigned long typeVal) {
+    // stoul() would quietly turn "-1" into a huge number
+    if (val.find('-') != string::npos) {
+        throw std::invalid_argument(val);
+    }
     return stoul(val);
 }
 
@@ -158,9 +400,12 @@ T get_query_parameter(const served::request& req, const char* paramName, T defau
     if (val.empty()) {
         return defaultVal;
     }
-    else {
+    try {
         return convert_to(val, defaultVal);
     }
+    catch (const std::logic_error&) {
+        throw BadParameter(paramName);
+    }
 }
 
 
@@ -187,9 +432,12 @@ T get_path_parameter(const served::request& req, const char* paramName, T defaul
     if (val.empty()) {
         return defaultVal;
     }
-    else {
+    try {
         return convert_to(val, defaultVal);
     }
+    catch (const std::logic_error&) {
+        throw BadParameter(paramName);
+    }
 }
 
 
@@ -205,80 +453,109 @@ string get_path_parameter(const served::request& req, const char* paramName, str
 
 
 /**
- * Handler for GET /locations
+ * Returns a QueryLookup that reads the query parameters of req
  */
-void get_locations_handler(served::response& res, const served::request& req)
-{
-    StationTypeFilter filter(get_path_parameter(req, "stationType"));
-    int filterRef = get_query_parameter<bool>(req, "referenceOnly", 0);
-    
-    json jLocs = json::array();
+QueryLookup query_lookup(const served::request& req) {
+    return [&req](const char* paramName) { return get_query_parameter(req, paramName); };
+}
 
-    StationIndex& stations = Global::stationIndex();
 
-    for (int s = 0; s < stations.size(); s++) {
-        StationRef*  pRef = stations[s];
-        if (filter.qualifies(pRef)) {
-            if (!filterRef || pRef->isReferenceStation) {
-                json j = json({});
-                tojson(pRef, j);
-                jLocs += j;
-            }
-        }
-    }
 
-    returnjson(res, jLocs);
+void returnbody(served::response& res, const string& body, const string& contentType) {
+    res.set_status(OK);
+    res.set_body(body);
+    res.set_header("Content-Type", contentType);
 }
 
 
+
 /**
- * Handler for GET /station
+ * Returns the rendered body to the client, or a 304 Not Modified if the
+ * client already has it (i.e. sent its ETag in If-None-Match).  If maxAge
+ * is non-zero, a Cache-Control header is added so browsers and CDNs may
+ * keep the result for that many seconds.
  */
-void get_station_handler(served::response& res, const served::request& req)
-{
-    int stationIndex = xtutil::getStationIndex(get_path_parameter(req, "stationId"));
-    if (!xtutil::stationIndexValid(stationIndex)) {
-        returnbadstation(res, get_path_parameter(req, "stationId"));
+void returnrendered(served::response& res, const served::request& req, const RenderedBody& rendered, int maxAge = -1) {
+
+    res.set_header("ETag", rendered.etag);
+    if (maxAge >= 0) {
+        res.set_header("Cache-Control", "public, max-age=" + to_string(maxAge));
+    }
+
+    string ifNoneMatch = req.header("If-None-Match");
+    if (!ifNoneMatch.empty() &&
+        (ifNoneMatch == "*" || ifNoneMatch.find(rendered.etag) != string::npos)) {
+        res.set_status(NOT_MODIFIED);
         return;
     }
 
-    StationIndex& stations = Global::stationIndex();
-    Station* station = stations[stationIndex]->load();
-    StationRef*  pRef = stations[stationIndex];
+    returnbody(res, rendered.body, rendered.contentType);
+}
 
-    json j;
-    tojson(station, pRef, j);
 
-    int localTime = get_query_parameter<int>(req, "local", 0);
 
-    Timestamp startTime;
-    Dstr timezone(UTC);
-    if (localTime) {
-        timezone = station->timezone;
+/**
+ * Returns the number of web server IO threads to run.  A request to a
+ * pooled route holds its IO thread while it waits in the pool's queue and
+ * while it runs, so each pool can tie up at most its threads plus its
+ * queue.  There must be enough IO threads for every pool to do that at
+ * once with UNPOOLED_IO_THREADS to spare, or a backlog in one pool would
+ * keep requests for the others from even being read.  XTWSD_IO_THREADS is
+ * raised to that number if it is set lower.
+ */
+unsigned int ioThreadCount(const vector<WorkPool*>& pools) {
+
+    unsigned int needed = UNPOOLED_IO_THREADS;
+    for (WorkPool* pPool : pools) {
+        needed += pPool->getThreadCount() + pPool->getMaxQueued();
     }
-    if (has_query_parameter(req, "start")) {
-        Dstr timestring = get_query_parameter<string>(req, "start", "").c_str();
-        startTime = Timestamp(timestring, timezone);
+
+    int configured = xtutil::getEnvInt("XTWSD_IO_THREADS", 0);
+    if (configured <= 0) {
+        return needed;
     }
-    else {
-        startTime = Timestamp(std::time(nullptr));
+    if ((unsigned int) configured < needed) {
+        logMessage("XTWSD_IO_THREADS is " + to_string(configured) + ", but the work pools can hold " +
+                   to_string(needed - UNPOOLED_IO_THREADS) + " requests - using " + to_string(needed) + " IO threads");
+        return needed;
     }
+    return configured;
+}
 
-    int days = get_query_parameter<int>(req, "days", 1);
 
-    Timestamp endTime = startTime + Interval(days * 60 * 60 * 24);
- 
 
-    Station::TideEventsFilter filter = Station::TideEventsFilter::maxMin;
-    if (get_query_parameter(req, "detailed", 0) == 1) {
-        filter = Station::TideEventsFilter::noFilter;
-    }
+/**
+ * Handler for GET /locations
+ */
+void get_locations_handler(served::response& res, const served::request& req)
+{
+    StationTypeFilter filter(get_path_parameter(req, "stationType"));
+    int filterRef = get_query_parameter<bool>(req, "referenceOnly", 0);
 
-    TideEventsOrganizer eventList;
-    station->predictTideEvents(startTime, endTime, eventList, filter);
-    setEvents(eventList, j, &timezone);
+    returnbody(res, getLocationsBody(filter, filterRef), "application/json");
+}
 
-    returnjson(res, j);
+
+
+/**
+ * Handler for GET /station
+ */
+void get_station_handler(served::response& res, const served::request& req)
+{
+    PredictionParams params;
+    string error;
+    if (!parsePredictionRequest(get_path_parameter(req, "stationId"), query_lookup(req), params, error)) {
+        returnerror(res, error.c_str(), BAD_REQUEST);
+        return;
+    }
+
+    RenderedBody rendered = getPrediction(params);
+    if (rendered.complete) {
+        returnrendered(res, req, rendered);
+    }
+    else if (!WorkPool::cancelled()) {
+        returnerror(res, "Could not render response");
+    }
 }
 
 
@@ -287,38 +564,42 @@ void get_station_handler(served::response& res, const served::request& req)
  */
 void get_graph_handler(served::response& res, const served::request& req)
 {
-    int stationIndex = xtutil::getStationIndex(get_path_parameter(req, "stationId"));
-    if (!xtutil::stationIndexValid(stationIndex)) {
-        returnbadstation(res, get_path_parameter(req, "stationId"));
+    GraphParams params;
+    string error;
+    if (!parseGraphRequest(get_path_parameter(req, "stationId"), query_lookup(req), params, error)) {
+        returnerror(res, error.c_str(), BAD_REQUEST);
         return;
     }
 
-    StationIndex& stations = Global::stationIndex();
-    Station* station = stations[stationIndex]->load();
-    StationRef*  pRef = stations[stationIndex];
-
-    Timestamp startTime;
-    Dstr timezone(UTC);
-    if (has_query_parameter(req, "start")) {
-        Dstr timestring = get_query_parameter(req, "start").c_str();
-        startTime = Timestamp(timestring, timezone);
+    RenderedBody rendered = getGraph(params);
+    if (rendered.complete) {
+        returnrendered(res, req, rendered, graphMaxAge(params));
     }
-    else {
-        startTime = Timestamp(std::time(nullptr));
+    else if (!WorkPool::cancelled()) {
+        returnerror(res, "Could not render response");
     }
- 
-    unsigned int width = get_query_parameter<unsigned int>(req, "width", 1200);
-    unsigned int height = get_query_parameter<unsigned int>(req, "height", 400);
-    SVGGraph svg (width, height);
-    Dstr text_out;
-    svg.drawTides(station, startTime);
-    svg.print(text_out);
+}
 
-    const string body = text_out.aschar();
 
-    res.set_status(BAD_REQUEST);
-    res.set_body(body);
-    res.set_header("Content-Type", "image/svg+xml");
+/**
+ * Handler for GET /spark
+ */
+void get_spark_handler(served::response& res, const served::request& req)
+{
+    SparkParams params;
+    string error;
+    if (!parseSparkRequest(get_path_parameter(req, "stationId"), query_lookup(req), params, error)) {
+        returnerror(res, error.c_str(), BAD_REQUEST);
+        return;
+    }
+
+    RenderedBody rendered = getSpark(params);
+    if (rendered.complete) {
+        returnrendered(res, req, rendered, graphMaxAge(params));
+    }
+    else if (!WorkPool::cancelled()) {
+        returnerror(res, "Could not render response");
+    }
 }
 
 
@@ -331,7 +612,7 @@ void get_nearest_handler(served::response& res, const served::request& req)
     
     json jnear = json::array();
 
-    StationIndex& stations = Global::stationIndex();
+    StationIndex& stations = currentStations();
 
     double lat = get_query_parameter(req, "lat", 26.2567);
     double lng = get_query_parameter(req, "lng", -80.08);
@@ -365,11 +646,12 @@ void get_nearest_handler(served::response& res, const served::request& req)
 
 void get_schema_handler(served::response& res, const served::request& req)
 {
-    json schema;
-    getJsonSchema(schema);
+    RenderedBody rendered;
+    rendered.contentType = "application/json";
+    rendered.complete = getJsonSchemaBody(rendered.body, rendered.etag);
 
-    if (!schema.empty()) {
-        returnjson(res, schema);
+    if (rendered.complete) {
+        returnrendered(res, req, rendered);
     }
     else {
         returnerror(res, "Could not open database");
@@ -408,6 +690,40 @@ void get_harmonics_handler(served::response& res, const served::request& req)
 
 
 
+/**
+ * The number of stations GET /harmonics exports per page if no limit is
+ * given, and the most it will export per page.
+ */
+#define DEFAULT_EXPORT_LIMIT 1000
+#define MAX_EXPORT_LIMIT 5000
+
+
+/**
+ * Handler for GET /harmonics (without a station id)
+ * Exports the harmonics of every station (or just the ones changed since a
+ * data version) as newline delimited json.
+ */
+void get_harmonics_export_handler(served::response& res, const served::request& req)
+{
+    unsigned long since = get_query_parameter<unsigned long>(req, "since", 0);
+    unsigned long offset = get_query_parameter<unsigned long>(req, "offset", 0);
+    unsigned long limit = get_query_parameter<unsigned long>(req, "limit", DEFAULT_EXPORT_LIMIT);
+    limit = std::max(1UL, std::min(limit, (unsigned long) MAX_EXPORT_LIMIT));
+
+    string body;
+    HarmonicsExport info;
+    if (!exportStationHarmonics(since, offset, limit, body, info)) {
+        // Cancelled - onPool has already answered
+        return;
+    }
+
+    res.set_header("X-Export", info.full ? "full" : "changes");
+    res.set_header("X-Total-Count", to_string(info.total));
+    returnbody(res, body, "application/x-ndjson");
+}
+
+
+
 /**
  * Handler for POST /harmonics
  */
@@ -419,11 +735,22 @@ void post_harmonics_handler(served::response& res, const served::request& req)
     }
 
     try {
-        json j = json::parse(req.body());
-        json status;
+        vector<json> list;
+        list.push_back(json::parse(req.body()));
+
+        string error;
+        if (!checkStationJson(list[0], error)) {
+            returnerror(res, error.c_str(), BAD_REQUEST);
+            return;
+        }
 
-        setStationHarmonicsFromJson(j, status);
+        json results;
+        pHarmonicsWriter->write(list, results);
 
+        json status = results.count("results") ? results["results"][0] : results;
+        if (results.count("version")) {
+            status["version"] = results["version"];
+        }
         returnjson(res, status, status["statusCode"].get<int>());
     }
     catch (nlohmann::detail::parse_error& err) {
@@ -440,60 +767,485 @@ void post_harmonics_handler(served::response& res, const served::request& req)
 
 
 
+/**
+ * Handler for POST /harmonics/bulk
+ * Accepts a json array of station definitions, or newline delimited json
+ * (one definition per line).
+ */
+void post_harmonics_bulk_handler(served::response& res, const served::request& req)
+{
+    string contentType = req.header("Content-Type");
+    bool ndjson = (contentType == "application/x-ndjson");
+    if (contentType != "application/json" && !ndjson) {
+        returnerror(res, "Request must be of type application/json or application/x-ndjson", BAD_REQUEST);
+        return;
+    }
+
+    vector<json> list;
+    vector<int> lineNumbers;
+    int lineNum = 0;
+    try {
+        if (ndjson) {
+            istringstream in(req.body());
+            string line;
+            while (getline(in, line)) {
+                lineNum++;
+                if (line.find_first_not_of(" \t\r") != string::npos) {
+                    list.push_back(json::parse(line));
+                    lineNumbers.push_back(lineNum);
+                }
+            }
+        }
+        else {
+            json j = json::parse(req.body());
+            if (!j.is_array()) {
+                returnerror(res, "Request body must be an array of station definitions", BAD_REQUEST);
+                return;
+            }
+            for (auto& station : j) {
+                list.push_back(station);
+            }
+        }
+    }
+    catch (nlohmann::detail::parse_error& err) {
+        string msg = "Error parsing input string: ";
+        if (ndjson) {
+            msg += "line " + to_string(lineNum) + ": ";
+        }
+        msg += err.what();
+        returnerror(res, msg.c_str(), BAD_REQUEST);
+        return;
+    }
+
+    // Nothing is journaled unless every definition can be decoded
+    for (size_t i = 0; i < list.size(); i++) {
+        string error;
+        if (!checkStationJson(list[i], error)) {
+            string msg = (ndjson ? "Line " : "Entry ") + to_string(ndjson ? lineNumbers[i] : i + 1) + ": " + error;
+            returnerror(res, msg.c_str(), BAD_REQUEST);
+            return;
+        }
+    }
+
+    try {
+        json results;
+        pHarmonicsWriter->write(list, results);
+        returnjson(res, results, results["statusCode"].get<int>());
+    }
+    catch (const std::exception& err) {
+        returnerror(res, err.what());
+    }
+}
+
+
+
 /**
  * Handler for GET /tcd
  */
 void get_tcd_handler(served::response& res, const served::request& req)
 {
+    DatasetPin pin;
     json j;
-    StationIndex& stations = Global::stationIndex();
-    StationRef*  pRef = stations[0];
-    if (open_tide_db(pRef->harmonicsFileName.aschar())) {
-        auto db = get_tide_db_header();
-
-        json version;
-        version["major_rev"] = db.major_rev;
-        version["minor_rev"] = db.minor_rev;
-        version["libtcd"] = db.version;
-        j["version"] = version;
-        j["start_year"] = db.start_year;
-        j["end_year"] = db.start_year + db.number_of_years;
-        j["number_of_records"] = db.number_of_records;
-
-        close_tide_db();
+    json files = json::array();
+
+    for (auto& file : getHarmonicsFiles()) {
+        TideDbSession session(file.fileName);
+        if (session.isOpen()) {
+            const DB_HEADER_PUBLIC& db = session.header();
+
+            json f;
+            f["file"] = file.fileName.aschar();
+            json version;
+            version["major_rev"] = db.major_rev;
+            version["minor_rev"] = db.minor_rev;
+            version["libtcd"] = db.version;
+            f["version"] = version;
+            f["start_year"] = db.start_year;
+            f["end_year"] = db.start_year + db.number_of_years;
+            f["number_of_records"] = db.number_of_records;
+            f["stations"] = file.stationCount;
+            f["writable"] = (file.fileName == getWriteHarmonicsFile());
+
+            if (file.fileName == getWriteHarmonicsFile()) {
+                // The top level describes the file new stations are added to
+                j["version"] = version;
+                j["start_year"] = f["start_year"];
+                j["end_year"] = f["end_year"];
+                j["number_of_records"] = db.number_of_records;
+            }
+
+            files += f;
+        }
     }
+
+    j["files"] = files;
+    j["dataVersion"] = xtutil::dataVersion();
     returnjson(res, j);
 }
 
 
 
+/**
+ * Handler for GET /changes
+ * Waits (up to timeout seconds) for the data version to move past since,
+ * then returns the new version and the ids of the stations that changed.
+ */
+void get_changes_handler(served::response& res, const served::request& req)
+{
+    unsigned long since = get_query_parameter<unsigned long>(req, "since", 0);
+    unsigned int timeout = get_query_parameter<unsigned int>(req, "timeout", 30);
+    timeout = std::min(timeout, changesMaxWaitSecs);
+
+    shared_ptr<Dataset> dataset = waitForChange(since, timeout * 1000);
+
+    // Read the version first, so a change made while we are answering is
+    // reported (again) by the next poll rather than lost.
+    unsigned long version = dataset->version.load();
+    vector<string> changedIds;
+    bool full = !dataset->changesSince(since, changedIds);
+
+    json j;
+    j["version"] = version;
+    j["full"] = full;
+    j["stations"] = changedIds;
+
+    res.set_header("X-Data-Version", to_string(version));
+    res.set_header("Cache-Control", "no-store");
+    returnjson(res, j);
+}
+
+
+
+/**
+ * Returns TRUE if the request carries the admin token (set with
+ * XTWSD_ADMIN_TOKEN) in its X-Admin-Token header.  If no token is set,
+ * the admin resources are turned off.
+ */
+bool authorized(const served::request& req)
+{
+    const char* token = getenv("XTWSD_ADMIN_TOKEN");
+    if (token == NULL || *token == '\0') {
+        return false;
+    }
+
+    // Compare every character, so the time taken does not give away
+    // how much of the token was right.
+    string given = req.header("X-Admin-Token");
+    string expected = token;
+    unsigned char diff = (given.size() != expected.size());
+    for (size_t i = 0; i < given.size(); i++) {
+        diff |= given[i] ^ expected[i % expected.size()];
+    }
+    return diff == 0;
+}
+
+
+
+static mutex reloadRequestLock;
+static condition_variable reloadRequested;
+static bool reloadPending = false;
+
+/**
+ * Runs a reload of the harmonics data in the background.  Reloads run one
+ * at a time on a thread of their own.  Asking for a reload while one is
+ * running queues a single reload to start when it is done, however many
+ * times it is asked for.
+ */
+void startReload()
+{
+    static once_flag reloaderStarted;
+    call_once(reloaderStarted, [] {
+        std::thread([] {
+            while (true) {
+                {
+                    unique_lock<mutex> guard(reloadRequestLock);
+                    reloadRequested.wait(guard, [] { return reloadPending; });
+                    reloadPending = false;
+                }
+
+                string error;
+                if (!reloadDataset(error)) {
+                    logMessage("Reload failed: " + error);
+                }
+            }
+        }).detach();
+    });
+
+    lock_guard<mutex> guard(reloadRequestLock);
+    reloadPending = true;
+    reloadRequested.notify_one();
+}
+
+
+
+/**
+ * Handler for POST /admin/reload
+ */
+void post_reload_handler(served::response& res, const served::request& req)
+{
+    if (!authorized(req)) {
+        returnerror(res, "Forbidden", FORBIDDEN);
+        return;
+    }
+
+    startReload();
+
+    json status;
+    status["statusCode"] = ACCEPTED;
+    status["message"] = "Reload started";
+    status["version"] = xtutil::dataVersion();
+    returnjson(res, status, ACCEPTED);
+}
+
+
+
+/**
+ * The longest profile GET /debug/profile will take
+ */
+#define MAX_PROFILE_SECS 60
+
+
+/**
+ * Handler for GET /debug/profile
+ */
+void get_profile_handler(served::response& res, const served::request& req)
+{
+    if (!authorized(req)) {
+        returnerror(res, "Forbidden", FORBIDDEN);
+        return;
+    }
+
+    unsigned int seconds = get_query_parameter<unsigned int>(req, "seconds", 10);
+    seconds = std::max(1U, std::min(seconds, (unsigned int) MAX_PROFILE_SECS));
+    unsigned int hz = get_query_parameter<unsigned int>(req, "hz", 99);
+
+    string mode = get_query_parameter(req, "mode", "cpu");
+    if (mode != "cpu" && mode != "heap") {
+        returnerror(res, "mode must be cpu or heap", BAD_REQUEST);
+        return;
+    }
+    if (mode == "cpu" && (hz < MIN_PROFILE_HZ || hz > MAX_PROFILE_HZ)) {
+        string msg = "hz must be between " + to_string(MIN_PROFILE_HZ) + " and " + to_string(MAX_PROFILE_HZ);
+        returnerror(res, msg.c_str(), BAD_REQUEST);
+        return;
+    }
+
+    string folded;
+    string error;
+    switch (runProfile(mode == "heap" ? PROFILE_HEAP : PROFILE_CPU, seconds, hz, folded, error)) {
+        case PROFILE_DONE:
+            break;
+
+        case PROFILE_BUSY:
+            returnerror(res, error.c_str(), CONFLICT);
+            return;
+
+        case PROFILE_FAILED:
+            returnerror(res, error.c_str(), INTERNAL_SERVER_ERROR);
+            return;
+    }
+
+    if (!error.empty()) {
+        res.set_header("Warning", "199 xtwsd \"" + error + "\"");
+    }
+    res.set_header("Cache-Control", "no-store");
+    returnbody(res, folded, "text/plain");
+}
+
+
+
+/**
+ * Handler for GET /ready
+ */
+void get_ready_handler(served::response& res, const served::request& req)
+{
+    if (warmupComplete()) {
+        returnbody(res, "ready", "text/plain");
+    }
+    else {
+        returnbusy(res, "Warming up");
+    }
+}
+
+
+
+/**
+ * Handler for GET /metrics
+ */
+void get_metrics_handler(served::response& res, const served::request& req)
+{
+    string body;
+    renderMetrics(body);
+
+    body += "# HELP xtwsd_pool_queue_depth Requests waiting for a thread, by work pool.\n";
+    body += "# TYPE xtwsd_pool_queue_depth gauge\n";
+    for (WorkPool* pPool : metricsPools) {
+        body += "xtwsd_pool_queue_depth{pool=\"" + pPool->getName() + "\"} " + to_string(pPool->getQueueDepth()) + "\n";
+    }
+
+    body += "# HELP xtwsd_data_version The current data version.\n";
+    body += "# TYPE xtwsd_data_version gauge\n";
+    body += "xtwsd_data_version " + to_string(xtutil::dataVersion()) + "\n";
+
+    res.set_header("X-Data-Version", to_string(xtutil::dataVersion()));
+    res.set_header("Cache-Control", "no-store");
+    returnbody(res, body, "text/plain; version=0.0.4");
+}
+
+
+
 int main(const int argc, const char** argv)
 {
 
     printf("xtwsd v0.2\n");
 
+    // SIGHUP reloads the harmonics data, and SIGTERM and SIGINT write out
+    // the queued log lines before stopping. Block them before any threads
+    // are started so that only the signal thread (below) ever receives them.
+    sigset_t handledSignals;
+    sigemptyset(&handledSignals);
+    sigaddset(&handledSignals, SIGHUP);
+    sigaddset(&handledSignals, SIGTERM);
+    sigaddset(&handledSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &handledSignals, NULL);
+
     const char* port = "8080";
     if (argc >= 2) {
         port = argv[1];
     }
 
+    // Request threads log through a background writer (see accesslog.h)
+    string accessLogFile;
+    if (getenv("XTWSD_ACCESS_LOG") != NULL) {
+        accessLogFile = getenv("XTWSD_ACCESS_LOG");
+    }
+    startLogWriter(accessLogFile,
+                   (size_t) xtutil::getEnvInt("XTWSD_ACCESS_LOG_MAX_MB", 100) * 1024 * 1024,
+                   xtutil::getEnvInt("XTWSD_ACCESS_LOG_KEEP", 5));
+
+    retryAfterSecs = xtutil::getEnvInt("XTWSD_RETRY_AFTER", retryAfterSecs);
+
+    if (getenv("XTWSD_RATE_KEY_HEADER") != NULL) {
+        rateKeyHeader = getenv("XTWSD_RATE_KEY_HEADER");
+    }
+
+    // Catalog lookups are quick and have a tight deadline...
+    WorkPool lookupPool("lookup",
+                        xtutil::getEnvInt("XTWSD_LOOKUP_THREADS", 4),
+                        xtutil::getEnvInt("XTWSD_LOOKUP_QUEUE", 32));
+    RouteClass lookup = { &lookupPool, (unsigned int) xtutil::getEnvInt("XTWSD_LOOKUP_DEADLINE_MS", 2000) };
+
+    // ...while predictions and graph rendering can take a while.
+    WorkPool computePool("compute",
+                         xtutil::getEnvInt("XTWSD_COMPUTE_THREADS", std::thread::hardware_concurrency()),
+                         xtutil::getEnvInt("XTWSD_COMPUTE_QUEUE", 16));
+    RouteClass compute = { &computePool, (unsigned int) xtutil::getEnvInt("XTWSD_COMPUTE_DEADLINE_MS", 30000) };
+
+    // Optionally compute the next prediction window in the background
+    // whenever a prediction is served.
+    WorkPool prefetchPool("prefetch", 1, 16);
+    if (xtutil::getEnvInt("XTWSD_PREFETCH", 0)) {
+        enablePrefetch(&prefetchPool, &computePool, xtutil::getEnvInt("XTWSD_PREFETCH_PER_MINUTE", 60));
+    }
+
+    // Long polls for /changes spend their time waiting, so they get a few
+    // threads of their own (and IO threads to match - see ioThreadCount()).
+    // A poll that can not get a thread right away is turned away rather
+    // than left holding an IO thread in the queue. Polls never check for
+    // cancellation, so the deadline does not cut a running one short.
+    changesMaxWaitSecs = xtutil::getEnvInt("XTWSD_CHANGES_MAX_WAIT", changesMaxWaitSecs);
+    WorkPool changesPool("changes",
+                         xtutil::getEnvInt("XTWSD_CHANGES_THREADS", 4),
+                         xtutil::getEnvInt("XTWSD_CHANGES_QUEUE", 2));
+    RouteClass changes = { &changesPool, 1000 };
+
+    // Changes to the database are written one batch at a time by the
+    // harmonics writer, so a couple of threads are enough to keep it fed
+    // with batches.  The deadline only limits how long a write waits for a
+    // thread: once its definitions are journaled it always finishes, and
+    // its handler never checks for cancellation.
+    WorkPool writePool("write",
+                       xtutil::getEnvInt("XTWSD_WRITE_THREADS", 2),
+                       xtutil::getEnvInt("XTWSD_WRITE_QUEUE", 8));
+    RouteClass write = { &writePool, (unsigned int) xtutil::getEnvInt("XTWSD_WRITE_DEADLINE_MS", 10000) };
+
+    // Profiles run for seconds at a time, so keep them off everyone else's threads
+    WorkPool debugPool("debug", 1, 1);
+    RouteClass debug = { &debugPool, (MAX_PROFILE_SECS + 30) * 1000 };
+
+    metricsPools = { &lookupPool, &computePool, &prefetchPool, &changesPool, &writePool, &debugPool };
+
 	// Create a multiplexer for handling requests
 	served::multiplexer mux;
 
-    mux.handle("/locations/{stationType}").get(get_locations_handler);
-    mux.handle("/locations").get(get_locations_handler);
-    mux.handle("/location/{stationId}").get(get_station_handler);
-    mux.handle("/graph/{stationId}").get(get_graph_handler);
-    mux.handle("/nearest/{stationType}").get(get_nearest_handler);
-    mux.handle("/nearest").get(get_nearest_handler);
-    mux.handle("/harmonics/{stationId}").get(get_harmonics_handler);
-    mux.handle("/harmonics").post(post_harmonics_handler);
-    mux.handle("/tcd").get(get_tcd_handler);
-    
+    mux.handle("/locations/{stationType}").get(metered("/locations", RATE_CHEAP, onPool(lookup, get_locations_handler)));
+    mux.handle("/locations").get(metered("/locations", RATE_CHEAP, onPool(lookup, get_locations_handler)));
+    mux.handle("/location/{stationId}").get(metered("/location/{stationId}", RATE_EXPENSIVE, onPool(compute, get_station_handler)));
+    mux.handle("/graph/{stationId}").get(metered("/graph/{stationId}", RATE_EXPENSIVE, onPool(compute, get_graph_handler)));
+    mux.handle("/spark/{stationId}").get(metered("/spark/{stationId}", RATE_EXPENSIVE, onPool(compute, get_spark_handler)));
+    mux.handle("/nearest/{stationType}").get(metered("/nearest", RATE_CHEAP, onPool(lookup, get_nearest_handler)));
+    mux.handle("/nearest").get(metered("/nearest", RATE_CHEAP, onPool(lookup, get_nearest_handler)));
+    mux.handle("/harmonics/bulk").post(metered("POST /harmonics/bulk", RATE_EXPENSIVE, onPool(write, post_harmonics_bulk_handler)));
+    mux.handle("/harmonics/{stationId}").get(metered("/harmonics/{stationId}", RATE_CHEAP, onPool(lookup, get_harmonics_handler)));
+    mux.handle("/harmonics").get(metered("/harmonics", RATE_EXPENSIVE, onPool(compute, get_harmonics_export_handler)))
+                            .post(metered("POST /harmonics", RATE_EXPENSIVE, onPool(write, post_harmonics_handler)));
+    mux.handle("/tcd").get(metered("/tcd", RATE_CHEAP, get_tcd_handler));
+    mux.handle("/changes").get(metered("/changes", RATE_CHEAP, onPool(changes, get_changes_handler)));
+    mux.handle("/ready").get(metered("/ready", RATE_NONE, get_ready_handler));
+    mux.handle("/metrics").get(get_metrics_handler);
+    mux.handle("/admin/reload").post(metered("POST /admin/reload", RATE_NONE, post_reload_handler));
+    mux.handle("/debug/profile").get(metered("/debug/profile", RATE_NONE, onPool(debug, get_profile_handler)));
+
+    // Finish any changes that were in flight when we last stopped
+    string journalFile;
+    if (getenv("XTWSD_JOURNAL") != NULL) {
+        journalFile = getenv("XTWSD_JOURNAL");
+    }
+    else {
+        journalFile = getWriteHarmonicsFile().aschar();
+        journalFile += ".journal";
+    }
+    HarmonicsWriter harmonicsWriter(journalFile);
+    harmonicsWriter.replay();
+    pHarmonicsWriter = &harmonicsWriter;
+
+    std::thread([handledSignals] {
+        while (true) {
+            int sig;
+            if (sigwait(&handledSignals, &sig) == 0) {
+                if (sig == SIGHUP) {
+                    startReload();
+                }
+                else {
+                    logMessage("Shutting down");
+                    stopLogWriter();
+                    _exit(EXIT_SUCCESS);
+                }
+            }
+        }
+    }).detach();
+
+    // Fill the caches before taking traffic. The entries to compute come
+    // from XTWSD_WARMUP_FILE (a hot station list or an access log).
+    vector<string> warmupTargets;
+    const char* warmupFile = getenv("XTWSD_WARMUP_FILE");
+    if (warmupFile != NULL) {
+        readWarmupTargets(warmupFile, xtutil::getEnvInt("XTWSD_WARMUP_LIMIT", 1000), warmupTargets);
+    }
+    unsigned int warmupThreads = std::thread::hardware_concurrency();
+    if (xtutil::getEnvInt("XTWSD_WARMUP_BACKGROUND", 0)) {
+        // Start listening right away, and let /ready tell the load
+        // balancer when we are done.
+        std::thread([warmupTargets, warmupThreads] { warmCaches(warmupTargets, warmupThreads); }).detach();
+    }
+    else {
+        warmCaches(warmupTargets, warmupThreads);
+    }
+
     printf("Starting web service on port %s\n", port);
     
 	served::net::server server("0.0.0.0", port, mux);
-	server.run(10);
+	server.run(ioThreadCount({ &lookupPool, &computePool, &changesPool, &writePool, &debugPool }));
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,408 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+
+#define MAX_ROUTES 32
+
+// Latency buckets, in the style of an HDR histogram: every power of two
+// range of microseconds (2^o, 2^(o+1)] is split into LATENCY_SUB_BUCKETS
+// equal parts, so a bucket's bound is never more than 25% above the values
+// in it.  Bucket 0 counts everything up to 2^FIRST_OCTAVE us (128us), and
+// the last bucket anything over 2^(LAST_OCTAVE+1) us (about 134s).  Each
+// bucket counts the values up to and including its bound, as the le label
+// it is reported under says.
+#define LATENCY_SUB_BITS 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define FIRST_OCTAVE 7
+#define LAST_OCTAVE 26
+#define LATENCY_BUCKETS ((LAST_OCTAVE - FIRST_OCTAVE + 1) * LATENCY_SUB_BUCKETS + 2)
+
+// The status codes counted separately. Anything else is counted as "other".
+static const int statusCodes[] = { 200, 202, 304, 400, 403, 404, 429, 500, 503 };
+#define STATUS_SLOTS (sizeof(statusCodes) / sizeof(statusCodes[0]) + 1)
+
+static const char* eventNames[METRIC_EVENT_COUNT][2] = {
+    { "xtwsd_tcd_opens_total", "Harmonics files opened by libtcd" },
+    { "xtwsd_tcd_reads_total", "Records read from the harmonics files" },
+    { "xtwsd_station_loads_total", "Stations loaded by libxtide" },
+    { "xtwsd_log_lines_dropped_total", "Log lines dropped because the log writer fell behind" },
+};
+
+
+/**
+ * The counters one thread records into. Only the owning thread changes
+ * them, so relaxed atomics are enough and the cache lines are never shared
+ * with another writer.
+ */
+struct ThreadMetrics {
+    atomic<unsigned long> inFlight[MAX_ROUTES];
+    atomic<unsigned long> finished[MAX_ROUTES];
+    atomic<unsigned long> statuses[MAX_ROUTES][STATUS_SLOTS];
+    atomic<unsigned long> latency[MAX_ROUTES][LATENCY_BUCKETS];
+    atomic<unsigned long> latencySumUs[MAX_ROUTES];
+    atomic<unsigned long> events[METRIC_EVENT_COUNT];
+
+    ThreadMetrics() {
+        reset();
+    }
+
+    void reset() {
+        for (int r = 0; r < MAX_ROUTES; r++) {
+            inFlight[r] = 0;
+            finished[r] = 0;
+            latencySumUs[r] = 0;
+            for (size_t s = 0; s < STATUS_SLOTS; s++) {
+                statuses[r][s] = 0;
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                latency[r][b] = 0;
+            }
+        }
+        for (int e = 0; e < METRIC_EVENT_COUNT; e++) {
+            events[e] = 0;
+        }
+    }
+};
+
+
+/**
+ * Everything registered so far.  Function local, so it can be used from
+ * other files' static initializers.
+ */
+struct MetricsRegistry {
+    mutex lock;
+    vector<string> routes;
+    vector<pair<string, function<CacheStats()>>> caches;
+
+    // The counters of every running thread, the totals of the threads
+    // that have exited (so totals never go backwards), and counters
+    // that exited threads have given back for reuse.
+    vector<ThreadMetrics*> threads;
+    ThreadMetrics retired;
+    vector<ThreadMetrics*> freeMetrics;
+};
+
+static MetricsRegistry& registry() {
+    static MetricsRegistry* pRegistry = new MetricsRegistry();
+    return *pRegistry;
+}
+
+
+// Only the owning thread writes a counter, so a plain load and store is
+// enough (and, unlike fetch_add, needs no locked instruction).
+static inline void add(atomic<unsigned long>& counter, long n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+static inline void addTo(atomic<unsigned long>& total, const atomic<unsigned long>& counter) {
+    add(total, counter.load(memory_order_relaxed));
+}
+
+
+/**
+ * Holds the current thread's counters.  When the thread exits they are
+ * added to the retired totals and given back for another thread to use.
+ */
+struct MetricsHolder {
+    ThreadMetrics* pMetrics;
+
+    MetricsHolder() : pMetrics(NULL) {}
+
+    ~MetricsHolder() {
+        if (pMetrics == NULL) {
+            return;
+        }
+
+        MetricsRegistry& reg = registry();
+        lock_guard<mutex> guard(reg.lock);
+        ThreadMetrics& total = reg.retired;
+        for (int r = 0; r < MAX_ROUTES; r++) {
+            addTo(total.inFlight[r], pMetrics->inFlight[r]);
+            addTo(total.finished[r], pMetrics->finished[r]);
+            addTo(total.latencySumUs[r], pMetrics->latencySumUs[r]);
+            for (size_t s = 0; s < STATUS_SLOTS; s++) {
+                addTo(total.statuses[r][s], pMetrics->statuses[r][s]);
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                addTo(total.latency[r][b], pMetrics->latency[r][b]);
+            }
+        }
+        for (int e = 0; e < METRIC_EVENT_COUNT; e++) {
+            addTo(total.events[e], pMetrics->events[e]);
+        }
+
+        pMetrics->reset();
+        reg.threads.erase(find(reg.threads.begin(), reg.threads.end(), pMetrics));
+        reg.freeMetrics.push_back(pMetrics);
+    }
+};
+
+
+static ThreadMetrics& threadMetrics() {
+    static thread_local MetricsHolder holder;
+    if (holder.pMetrics == NULL) {
+        MetricsRegistry& reg = registry();
+        lock_guard<mutex> guard(reg.lock);
+        if (!reg.freeMetrics.empty()) {
+            holder.pMetrics = reg.freeMetrics.back();
+            reg.freeMetrics.pop_back();
+        }
+        else {
+            holder.pMetrics = new ThreadMetrics();
+        }
+        reg.threads.push_back(holder.pMetrics);
+    }
+    return *holder.pMetrics;
+}
+
+
+
+int registerRoute(const string& routeName) {
+    MetricsRegistry& reg = registry();
+    lock_guard<mutex> guard(reg.lock);
+    for (size_t r = 0; r < reg.routes.size(); r++) {
+        if (reg.routes[r] == routeName) {
+            return r;
+        }
+    }
+    if (reg.routes.size() >= MAX_ROUTES) {
+        return -1;
+    }
+    reg.routes.push_back(routeName);
+    return reg.routes.size() - 1;
+}
+
+
+
+RequestTimer::RequestTimer(int routeId) :
+    routeId(routeId),
+    started(chrono::steady_clock::now()),
+    finished(false) {
+
+    if (routeId >= 0) {
+        add(threadMetrics().inFlight[routeId], 1);
+    }
+}
+
+
+RequestTimer::~RequestTimer() {
+    if (!finished) {
+        finish(500);
+    }
+}
+
+
+unsigned long RequestTimer::elapsedUs() const {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+}
+
+
+/**
+ * Returns the latency bucket us belongs in
+ */
+static int latencyBucket(unsigned long us) {
+    if (us <= (1UL << FIRST_OCTAVE)) {
+        return 0;
+    }
+
+    // Work with us - 1, so a value that is exactly a bucket's bound
+    // lands in that bucket rather than the next one up.
+    unsigned long v = us - 1;
+    int octave = (int) (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(v);
+    if (octave > LAST_OCTAVE) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int sub = (int) (v >> (octave - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS;
+    return 1 + (octave - FIRST_OCTAVE) * LATENCY_SUB_BUCKETS + sub;
+}
+
+
+/**
+ * Returns the largest value, in microseconds, counted by bucket (which
+ * must not be the last one)
+ */
+static unsigned long latencyBound(int bucket) {
+    if (bucket == 0) {
+        return 1UL << FIRST_OCTAVE;
+    }
+    int octave = FIRST_OCTAVE + (bucket - 1) / LATENCY_SUB_BUCKETS;
+    int sub = (bucket - 1) % LATENCY_SUB_BUCKETS + 1;
+    return (1UL << (octave - LATENCY_SUB_BITS)) * (LATENCY_SUB_BUCKETS + sub);
+}
+
+
+
+void RequestTimer::finish(int statusCode) {
+    if (finished) {
+        return;
+    }
+    finished = true;
+    if (routeId < 0) {
+        return;
+    }
+
+    unsigned long us = elapsedUs();
+    int bucket = latencyBucket(us);
+
+    size_t slot = 0;
+    while (slot < STATUS_SLOTS - 1 && statusCodes[slot] != statusCode) {
+        slot++;
+    }
+
+    ThreadMetrics& m = threadMetrics();
+    add(m.inFlight[routeId], -1);
+    add(m.finished[routeId], 1);
+    add(m.statuses[routeId][slot], 1);
+    add(m.latency[routeId][bucket], 1);
+    add(m.latencySumUs[routeId], us);
+}
+
+
+
+void countEvent(MetricEvent event) {
+    add(threadMetrics().events[event], 1);
+}
+
+
+
+bool registerCache(const string& cacheName, function<CacheStats()> getStats) {
+    MetricsRegistry& reg = registry();
+    lock_guard<mutex> guard(reg.lock);
+    reg.caches.push_back(make_pair(cacheName, getStats));
+    return true;
+}
+
+
+
+static void appendHeader(string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+
+static void appendSample(string& out, const string& name, const string& labels, double val) {
+    char num[32];
+    snprintf(num, sizeof(num), "%.17g", val);
+    out += name;
+    if (!labels.empty()) {
+        out += "{" + labels + "}";
+    }
+    out += " ";
+    out += num;
+    out += "\n";
+}
+
+
+
+void renderMetrics(string& out) {
+
+    MetricsRegistry& reg = registry();
+
+    // Add up every thread's counters. Each value is read atomically, so
+    // the totals may be a request or two apart but are never torn.
+    vector<string> routes;
+    vector<pair<string, function<CacheStats()>>> caches;
+    vector<unsigned long> inFlight(MAX_ROUTES), finished(MAX_ROUTES), sumUs(MAX_ROUTES);
+    vector<vector<unsigned long>> statuses(MAX_ROUTES, vector<unsigned long>(STATUS_SLOTS));
+    vector<vector<unsigned long>> latency(MAX_ROUTES, vector<unsigned long>(LATENCY_BUCKETS));
+    vector<unsigned long> events(METRIC_EVENT_COUNT);
+    {
+        lock_guard<mutex> guard(reg.lock);
+        routes = reg.routes;
+        caches = reg.caches;
+        vector<ThreadMetrics*> counted = reg.threads;
+        counted.push_back(&reg.retired);
+        for (ThreadMetrics* pMetrics : counted) {
+            for (size_t r = 0; r < routes.size(); r++) {
+                inFlight[r] += pMetrics->inFlight[r].load(memory_order_relaxed);
+                finished[r] += pMetrics->finished[r].load(memory_order_relaxed);
+                sumUs[r] += pMetrics->latencySumUs[r].load(memory_order_relaxed);
+                for (size_t s = 0; s < STATUS_SLOTS; s++) {
+                    statuses[r][s] += pMetrics->statuses[r][s].load(memory_order_relaxed);
+                }
+                for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                    latency[r][b] += pMetrics->latency[r][b].load(memory_order_relaxed);
+                }
+            }
+            for (int e = 0; e < METRIC_EVENT_COUNT; e++) {
+                events[e] += pMetrics->events[e].load(memory_order_relaxed);
+            }
+        }
+    }
+
+    appendHeader(out, "xtwsd_requests_total", "counter", "Requests handled, by route and status code.");
+    for (size_t r = 0; r < routes.size(); r++) {
+        for (size_t s = 0; s < STATUS_SLOTS; s++) {
+            if (statuses[r][s] > 0) {
+                string code = (s < STATUS_SLOTS - 1) ? to_string(statusCodes[s]) : "other";
+                appendSample(out, "xtwsd_requests_total", "route=\"" + routes[r] + "\",code=\"" + code + "\"", statuses[r][s]);
+            }
+        }
+    }
+
+    appendHeader(out, "xtwsd_requests_in_flight", "gauge", "Requests being handled right now.");
+    for (size_t r = 0; r < routes.size(); r++) {
+        appendSample(out, "xtwsd_requests_in_flight", "route=\"" + routes[r] + "\"", (long) inFlight[r]);
+    }
+
+    appendHeader(out, "xtwsd_request_duration_seconds", "histogram", "Time taken to handle requests, by route.");
+    for (size_t r = 0; r < routes.size(); r++) {
+        string route = "route=\"" + routes[r] + "\"";
+        unsigned long cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+            cumulative += latency[r][b];
+            char le[32];
+            snprintf(le, sizeof(le), "%.9g", (double) latencyBound(b) / 1e6);
+            appendSample(out, "xtwsd_request_duration_seconds_bucket", route + ",le=\"" + le + "\"", cumulative);
+        }
+        appendSample(out, "xtwsd_request_duration_seconds_bucket", route + ",le=\"+Inf\"", finished[r]);
+        appendSample(out, "xtwsd_request_duration_seconds_sum", route, sumUs[r] / 1e6);
+        appendSample(out, "xtwsd_request_duration_seconds_count", route, finished[r]);
+    }
+
+    vector<CacheStats> cacheStats;
+    for (auto& cache : caches) {
+        cacheStats.push_back(cache.second());
+    }
+
+    appendHeader(out, "xtwsd_cache_hits_total", "counter", "Cache lookups that found a value.");
+    for (size_t c = 0; c < caches.size(); c++) {
+        appendSample(out, "xtwsd_cache_hits_total", "cache=\"" + caches[c].first + "\"", cacheStats[c].hits);
+    }
+    appendHeader(out, "xtwsd_cache_misses_total", "counter", "Cache lookups that found nothing.");
+    for (size_t c = 0; c < caches.size(); c++) {
+        appendSample(out, "xtwsd_cache_misses_total", "cache=\"" + caches[c].first + "\"", cacheStats[c].misses);
+    }
+    appendHeader(out, "xtwsd_cache_entries", "gauge", "Values held in the cache.");
+    for (size_t c = 0; c < caches.size(); c++) {
+        appendSample(out, "xtwsd_cache_entries", "cache=\"" + caches[c].first + "\"", cacheStats[c].entries);
+    }
+    appendHeader(out, "xtwsd_cache_max_entries", "gauge", "Values the cache can hold.");
+    for (size_t c = 0; c < caches.size(); c++) {
+        appendSample(out, "xtwsd_cache_max_entries", "cache=\"" + caches[c].first + "\"", cacheStats[c].maxEntries);
+    }
+    appendHeader(out, "xtwsd_cache_bytes", "gauge", "Bytes held in the cache, for caches that count them.");
+    for (size_t c = 0; c < caches.size(); c++) {
+        appendSample(out, "xtwsd_cache_bytes", "cache=\"" + caches[c].first + "\"", cacheStats[c].bytes);
+    }
+
+    for (int e = 0; e < METRIC_EVENT_COUNT; e++) {
+        appendHeader(out, eventNames[e][0], "counter", eventNames[e][1]);
+        appendSample(out, eventNames[e][0], "", events[e]);
+    }
+}
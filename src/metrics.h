@@ -0,0 +1,136 @@
+#ifndef _metrics_h_
+#define _metrics_h_
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include "lrucache.h"
+
+/**
+  * metrics.h
+  * -------------------------
+  * Request and cache statistics, reported by GET /metrics in the
+  * Prometheus text format.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * Things that are counted (see countEvent())
+ */
+enum MetricEvent {
+    TCD_OPEN,       // libtcd opened a harmonics file
+    TCD_READ,       // A record was read with libtcd
+    STATION_LOAD,   // libxtide loaded a station
+    LOG_DROPPED,    // A log line was dropped because its queue was full
+    METRIC_EVENT_COUNT
+};
+
+
+/**
+ * Returns the id used to record requests for the named route.  Routes
+ * registered more than once with the same name share an id.  At most
+ * 32 routes can be registered; -1 is returned after that.
+ */
+extern int registerRoute(const std::string& routeName);
+
+
+/**
+ * Counts and times one request to a route.  Create one when the request
+ * arrives and call finish() with the status code once it has been handled,
+ * on the same thread.  A request that is never finished is counted as a 500.
+ *
+ * Every thread records into its own counters, so recording never waits
+ * on another thread.  The counters are only added up when they are
+ * reported.
+ */
+class RequestTimer {
+
+    public:
+        explicit RequestTimer(int routeId);
+
+        ~RequestTimer();
+
+        void finish(int statusCode);
+
+        /**
+         * Microseconds since the timer was started
+         */
+        unsigned long elapsedUs() const;
+
+    private:
+        int routeId;
+        std::chrono::steady_clock::time_point started;
+        bool finished;
+
+        RequestTimer(const RequestTimer&) = delete;
+        RequestTimer& operator=(const RequestTimer&) = delete;
+};
+
+
+/**
+ * Counts one occurrence of event
+ */
+extern void countEvent(MetricEvent event);
+
+
+
+/**
+ * A snapshot of a cache's statistics
+ */
+struct CacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    size_t entries;
+    size_t maxEntries;
+    size_t bytes;
+};
+
+
+/**
+ * Adds a cache to the metrics report.  getStats is called every time
+ * the metrics are reported.  Returns TRUE, so it can be used to initialize
+ * a static.
+ */
+extern bool registerCache(const std::string& cacheName, std::function<CacheStats()> getStats);
+
+
+template <typename V>
+bool registerCache(const std::string& cacheName, LruCache<V>& cache) {
+    LruCache<V>* pCache = &cache;
+    return registerCache(cacheName, [pCache] {
+        CacheStats stats = { pCache->getHits(), pCache->getMisses(), pCache->size(), pCache->getMaxEntries(),
+                             pCache->getBytes() };
+        return stats;
+    });
+}
+
+
+
+/**
+ * Appends the metrics of every route, cache and event, in the Prometheus
+ * text exposition format, to out.
+ */
+extern void renderMetrics(std::string& out);
+
+#endif
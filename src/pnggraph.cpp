@@ -0,0 +1,59 @@
+#include "pnggraph.h"
+
+#include <png.h>
+
+using namespace std;
+
+
+static void appendPngData(png_structp png, png_bytep data, png_size_t length) {
+    string* pOut = static_cast<string*>(png_get_io_ptr(png));
+    pOut->append(reinterpret_cast<const char*>(data), length);
+}
+
+
+static void flushPngData(png_structp png) {
+    // Nothing to do - the data is already in memory
+}
+
+
+
+bool PngGraph::encode(string& out, int level) {
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png == NULL) {
+        return false;
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        png_destroy_write_struct(&png, NULL);
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        // libpng errors land here
+        png_destroy_write_struct(&png, &info);
+        out.clear();
+        return false;
+    }
+
+    png_set_write_fn(png, &out, appendPngData, flushPngData);
+
+    png_set_compression_level(png, level);
+    if (level <= 1) {
+        // Row filtering costs more time than it saves at low levels
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    }
+
+    png_set_IHDR(png, info, _xSize, _ySize, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for (unsigned int y = 0; y < _ySize; y++) {
+        png_write_row(png, &(rgb[y * _xSize * 3]));
+    }
+
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef _pnggraph_h_
+#define _pnggraph_h_
+
+#include <string>
+
+#include "_libxtide.h"
+
+/**
+  * pnggraph.h
+  * -------------------------
+  * A libxtide RGBGraph that can encode itself as a PNG image in memory.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * RGBGraph::writeAsPNG() can only write through a global callback and
+ * always uses libpng's default compression.  PngGraph encodes the graph's
+ * pixels itself, into a string, with a caller chosen zlib compression level.
+ */
+class PngGraph : public libxtide::RGBGraph {
+
+    public:
+        PngGraph(unsigned int xSize, unsigned int ySize) : RGBGraph(xSize, ySize) {}
+
+        /**
+         * Encodes the graph drawn so far as a PNG image into out.  level is
+         * the zlib compression level, from 0 (none) to 9 (smallest). Returns
+         * FALSE if libpng reported an error.
+         */
+        bool encode(std::string& out, int level);
+};
+
+#endif
@@ -0,0 +1,656 @@
+#include "predict.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "catalog.h"
+#include "dataset.h"
+#include "json_fifo.h"
+#include "jsonxt.h"
+#include "lrucache.h"
+#include "metrics.h"
+#include "pnggraph.h"
+#include "sparkline.h"
+#include "singleflight.h"
+#include "trace.h"
+#include "workpool.h"
+#include "xtutil.h"
+
+using namespace std;
+using namespace libxtide;
+
+
+static SingleFlight<RenderedBody> predictionFlights;
+static SingleFlight<RenderedBody> graphFlights;
+static SingleFlight<RenderedBody> sparkFlights;
+
+
+/**
+ * Completed /location results, keyed by predictionKey(). The size can be
+ * set with XTWSD_PREDICTION_CACHE (0 disables the cache)
+ */
+static LruCache<RenderedBody>& predictionCache() {
+    static LruCache<RenderedBody> cache(xtutil::getEnvInt("XTWSD_PREDICTION_CACHE", 1024));
+    static bool registered = registerCache("prediction", cache);
+    return cache;
+}
+
+
+/**
+ * Rendered graphs, keyed by graphKey(). The number of graphs can be set
+ * with XTWSD_GRAPH_CACHE (0 disables the cache), and the megabytes they
+ * may take up with XTWSD_GRAPH_CACHE_MB.  A large PNG with little
+ * compression is tens of megabytes, so the count alone does not bound it.
+ */
+static LruCache<RenderedBody>& graphCache() {
+    static LruCache<RenderedBody> cache(xtutil::getEnvInt("XTWSD_GRAPH_CACHE", 512),
+                                        (size_t) xtutil::getEnvInt("XTWSD_GRAPH_CACHE_MB", 64) * 1024 * 1024);
+    static bool registered = registerCache("graph", cache);
+    return cache;
+}
+
+
+/**
+ * Graphs requested without a start time start at the current time rounded
+ * down to this many seconds (XTWSD_GRAPH_BUCKET), so that requests for
+ * "now" share one rendering for the whole bucket.
+ */
+static time_t graphBucket() {
+    static time_t bucket = max(1, xtutil::getEnvInt("XTWSD_GRAPH_BUCKET", 3600));
+    return bucket;
+}
+
+
+// Speculative prefetching of the next prediction window - see enablePrefetch()
+static WorkPool* pPrefetchPool = NULL;
+static WorkPool* pForegroundPool = NULL;
+static unsigned int prefetchBudget = 0;
+static mutex prefetchLock;
+static time_t prefetchMinute = 0;
+static unsigned int prefetchesThisMinute = 0;
+
+
+string predictionKey(const PredictionParams& params) {
+    string key = "location:";
+    key += xtutil::stationCacheKey(params.stationIndex);
+    key += ":";
+    key += to_string(params.start);
+    key += ":";
+    key += to_string(params.days);
+    key += params.detailed ? ":detailed" : ":maxmin";
+    key += params.local ? ":local" : ":utc";
+    return key;
+}
+
+
+string graphKey(const GraphParams& params) {
+    string key = "graph:";
+    key += xtutil::stationCacheKey(params.stationIndex);
+    key += ":";
+    key += to_string(params.start);
+    key += ":";
+    key += to_string(params.width);
+    key += "x";
+    key += to_string(params.height);
+    if (params.png) {
+        key += ":png";
+        key += to_string(params.compressionLevel);
+    }
+    return key;
+}
+
+
+
+string sparkKey(const SparkParams& params) {
+    string key = "spark:";
+    key += xtutil::stationCacheKey(params.stationIndex);
+    key += ":";
+    key += to_string(params.start);
+    key += ":";
+    key += to_string(params.hours);
+    key += ":";
+    key += to_string(params.width);
+    key += "x";
+    key += to_string(params.height);
+    key += params.json ? ":json" : ":svg";
+    return key;
+}
+
+
+
+/**
+ * Returns the "start" query parameter interpreted in the specified time
+ * zone. If no start was specified, the current time rounded down to a
+ * multiple of roundTo seconds is returned (rounding lets requests for
+ * "now" share cached results).  -1 is returned if the value could not
+ * be parsed.
+ */
+static time_t parseStart(QueryLookup& query, const Dstr& timezone, time_t roundTo) {
+    string start = query("start");
+    if (!start.empty()) {
+        Timestamp startTime(Dstr(start.c_str()), timezone);
+        if (startTime.isNull()) {
+            return -1;
+        }
+        return startTime.timet();
+    }
+    else {
+        time_t now = std::time(nullptr);
+        return now - (now % roundTo);
+    }
+}
+
+
+// The sizes /graph will draw
+#define MIN_GRAPH_SIZE 64
+#define MAX_GRAPH_WIDTH 4000
+#define MAX_GRAPH_HEIGHT 2000
+
+// The most days /location will predict in one request
+#define MAX_PREDICTION_DAYS 366
+
+// /location predicts this many days at a time, so a cancelled request
+// stops within one chunk
+#define PREDICTION_CHUNK_DAYS 7
+
+#define SECONDS_PER_DAY ((int64_t) 60 * 60 * 24)
+
+
+/**
+ * Reads the integer query parameter name into val, or sets error if it
+ * is not a number.
+ */
+static bool intParam(QueryLookup& query, const char* name, int defaultVal, int& val, string& error) {
+    string str = query(name);
+    if (str.empty()) {
+        val = defaultVal;
+        return true;
+    }
+    try {
+        size_t used;
+        val = stoi(str, &used);
+        if (used == str.size()) {
+            return true;
+        }
+    }
+    catch (const std::logic_error&) {
+    }
+    error = name;
+    error += " must be a number";
+    return false;
+}
+
+
+/**
+ * Resolves stationId to a valid station index, or sets error
+ */
+static bool parseStation(const string& stationId, int& stationIndex, string& error) {
+    TraceSpan span(TRACE_RESOLVE);
+    stationIndex = xtutil::getStationIndex(stationId);
+    if (!xtutil::stationIndexValid(stationIndex)) {
+        error = "Invalid station Id: ";
+        error += stationId;
+        return false;
+    }
+    return true;
+}
+
+
+
+bool parsePredictionRequest(const string& stationId, QueryLookup query, PredictionParams& params, string& error) {
+
+    if (!parseStation(stationId, params.stationIndex, error)) {
+        return false;
+    }
+
+    StationRef* pRef = currentStations()[params.stationIndex];
+
+    int local;
+    int detailed;
+    if (!intParam(query, "local", 0, local, error) ||
+        !intParam(query, "days", 1, params.days, error) ||
+        !intParam(query, "detailed", 0, detailed, error)) {
+        return false;
+    }
+    if (params.days < 1 || params.days > MAX_PREDICTION_DAYS) {
+        error = "days must be between 1 and " + to_string(MAX_PREDICTION_DAYS);
+        return false;
+    }
+    params.local = (local != 0);
+    params.detailed = (detailed == 1);
+    params.start = parseStart(query, params.local ? pRef->timezone : Dstr(UTC), 60);
+
+    if (params.start == -1) {
+        error = "Invalid start time";
+        return false;
+    }
+    return true;
+}
+
+
+
+bool parseGraphRequest(const string& stationId, QueryLookup query, GraphParams& params, string& error) {
+
+    // /graph/{stationId}.png asks for a PNG image instead of SVG
+    const string pngSuffix = ".png";
+    string id = stationId;
+    params.png = id.size() > pngSuffix.size() &&
+                 id.compare(id.size() - pngSuffix.size(), pngSuffix.size(), pngSuffix) == 0;
+    if (params.png) {
+        id.erase(id.size() - pngSuffix.size());
+    }
+
+    if (!parseStation(id, params.stationIndex, error)) {
+        return false;
+    }
+
+    params.startIsNow = query("start").empty();
+    params.start = parseStart(query, Dstr(UTC), graphBucket());
+
+    // Graphs of "now" are rendered constantly, so favor encoding speed over size
+    int width;
+    int height;
+    if (!intParam(query, "width", 1200, width, error) ||
+        !intParam(query, "height", 400, height, error) ||
+        !intParam(query, "compression", params.startIsNow ? 1 : 6, params.compressionLevel, error)) {
+        return false;
+    }
+    // Rendering needs width * height * 3 bytes, so keep both sensible
+    if (width < MIN_GRAPH_SIZE || width > MAX_GRAPH_WIDTH || height < MIN_GRAPH_SIZE || height > MAX_GRAPH_HEIGHT) {
+        error = "width must be between " + to_string(MIN_GRAPH_SIZE) + " and " + to_string(MAX_GRAPH_WIDTH) +
+                ", and height between " + to_string(MIN_GRAPH_SIZE) + " and " + to_string(MAX_GRAPH_HEIGHT);
+        return false;
+    }
+    params.width = width;
+    params.height = height;
+    if (params.compressionLevel < 0 || params.compressionLevel > 9) {
+        error = "compression must be between 0 and 9";
+        return false;
+    }
+
+    if (params.start == -1) {
+        error = "Invalid start time";
+        return false;
+    }
+    return true;
+}
+
+
+
+bool parseSparkRequest(const string& stationId, QueryLookup query, SparkParams& params, string& error) {
+
+    if (!parseStation(stationId, params.stationIndex, error)) {
+        return false;
+    }
+
+    params.startIsNow = query("start").empty();
+    params.start = parseStart(query, Dstr(UTC), graphBucket());
+    int hours;
+    int width;
+    int height;
+    if (!intParam(query, "hours", 48, hours, error) ||
+        !intParam(query, "w", 200, width, error) ||
+        !intParam(query, "h", 40, height, error)) {
+        return false;
+    }
+    params.json = query("format") == "json";
+
+    if (params.start == -1) {
+        error = "Invalid start time";
+        return false;
+    }
+    if (hours < 1 || hours > 24 * 31 || width < 2 || width > 2000 || height < 2 || height > 2000) {
+        error = "hours, w or h is out of range";
+        return false;
+    }
+    params.hours = hours;
+    params.width = width;
+    params.height = height;
+    return true;
+}
+
+
+
+static RenderedBody renderPrediction(const PredictionParams& params) {
+
+    RenderedBody out;
+
+    StationRef* pRef = currentStations()[params.stationIndex];
+    StationLease station = loadStation(params.stationIndex);
+    if (WorkPool::cancelled()) {
+        return out;
+    }
+
+    TraceSpan buildSpan(TRACE_BUILD);
+
+    json j;
+    tojson(station.get(), pRef, j);
+
+    Dstr timezone(UTC);
+    if (params.local) {
+        timezone = station->timezone;
+    }
+
+    Station::TideEventsFilter filter = Station::TideEventsFilter::maxMin;
+    if (params.detailed) {
+        filter = Station::TideEventsFilter::noFilter;
+    }
+
+    // Predict a chunk at a time, so an abandoned request does not keep a
+    // thread busy for the whole range.
+    TideEventsOrganizer eventList;
+    {
+        TraceSpan span(TRACE_PREDICT);
+        for (int day = 0; day < params.days; day += PREDICTION_CHUNK_DAYS) {
+            int chunkDays = min(PREDICTION_CHUNK_DAYS, params.days - day);
+            Timestamp chunkStart(params.start + day * SECONDS_PER_DAY);
+            Timestamp chunkEnd = chunkStart + Interval(chunkDays * SECONDS_PER_DAY);
+            station->predictTideEvents(chunkStart, chunkEnd, eventList, filter);
+            if (WorkPool::cancelled()) {
+                return out;
+            }
+        }
+    }
+    setEvents(eventList, j, &timezone);
+
+    TraceSpan dumpSpan(TRACE_DUMP);
+    out.contentType = "application/json";
+    out.body = j.dump(-1, ' ', true);
+    out.etag = xtutil::makeETag(out.body);
+    out.complete = true;
+    return out;
+}
+
+
+
+static RenderedBody renderPngGraph(const GraphParams& params) {
+
+    RenderedBody out;
+
+    StationLease station = loadStation(params.stationIndex);
+
+    PngGraph png(params.width, params.height);
+    {
+        TraceSpan span(TRACE_RENDER);
+        png.drawTides(station.get(), Timestamp(params.start));
+    }
+    if (WorkPool::cancelled()) {
+        return out;
+    }
+    TraceSpan dumpSpan(TRACE_DUMP);
+    if (!png.encode(out.body, params.compressionLevel)) {
+        return out;
+    }
+
+    out.contentType = "image/png";
+    out.etag = xtutil::makeETag(out.body);
+    out.complete = true;
+    return out;
+}
+
+
+
+static RenderedBody renderGraph(const GraphParams& params) {
+
+    if (params.png) {
+        return renderPngGraph(params);
+    }
+
+    RenderedBody out;
+
+    StationLease station = loadStation(params.stationIndex);
+
+    SVGGraph svg(params.width, params.height);
+    Dstr text_out;
+    {
+        TraceSpan span(TRACE_RENDER);
+        svg.drawTides(station.get(), Timestamp(params.start));
+    }
+    if (WorkPool::cancelled()) {
+        return out;
+    }
+    TraceSpan dumpSpan(TRACE_DUMP);
+    svg.print(text_out);
+
+    out.contentType = "image/svg+xml";
+    out.body.assign(text_out.aschar(), text_out.length());
+    out.etag = xtutil::makeETag(out.body);
+    out.complete = true;
+    return out;
+}
+
+
+
+static RenderedBody renderSpark(const SparkParams& params) {
+
+    RenderedBody out;
+
+    StationLease station = loadStation(params.stationIndex);
+
+    // Sample a few points per pixel so the decimation has real
+    // peaks and troughs to choose from
+    const unsigned int samplesPerPixel = 4;
+    size_t sampleCount = params.width * samplesPerPixel;
+    double step = params.hours * 3600.0 / (sampleCount - 1);
+
+    vector<sparkline::Point> samples(sampleCount);
+    {
+        TraceSpan span(TRACE_PREDICT);
+        for (size_t i = 0; i < sampleCount; i++) {
+            time_t t = params.start + (time_t) (i * step);
+            samples[i].x = t;
+            samples[i].y = station->predictTideLevel(Timestamp(t)).val();
+        }
+    }
+    if (WorkPool::cancelled()) {
+        return out;
+    }
+
+    TraceSpan renderSpan(TRACE_RENDER);
+    vector<sparkline::Point> points = sparkline::decimate(samples, params.width);
+
+    if (params.json) {
+        out.contentType = "application/json";
+        out.body = sparkline::toJson(points);
+    }
+    else {
+        out.contentType = "image/svg+xml";
+        out.body = sparkline::toSvg(points, params.width, params.height);
+    }
+    out.etag = xtutil::makeETag(out.body);
+    out.complete = true;
+    return out;
+}
+
+
+
+/**
+ * Runs render through flights. If the computation we ended up sharing was
+ * abandoned because the thread that started it was cancelled, and we
+ * ourselves have not been, the work is done again.  A render that simply
+ * failed is not: it would only fail again.
+ */
+template <typename P>
+static RenderedBody coalesce(SingleFlight<RenderedBody>& flights, const string& key,
+                             RenderedBody (*render)(const P&), const P& params) {
+
+    RenderedBody out = flights.run(key, [render, &params] {
+        RenderedBody rendered = render(params);
+        rendered.cancelled = !rendered.complete && WorkPool::cancelled();
+        return rendered;
+    });
+    if (out.cancelled && !WorkPool::cancelled()) {
+        out = render(params);
+    }
+    return out;
+}
+
+
+
+/**
+ * Returns the prediction from the cache, computing (and caching) it if need be.
+ */
+static RenderedBody lookupPrediction(const PredictionParams& params) {
+
+    string key = predictionKey(params);
+
+    RenderedBody out;
+    if (predictionCache().get(key, out)) {
+        return out;
+    }
+
+    out = coalesce(predictionFlights, key, renderPrediction, params);
+    if (out.complete) {
+        predictionCache().put(key, out);
+    }
+    return out;
+}
+
+
+
+/**
+ * Returns TRUE if there is room left in this minute's prefetch budget,
+ * and uses up one unit of it.
+ */
+static bool takePrefetchBudget() {
+    lock_guard<mutex> guard(prefetchLock);
+    time_t minute = std::time(nullptr) / 60;
+    if (minute != prefetchMinute) {
+        prefetchMinute = minute;
+        prefetchesThisMinute = 0;
+    }
+    if (prefetchesThisMinute >= prefetchBudget) {
+        return false;
+    }
+    prefetchesThisMinute++;
+    return true;
+}
+
+
+
+/**
+ * Schedules the prediction window that immediately follows params, so it
+ * is already in the cache when the client pages forward.
+ */
+static void prefetchNext(const PredictionParams& params) {
+
+    if (pPrefetchPool == NULL) {
+        return;
+    }
+
+    PredictionParams next = params;
+    next.start = params.start + params.days * SECONDS_PER_DAY;
+
+    if (predictionCache().contains(predictionKey(next))) {
+        return;
+    }
+
+    // Prefetching is only worth doing with spare capacity - never
+    // when real requests are waiting for a thread.
+    if (pForegroundPool != NULL && pForegroundPool->getQueueDepth() > 0) {
+        return;
+    }
+
+    if (!takePrefetchBudget()) {
+        return;
+    }
+
+    // next.stationIndex belongs to the requester's dataset
+    shared_ptr<Dataset> dataset = currentDataset();
+
+    pPrefetchPool->post([next, dataset] {
+#ifdef __linux__
+        // Let the scheduler favor the foreground threads
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+        DatasetPin pin(dataset);
+        lookupPrediction(next);
+    });
+}
+
+
+
+void enablePrefetch(WorkPool* pPool, WorkPool* pForeground, unsigned int budgetPerMinute) {
+    pPrefetchPool = pPool;
+    pForegroundPool = pForeground;
+    prefetchBudget = budgetPerMinute;
+}
+
+
+
+RenderedBody getPrediction(const PredictionParams& params) {
+    RenderedBody out = lookupPrediction(params);
+    if (out.complete) {
+        prefetchNext(params);
+    }
+    return out;
+}
+
+
+
+RenderedBody getGraph(const GraphParams& params) {
+
+    string key = graphKey(params);
+
+    RenderedBody out;
+    if (graphCache().get(key, out)) {
+        return out;
+    }
+
+    out = coalesce(graphFlights, key, renderGraph, params);
+    if (out.complete) {
+        graphCache().put(key, out, out.body.size());
+    }
+    return out;
+}
+
+
+
+RenderedBody getSpark(const SparkParams& params) {
+
+    string key = sparkKey(params);
+
+    RenderedBody out;
+    if (graphCache().get(key, out)) {
+        return out;
+    }
+
+    out = coalesce(sparkFlights, key, renderSpark, params);
+    if (out.complete) {
+        graphCache().put(key, out, out.body.size());
+    }
+    return out;
+}
+
+
+
+static unsigned int maxAge(bool startIsNow, time_t start) {
+    if (startIsNow) {
+        time_t left = start + graphBucket() - std::time(nullptr);
+        return left > 0 ? left : 0;
+    }
+    else {
+        static unsigned int explicitMaxAge = xtutil::getEnvInt("XTWSD_GRAPH_MAX_AGE", 3600);
+        return explicitMaxAge;
+    }
+}
+
+
+unsigned int graphMaxAge(const GraphParams& params) {
+    return maxAge(params.startIsNow, params.start);
+}
+
+
+unsigned int graphMaxAge(const SparkParams& params) {
+    return maxAge(params.startIsNow, params.start);
+}
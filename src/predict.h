@@ -0,0 +1,175 @@
+#ifndef _predict_h_
+#define _predict_h_
+
+#include <ctime>
+#include <functional>
+#include <string>
+
+#include "_libxtide.h"
+
+/**
+  * predict.h
+  * -------------------------
+  * Tide prediction and graph rendering for the /location and /graph
+  * resources. Requests are described by normalized parameter structures
+  * so identical requests can be recognized and share a single result.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+class WorkPool;
+
+
+/**
+ * A fully serialized response body.  complete is FALSE if the work
+ * failed, or was abandoned part way through, in which case cancelled
+ * is TRUE (see WorkPool::cancelled())
+ */
+struct RenderedBody {
+    bool complete;
+    bool cancelled;
+    std::string contentType;
+    std::string body;
+    std::string etag;
+
+    RenderedBody() : complete(false), cancelled(false) {}
+};
+
+
+/**
+ * A normalized /location request
+ */
+struct PredictionParams {
+    int stationIndex;
+    time_t start;
+    int days;
+    bool detailed;
+    bool local;
+};
+
+
+/**
+ * A normalized /graph request
+ */
+struct GraphParams {
+    int stationIndex;
+    time_t start;
+    unsigned int width;
+    unsigned int height;
+
+    // TRUE for a PNG image (rendered with compressionLevel), FALSE for SVG
+    bool png;
+    int compressionLevel;
+
+    // TRUE if no start was requested and start is the current time
+    // rounded down to the graph time bucket. Not part of the key.
+    bool startIsNow;
+};
+
+
+/**
+ * A normalized /spark request
+ */
+struct SparkParams {
+    int stationIndex;
+    time_t start;
+    unsigned int hours;
+    unsigned int width;
+    unsigned int height;
+
+    // TRUE for a json polyline, FALSE for SVG
+    bool json;
+
+    // See GraphParams - not part of the key
+    bool startIsNow;
+};
+
+
+/**
+ * Returns the value of the named query parameter, or an empty string
+ * if the request does not have one.
+ */
+typedef std::function<std::string(const char* name)> QueryLookup;
+
+
+/**
+ * Fills params from a request's station id and query parameters.  Returns
+ * FALSE, with error set to a message suitable for a 400 response, if the
+ * request is not valid.
+ */
+extern bool parsePredictionRequest(const std::string& stationId, QueryLookup query, PredictionParams& params, std::string& error);
+extern bool parseGraphRequest(const std::string& stationId, QueryLookup query, GraphParams& params, std::string& error);
+extern bool parseSparkRequest(const std::string& stationId, QueryLookup query, SparkParams& params, std::string& error);
+
+
+/**
+ * Returns a key that is identical for any two requests that would
+ * produce the same result.
+ */
+extern std::string predictionKey(const PredictionParams& params);
+extern std::string graphKey(const GraphParams& params);
+extern std::string sparkKey(const SparkParams& params);
+
+
+/**
+ * Returns the json tide event predictions described by params.  Results
+ * are cached, and if an identical request is already being computed,
+ * its result is shared.
+ */
+extern RenderedBody getPrediction(const PredictionParams& params);
+
+
+/**
+ * Returns the SVG or PNG graph described by params.  Rendered graphs are cached,
+ * and if an identical request is already being computed, its result is
+ * shared.
+ */
+extern RenderedBody getGraph(const GraphParams& params);
+
+
+/**
+ * Returns how long (in seconds) a client or CDN may keep the graph
+ * described by params before asking for it again.  A graph of "now"
+ * lasts until the end of its time bucket.
+ */
+extern unsigned int graphMaxAge(const GraphParams& params);
+extern unsigned int graphMaxAge(const SparkParams& params);
+
+
+/**
+ * Returns a sparkline (a small, minimal graph) of the tide levels described
+ * by params.  The tide curve is sampled at several points per pixel then
+ * reduced to one point per pixel, keeping its shape.  Results are cached
+ * along with the other graphs.
+ */
+extern RenderedBody getSpark(const SparkParams& params);
+
+
+
+/**
+ * Turns on speculative prefetching. After a prediction is served, the window
+ * that immediately follows it is computed on pPool and put in the cache.
+ * Prefetches are skipped whenever pForeground has requests waiting, and no
+ * more than budgetPerMinute of them are started in any one minute.
+ */
+extern void enablePrefetch(WorkPool* pPool, WorkPool* pForeground, unsigned int budgetPerMinute);
+
+#endif
@@ -0,0 +1,306 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <thread>
+
+#ifdef __linux__
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+using namespace std;
+
+
+#define MAX_FRAMES 48
+#define MAX_SAMPLES 20000
+#define HEAP_SAMPLE_BYTES (512 * 1024)
+
+
+struct Sample {
+    int depth;
+    size_t weight;
+    void* frames[MAX_FRAMES];
+};
+
+
+// Only one profile runs at a time
+static atomic<bool> profileRunning(false);
+
+// What is being sampled right now
+static atomic<bool> cpuSampling(false);
+static atomic<bool> heapSampling(false);
+
+// Samples taken so far. Preallocated, so samples can be taken inside a
+// signal handler or operator new.
+static Sample* pSamples = NULL;
+static atomic<size_t> sampleCount(0);
+
+// Number of threads writing a sample right now
+static atomic<int> samplersActive(0);
+
+
+/**
+ * Records the current thread's stack, leaving out the innermost skip frames
+ * (the profiler's own), if sampling is still active.  Safe to call from a
+ * signal handler.
+ */
+__attribute__((noinline))
+static void takeSample(const atomic<bool>& sampling, int skip, size_t weight) {
+#ifdef __linux__
+    // Announce ourselves before checking, so runProfile() either sees us
+    // or we see that it has stopped.
+    samplersActive++;
+    size_t n = sampling.load() ? sampleCount.fetch_add(1) : MAX_SAMPLES;
+    if (n < MAX_SAMPLES) {
+        Sample& sample = pSamples[n];
+        void* frames[MAX_FRAMES + 4];
+        int depth = backtrace(frames, MAX_FRAMES + skip);
+        sample.depth = 0;
+        for (int f = skip; f < depth && sample.depth < MAX_FRAMES; f++) {
+            sample.frames[sample.depth++] = frames[f];
+        }
+        sample.weight = weight;
+    }
+    samplersActive--;
+#endif
+}
+
+
+
+#ifdef __linux__
+
+static void onProfileSignal(int /* sig */) {
+    if (cpuSampling.load(memory_order_relaxed)) {
+        int savedErrno = errno;
+        // Skip takeSample(), this handler and the signal trampoline
+        takeSample(cpuSampling, 3, 1);
+        errno = savedErrno;
+    }
+}
+
+#endif
+
+
+
+__attribute__((noinline))
+static void sampleAllocation(size_t size) {
+    static thread_local size_t untilSample = HEAP_SAMPLE_BYTES;
+    if (size < untilSample) {
+        untilSample -= size;
+        return;
+    }
+    // Skip takeSample(), sampleAllocation() and operator new
+    takeSample(heapSampling, 3, HEAP_SAMPLE_BYTES);
+    untilSample = HEAP_SAMPLE_BYTES;
+}
+
+
+
+/**
+ * Replaces the standard operator new so allocations can be sampled.  When
+ * no heap profile is running this costs one relaxed load.
+ */
+void* operator new(size_t size) {
+    void* p;
+    while ((p = malloc(size > 0 ? size : 1)) == NULL) {
+        new_handler handler = get_new_handler();
+        if (handler == NULL) {
+            throw bad_alloc();
+        }
+        handler();
+    }
+    if (heapSampling.load(memory_order_relaxed)) {
+        sampleAllocation(size);
+    }
+    return p;
+}
+
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+
+
+#ifdef __linux__
+
+/**
+ * Returns a readable name for the code at address: its demangled function
+ * name if it can be found, otherwise its module and offset.
+ */
+static string symbolize(void* address) {
+    Dl_info info;
+    if (dladdr(address, &info) == 0) {
+        char hex[32];
+        snprintf(hex, sizeof(hex), "%p", address);
+        return hex;
+    }
+
+    if (info.dli_sname != NULL) {
+        int status;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+        string name = (status == 0 && demangled != NULL) ? demangled : info.dli_sname;
+        free(demangled);
+        return name;
+    }
+
+    string module = info.dli_fname != NULL ? info.dli_fname : "?";
+    size_t slash = module.rfind('/');
+    if (slash != string::npos) {
+        module.erase(0, slash + 1);
+    }
+    char offset[32];
+    snprintf(offset, sizeof(offset), "+0x%lx",
+             (unsigned long) ((char*) address - (char*) info.dli_fbase));
+    return module + offset;
+}
+
+#endif
+
+
+
+/**
+ * Turns the samples taken into folded stacks
+ */
+static void foldSamples(size_t count, string& out) {
+#ifdef __linux__
+    map<void*, string> symbols;
+    map<string, size_t> stacks;
+
+    for (size_t n = 0; n < count; n++) {
+        Sample& sample = pSamples[n];
+        string stack;
+        for (int f = sample.depth - 1; f >= 0; f--) {
+            void* address = sample.frames[f];
+            auto it = symbols.find(address);
+            if (it == symbols.end()) {
+                // Flame graph tools split frames on ';' and the count on ' '
+                string name = symbolize(address);
+                for (char& c : name) {
+                    if (c == ';' || c == '\n') {
+                        c = ':';
+                    }
+                }
+                it = symbols.insert(make_pair(address, name)).first;
+            }
+            if (!stack.empty()) {
+                stack += ';';
+            }
+            stack += it->second;
+        }
+        if (!stack.empty()) {
+            stacks[stack] += sample.weight;
+        }
+    }
+
+    for (auto& stack : stacks) {
+        out += stack.first;
+        out += ' ';
+        out += to_string(stack.second);
+        out += '\n';
+    }
+#endif
+}
+
+
+
+ProfileResult runProfile(ProfileMode mode, unsigned int seconds, unsigned int hz, string& out, string& error) {
+
+#ifdef __linux__
+    if (mode == PROFILE_CPU && (hz < MIN_PROFILE_HZ || hz > MAX_PROFILE_HZ)) {
+        error = "hz must be between " + to_string(MIN_PROFILE_HZ) + " and " + to_string(MAX_PROFILE_HZ);
+        return PROFILE_FAILED;
+    }
+
+    if (profileRunning.exchange(true)) {
+        error = "A profile is already running";
+        return PROFILE_BUSY;
+    }
+
+    if (pSamples == NULL) {
+        pSamples = new Sample[MAX_SAMPLES];
+
+        // The first call to backtrace() may load libgcc, which is not safe
+        // inside a signal handler.
+        void* frames[2];
+        backtrace(frames, 2);
+
+        // SIGPROF terminates the process by default, so once the handler is
+        // installed it stays installed.
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = onProfileSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, NULL);
+    }
+    sampleCount = 0;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (mode == PROFILE_CPU) {
+        // tv_usec must stay below a second, so 1 hz is tv_sec = 1
+        long intervalUs = 1000000L / hz;
+        timer.it_interval.tv_sec = intervalUs / 1000000;
+        timer.it_interval.tv_usec = intervalUs % 1000000;
+        timer.it_value = timer.it_interval;
+        cpuSampling = true;
+        if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+            error = string("Could not start the profiling timer: ") + strerror(errno);
+            cpuSampling = false;
+            profileRunning = false;
+            return PROFILE_FAILED;
+        }
+    }
+    else {
+        heapSampling = true;
+    }
+
+    this_thread::sleep_for(chrono::seconds(seconds));
+
+    if (mode == PROFILE_CPU) {
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, NULL);
+    }
+    cpuSampling = false;
+    heapSampling = false;
+
+    // Let samples that were being taken as we stopped finish
+    while (samplersActive.load() > 0) {
+        this_thread::yield();
+    }
+
+    size_t count = min(sampleCount.load(), (size_t) MAX_SAMPLES);
+    foldSamples(count, out);
+    if (sampleCount.load() > MAX_SAMPLES) {
+        error = "Only the first " + to_string(MAX_SAMPLES) + " samples were kept";
+    }
+
+    profileRunning = false;
+    return PROFILE_DONE;
+#else
+    error = "Profiling is only supported on Linux";
+    return PROFILE_FAILED;
+#endif
+}
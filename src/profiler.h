@@ -0,0 +1,67 @@
+#ifndef _profiler_h_
+#define _profiler_h_
+
+#include <string>
+
+/**
+  * profiler.h
+  * -------------------------
+  * A sampling profiler that can be run inside a live server.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+enum ProfileMode {
+    // Samples the stack of whichever thread is using the CPU, hz times per
+    // second of CPU time (SIGPROF).
+    PROFILE_CPU,
+
+    // Samples the stack of a memory allocation (operator new) about once
+    // for every 512KB allocated.
+    PROFILE_HEAP
+};
+
+
+// The sampling rates PROFILE_CPU accepts
+#define MIN_PROFILE_HZ 1
+#define MAX_PROFILE_HZ 1000
+
+
+enum ProfileResult {
+    PROFILE_DONE,       // out holds the profile (error may hold a warning)
+    PROFILE_BUSY,       // Another profile is running
+    PROFILE_FAILED      // The profile could not be taken - see error
+};
+
+
+/**
+ * Profiles the whole process for the specified number of seconds and
+ * fills out with the sampled stacks in the "folded" format used by
+ * flame graph tools: one line per distinct stack, root function first,
+ * frames separated by semicolons, followed by the number of samples
+ * (PROFILE_CPU) or bytes allocated (PROFILE_HEAP).  hz must be between
+ * MIN_PROFILE_HZ and MAX_PROFILE_HZ.  Only one profile can run at a time.
+ */
+extern ProfileResult runProfile(ProfileMode mode, unsigned int seconds, unsigned int hz,
+                                std::string& out, std::string& error);
+
+#endif
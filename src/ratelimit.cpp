@@ -0,0 +1,300 @@
+#include "ratelimit.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+
+#include "xtutil.h"
+
+using namespace std;
+
+
+// Size of each limiter's bucket table
+#define SHARDS 16
+#define BUCKETS_PER_SHARD 256
+
+// How many buckets of a shard a client's key may be stored in
+#define PROBES 8
+
+
+static int64_t nowUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+RateLimiter::RateLimiter(unsigned int perMinute, unsigned int burst) :
+    perMinute(perMinute),
+    burst(burst > 0 ? burst : 1),
+    intervalUs(60000000LL / (perMinute > 0 ? perMinute : 1)),
+    pBuckets(new Bucket[SHARDS * BUCKETS_PER_SHARD]) {
+
+    for (int b = 0; b < SHARDS * BUCKETS_PER_SHARD; b++) {
+        pBuckets[b].client.store(0, memory_order_relaxed);
+        pBuckets[b].full.store(0, memory_order_relaxed);
+    }
+}
+
+
+RateLimiter::~RateLimiter() {
+    delete [] pBuckets;
+}
+
+
+
+/**
+ * Returns the bucket client's tokens are kept in, claiming one if it does
+ * not have one yet.
+ */
+RateLimiter::Bucket& RateLimiter::findBucket(uint64_t client, int64_t now) {
+
+    Bucket* pShard = pBuckets + (client % SHARDS) * BUCKETS_PER_SHARD;
+    size_t first = (client / SHARDS) % BUCKETS_PER_SHARD;
+
+    Bucket* pFree = NULL;
+    uint64_t freeClient = 0;
+    for (int p = 0; p < PROBES; p++) {
+        Bucket& bucket = pShard[(first + p) % BUCKETS_PER_SHARD];
+        uint64_t owner = bucket.client.load(memory_order_acquire);
+        if (owner == client) {
+            return bucket;
+        }
+        if (pFree == NULL && (owner == 0 || bucket.full.load(memory_order_relaxed) <= now)) {
+            // Unused, or full again, so its owner would not miss it
+            pFree = &bucket;
+            freeClient = owner;
+        }
+    }
+
+    if (pFree != NULL && pFree->client.compare_exchange_strong(freeClient, client, memory_order_acq_rel)) {
+        return *pFree;
+    }
+
+    // Nowhere to go, so share with whoever has the first bucket
+    return pShard[first];
+}
+
+
+
+unsigned int RateLimiter::admit(const string& clientKey) {
+
+    uint64_t client = hash<string>()(clientKey);
+    if (client == 0) {
+        client = 1;
+    }
+
+    int64_t now = nowUs();
+    Bucket& bucket = findBucket(client, now);
+
+    // The bucket is kept as the time it will be full again. Each request
+    // moves that time one interval further out, and a request is turned
+    // away if that would be more than burst intervals from now.
+    int64_t limit = (int64_t) burst * intervalUs;
+    int64_t full = bucket.full.load(memory_order_relaxed);
+    while (true) {
+        int64_t next = (full > now ? full : now) + intervalUs;
+        if (next - now > limit) {
+            int64_t waitUs = next - now - limit;
+            return (unsigned int) ((waitUs + 999999) / 1000000);
+        }
+        if (bucket.full.compare_exchange_weak(full, next, memory_order_relaxed)) {
+            return 0;
+        }
+    }
+}
+
+
+
+/**
+ * Reads a budget of "perMinute" or "perMinute:burst".  The burst
+ * defaults to a tenth of a minute's worth of requests.
+ */
+static RateLimiter* parseBudget(const string& budget) {
+    unsigned int perMinute = 0;
+    unsigned int burst = 0;
+    try {
+        size_t colon = budget.find(':');
+        perMinute = stoul(budget.substr(0, colon));
+        if (colon != string::npos) {
+            burst = stoul(budget.substr(colon + 1));
+        }
+    }
+    catch (...) {
+        cerr << "Invalid rate limit " << budget << " - ignored" << endl;
+        return NULL;
+    }
+
+    if (perMinute == 0) {
+        return NULL;
+    }
+    if (burst == 0) {
+        burst = max(1U, perMinute / 10);
+    }
+    return new RateLimiter(perMinute, burst);
+}
+
+
+
+/**
+ * Reads XTWSD_RATE_ROUTES, a comma separated list of route=budget
+ * entries.  A budget of 0 turns off limits for that route.
+ */
+static map<string, RateLimiter*> readRouteLimits() {
+    map<string, RateLimiter*> limits;
+
+    const char* routes = getenv("XTWSD_RATE_ROUTES");
+    if (routes == NULL) {
+        return limits;
+    }
+
+    string list = routes;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) {
+            end = list.size();
+        }
+        string entry = list.substr(start, end - start);
+        size_t equals = entry.rfind('=');
+        if (equals != string::npos) {
+            limits[entry.substr(0, equals)] = parseBudget(entry.substr(equals + 1));
+        }
+        else if (!entry.empty()) {
+            cerr << "Invalid XTWSD_RATE_ROUTES entry " << entry << " - ignored" << endl;
+        }
+        start = end + 1;
+    }
+    return limits;
+}
+
+
+
+RateLimiter* getRateLimiter(const string& routeName, RateClass rateClass) {
+
+    static map<string, RateLimiter*> routeLimits = readRouteLimits();
+    static RateLimiter* pCheap = parseBudget(to_string(xtutil::getEnvInt("XTWSD_RATE_CHEAP", 0)) + ":" +
+                                             to_string(xtutil::getEnvInt("XTWSD_RATE_CHEAP_BURST", 0)));
+    static RateLimiter* pExpensive = parseBudget(to_string(xtutil::getEnvInt("XTWSD_RATE_EXPENSIVE", 0)) + ":" +
+                                                 to_string(xtutil::getEnvInt("XTWSD_RATE_EXPENSIVE_BURST", 0)));
+
+    auto it = routeLimits.find(routeName);
+    if (it != routeLimits.end()) {
+        return it->second;
+    }
+
+    switch (rateClass) {
+        case RATE_CHEAP:
+            return pCheap;
+
+        case RATE_EXPENSIVE:
+            return pExpensive;
+
+        default:
+            return NULL;
+    }
+}
+
+
+
+/**
+ * Returns address with any port left off.  Bracketed IPv6 addresses
+ * ("[::1]:8080") lose their brackets too.  When hasPort is set, address is
+ * known to end in a port, as a connection's source does, so even a bare
+ * IPv6 address loses its last group; otherwise one is only taken off an
+ * address with a single colon.
+ */
+static string withoutPort(const string& address, bool hasPort) {
+    if (!address.empty() && address[0] == '[') {
+        size_t close = address.find(']');
+        if (close != string::npos) {
+            return address.substr(1, close - 1);
+        }
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == string::npos || address.find_first_not_of("0123456789", colon + 1) != string::npos) {
+        return address;
+    }
+    if (!hasPort && address.find(':') != colon) {
+        return address;
+    }
+    return address.substr(0, colon);
+}
+
+
+
+/**
+ * Returns s without leading or trailing blanks
+ */
+static string trimmed(const string& s) {
+    size_t start = s.find_first_not_of(" \t");
+    if (start == string::npos) {
+        return "";
+    }
+    return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+
+
+string clientAddress(const string& source, const string& forwardedFor, const set<string>& trustedProxies) {
+
+    string address = withoutPort(source, true);
+    if (trustedProxies.count(address) == 0) {
+        return address;
+    }
+
+    size_t end = forwardedFor.size();
+    while (end > 0) {
+        size_t comma = forwardedFor.rfind(',', end - 1);
+        size_t start = (comma == string::npos) ? 0 : comma + 1;
+        string entry = withoutPort(trimmed(forwardedFor.substr(start, end - start)), false);
+        if (!entry.empty()) {
+            address = entry;
+            if (trustedProxies.count(address) == 0) {
+                break;
+            }
+        }
+        if (comma == string::npos) {
+            break;
+        }
+        end = comma;
+    }
+    return address;
+}
+
+
+
+/**
+ * Reads XTWSD_TRUSTED_PROXIES
+ */
+static set<string> readTrustedProxies() {
+    set<string> proxies;
+
+    const char* env = getenv("XTWSD_TRUSTED_PROXIES");
+    if (env == NULL) {
+        return proxies;
+    }
+
+    string list = env;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) {
+            end = list.size();
+        }
+        string entry = withoutPort(trimmed(list.substr(start, end - start)), false);
+        if (!entry.empty()) {
+            proxies.insert(entry);
+        }
+        start = end + 1;
+    }
+    return proxies;
+}
+
+
+
+const set<string>& getTrustedProxies() {
+    static set<string> proxies = readTrustedProxies();
+    return proxies;
+}
@@ -0,0 +1,122 @@
+#ifndef _ratelimit_h_
+#define _ratelimit_h_
+
+#include <atomic>
+#include <set>
+#include <stdint.h>
+#include <string>
+
+/**
+  * ratelimit.h
+  * -------------------------
+  * Per client rate limits, so one busy client can not use up the server
+  * for everyone else.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * The budget a route's requests are counted against
+ */
+enum RateClass {
+    RATE_NONE,          // Not limited
+    RATE_CHEAP,         // Catalog lookups and other quick requests
+    RATE_EXPENSIVE      // Predictions, graphs and changes to the database
+};
+
+
+/**
+ * A token bucket for each client.  A client may make up to burst requests
+ * at once, and after that perMinute requests a minute.
+ *
+ * Clients are hashed into a fixed size table split into shards, and each
+ * bucket is a single atomic that is updated with compare-and-swap, so
+ * admit() never takes a lock.  Buckets that have filled up again are
+ * reused by other clients.  If a client can find no bucket of its own,
+ * it shares one with another client.
+ */
+class RateLimiter {
+
+    public:
+        RateLimiter(unsigned int perMinute, unsigned int burst);
+
+        ~RateLimiter();
+
+        /**
+         * Takes a token from clientKey's bucket.  Returns 0 if there was
+         * one, or the number of seconds until there will be.
+         */
+        unsigned int admit(const std::string& clientKey);
+
+        unsigned int getPerMinute() const { return perMinute; }
+        unsigned int getBurst() const { return burst; }
+
+    private:
+        struct Bucket {
+            std::atomic<uint64_t> client;   // Hash of the client key, or 0 if unused
+            std::atomic<int64_t> full;      // Time (us) the bucket will be full again
+        };
+
+        unsigned int perMinute;
+        unsigned int burst;
+        int64_t intervalUs;     // Time for one token to come back
+        Bucket* pBuckets;
+
+        Bucket& findBucket(uint64_t client, int64_t now);
+
+        RateLimiter(const RateLimiter&) = delete;
+        RateLimiter& operator=(const RateLimiter&) = delete;
+};
+
+
+/**
+ * Returns the limiter for the route known as routeName (see
+ * registerRoute()), or NULL if its requests are not limited.  Routes named
+ * in XTWSD_RATE_ROUTES get a budget of their own.  Other routes share the
+ * budget of their rate class, which is set with XTWSD_RATE_CHEAP or
+ * XTWSD_RATE_EXPENSIVE.
+ */
+extern RateLimiter* getRateLimiter(const std::string& routeName, RateClass rateClass);
+
+
+/**
+ * Returns the address of the client that sent a request, without a port.
+ * source is the address and port the connection came from.  If that
+ * address is one of trustedProxies, the client is taken from forwardedFor
+ * (the request's X-Forwarded-For header) instead: its entries are read
+ * from the right, past any other trusted proxies, and the first one that
+ * is not trusted is the client.  Entries further left were written by the
+ * client itself, so they are never used.
+ */
+extern std::string clientAddress(const std::string& source,
+                                 const std::string& forwardedFor,
+                                 const std::set<std::string>& trustedProxies);
+
+
+/**
+ * Returns the proxies whose X-Forwarded-For headers are believed (see
+ * clientAddress()), read from XTWSD_TRUSTED_PROXIES, a comma separated list
+ * of addresses.
+ */
+extern const std::set<std::string>& getTrustedProxies();
+
+#endif
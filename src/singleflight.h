@@ -0,0 +1,104 @@
+#ifndef _singleflight_h_
+#define _singleflight_h_
+
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+  * singleflight.h
+  * -------------------------
+  * Collapses concurrent identical requests into a single computation.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * The first caller of run() for a given key does the work. Any other
+ * caller that arrives with the same key while that work is in progress
+ * waits for it and receives a copy of the same result.  Nothing is
+ * remembered once the work finishes - this is not a cache.
+ */
+template <typename V>
+class SingleFlight {
+
+    public:
+        SingleFlight() {}
+
+        /**
+         * Returns the result of compute(), or of the identical computation
+         * already in flight for key. If compute() throws, every caller
+         * waiting on it receives the same exception.
+         */
+        V run(const std::string& key, std::function<V()> compute) {
+
+            std::shared_ptr<std::promise<V>> leader;
+            std::shared_future<V> result;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = inFlight.find(key);
+                if (it != inFlight.end()) {
+                    result = it->second;
+                }
+                else {
+                    leader = std::make_shared<std::promise<V>>();
+                    result = leader->get_future().share();
+                    inFlight[key] = result;
+                }
+            }
+
+            if (leader) {
+                try {
+                    leader->set_value(compute());
+                }
+                catch (...) {
+                    leader->set_exception(std::current_exception());
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                inFlight.erase(key);
+            }
+
+            return result.get();
+        }
+
+
+        /**
+         * Returns the number of distinct computations currently in progress
+         */
+        size_t size() {
+            std::lock_guard<std::mutex> guard(lock);
+            return inFlight.size();
+        }
+
+    private:
+        std::mutex lock;
+        std::map<std::string, std::shared_future<V>> inFlight;
+
+        SingleFlight(const SingleFlight&) = delete;
+        SingleFlight& operator=(const SingleFlight&) = delete;
+};
+
+#endif
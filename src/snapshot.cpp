@@ -0,0 +1,385 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <thread>
+
+#include "_libxtide.h"
+#include "accesslog.h"
+#include "catalog.h"
+#include "dataset.h"
+#include "tidedb.h"
+
+using namespace std;
+using namespace libxtide;
+
+
+/*
+ * Snapshot layout. Everything is in host byte order - the snapshot is only
+ * ever read back by the machine that wrote it.
+ *
+ *   SnapHeader
+ *   SnapFile[fileCount]
+ *   SnapStation[stationCount]
+ *   string pool (NUL terminated strings, referenced by offset)
+ */
+
+static const char SNAP_MAGIC[8] = { 'X', 'T', 'W', 'S', 'N', 'A', 'P', '\0' };
+static const uint32_t SNAP_VERSION = 3;
+
+struct SnapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fileCount;
+    uint32_t stationCount;
+    uint32_t poolSize;
+};
+
+struct SnapFile {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t checksum;
+    uint32_t nameOffset;
+    uint32_t reserved;
+};
+
+struct SnapStation {
+    uint32_t fileIndex;
+    int32_t recordNumber;
+    uint32_t idOffset;
+};
+
+
+
+/**
+ * Returns the harmonics files used by the station index, in HFILE_PATH
+ * order (see getHarmonicsFiles()).  fileIndexes maps each one to its
+ * position.
+ */
+static vector<string> harmonicsFiles(map<string, uint32_t>& fileIndexes) {
+    vector<string> files;
+    for (auto& file : getHarmonicsFiles()) {
+        fileIndexes[file.fileName.aschar()] = files.size();
+        files.push_back(file.fileName.aschar());
+    }
+    return files;
+}
+
+
+/**
+ * Returns the snapshot file name, or an empty string if snapshots are
+ * turned off (XTWSD_SNAPSHOT set to an empty value).  By default it is
+ * named after the first harmonics file, plus a hash of the whole list
+ * when there is more than one, so different HFILE_PATHs that start with
+ * the same file do not keep replacing each other's snapshot.
+ */
+static string snapshotFileName(const vector<string>& files) {
+    const char* env = getenv("XTWSD_SNAPSHOT");
+    if (env != NULL) {
+        return env;
+    }
+
+    if (files.empty()) {
+        return "";
+    }
+
+    string fileName = files[0];
+    if (files.size() > 1) {
+        // 32 bit FNV-1a of the file names, in order
+        uint32_t hash = 2166136261U;
+        for (const string& file : files) {
+            for (unsigned char c : file) {
+                hash ^= c;
+                hash *= 16777619U;
+            }
+            hash ^= ':';
+            hash *= 16777619U;
+        }
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "-%08x", hash);
+        fileName += suffix;
+    }
+    fileName += ".snapshot";
+    return fileName;
+}
+
+
+
+/**
+ * Fills in the size and modification time of the specified harmonics
+ * file, and its checksum if withChecksum is set.
+ */
+static bool describeFile(const string& fileName, SnapFile& f, bool withChecksum) {
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    f.size = st.st_size;
+    f.mtime = st.st_mtime;
+    f.checksum = 0;
+    if (!withChecksum) {
+        close(fd);
+        return true;
+    }
+
+    // 64 bit FNV-1a over the whole file
+    uint64_t hash = 14695981039346656037ULL;
+    if (st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        const unsigned char* data = static_cast<const unsigned char*>(p);
+        for (off_t i = 0; i < st.st_size; i++) {
+            hash ^= data[i];
+            hash *= 1099511628211ULL;
+        }
+        munmap(p, st.st_size);
+    }
+    f.checksum = hash;
+
+    close(fd);
+    return true;
+}
+
+
+
+/**
+ * Describes every file in files.  Checksums are computed one thread per
+ * file, so checking several harmonics files takes about as long as
+ * checking the largest one.
+ */
+static bool describeFiles(const vector<string>& files, vector<SnapFile>& described, bool withChecksums) {
+
+    described.resize(files.size());
+    vector<char> ok(files.size(), 0);
+
+    vector<thread> threads;
+    for (size_t f = 0; f < files.size(); f++) {
+        if (withChecksums) {
+            threads.push_back(thread([&files, &described, &ok, f] {
+                ok[f] = describeFile(files[f], described[f], true);
+            }));
+        }
+        else {
+            ok[f] = describeFile(files[f], described[f], false);
+        }
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (char fileOk : ok) {
+        if (!fileOk) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+bool loadCatalogSnapshot(CatalogSnapshot& snap) {
+
+    map<string, uint32_t> fileIndexes;
+    vector<string> files = harmonicsFiles(fileIndexes);
+    string snapFile = snapshotFileName(files);
+    if (snapFile.empty() || currentStations().size() == 0) {
+        return false;
+    }
+
+    int fd = open(snapFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SnapHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    const char* base = static_cast<const char*>(p);
+    size_t length = st.st_size;
+    bool valid = false;
+
+    // Keep writers away from the harmonics files while we compare them
+    StationIndex& stations = currentStations();
+    TideDbSession session(Dstr(files[0].c_str()));
+
+    do {
+        const SnapHeader* pHeader = reinterpret_cast<const SnapHeader*>(base);
+        if (memcmp(pHeader->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+            pHeader->version != SNAP_VERSION ||
+            pHeader->stationCount != stations.size()) {
+            break;
+        }
+
+        size_t expected = sizeof(SnapHeader) +
+                          pHeader->fileCount * sizeof(SnapFile) +
+                          pHeader->stationCount * sizeof(SnapStation) +
+                          pHeader->poolSize;
+        if (expected != length) {
+            break;
+        }
+
+        const SnapFile* pFiles = reinterpret_cast<const SnapFile*>(base + sizeof(SnapHeader));
+        const SnapStation* pStations = reinterpret_cast<const SnapStation*>(pFiles + pHeader->fileCount);
+        const char* pool = reinterpret_cast<const char*>(pStations + pHeader->stationCount);
+
+        // Strings must lie inside the pool
+        if (pHeader->poolSize == 0 || pool[pHeader->poolSize - 1] != '\0') {
+            break;
+        }
+
+        // Every file, in the same order
+        if (files.size() != pHeader->fileCount) {
+            break;
+        }
+
+        bool filesMatch = true;
+        for (uint32_t f = 0; f < pHeader->fileCount && filesMatch; f++) {
+            filesMatch = pFiles[f].nameOffset < pHeader->poolSize &&
+                         files[f] == pool + pFiles[f].nameOffset;
+        }
+
+        // Only read the files through if their sizes and modification
+        // times still match, which rules out most changes for free.
+        vector<SnapFile> current;
+        if (!filesMatch || !describeFiles(files, current, false)) {
+            break;
+        }
+        for (uint32_t f = 0; f < pHeader->fileCount && filesMatch; f++) {
+            filesMatch = current[f].size == pFiles[f].size &&
+                         current[f].mtime == pFiles[f].mtime;
+        }
+        if (!filesMatch || !describeFiles(files, current, true)) {
+            break;
+        }
+
+        for (uint32_t f = 0; f < pHeader->fileCount && filesMatch; f++) {
+            filesMatch = current[f].checksum == pFiles[f].checksum;
+        }
+        if (!filesMatch) {
+            break;
+        }
+
+        snap.ids.resize(pHeader->stationCount);
+
+        bool stationsMatch = true;
+        for (uint32_t s = 0; s < pHeader->stationCount && stationsMatch; s++) {
+            const SnapStation& ss = pStations[s];
+            StationRef* pRef = stations[s];
+            stationsMatch = ss.fileIndex == fileIndexes[pRef->harmonicsFileName.aschar()] &&
+                            ss.recordNumber == (int32_t) pRef->recordNumber &&
+                            ss.idOffset < pHeader->poolSize;
+            if (stationsMatch) {
+                snap.ids[s] = pool + ss.idOffset;
+            }
+        }
+        valid = stationsMatch;
+    } while (false);
+
+    munmap(p, length);
+
+    if (!valid) {
+        snap.ids.clear();
+    }
+    return valid;
+}
+
+
+
+/**
+ * Adds str to the string pool and returns its offset
+ */
+static uint32_t poolString(string& pool, const string& str) {
+    uint32_t offset = pool.size();
+    pool += str;
+    pool += '\0';
+    return offset;
+}
+
+
+
+void saveCatalogSnapshot(const CatalogSnapshot& snap) {
+
+    map<string, uint32_t> fileIndexes;
+    vector<string> files = harmonicsFiles(fileIndexes);
+    string snapFile = snapshotFileName(files);
+    StationIndex& stations = currentStations();
+    if (snapFile.empty() || snap.ids.size() != stations.size()) {
+        return;
+    }
+
+    TideDbSession session(Dstr(files[0].c_str()));
+
+    string pool;
+    vector<SnapFile> snapFiles;
+    if (!describeFiles(files, snapFiles, true)) {
+        return;
+    }
+    for (size_t f = 0; f < files.size(); f++) {
+        snapFiles[f].nameOffset = poolString(pool, files[f]);
+        snapFiles[f].reserved = 0;
+    }
+
+    vector<SnapStation> snapStations(stations.size());
+    for (unsigned long s = 0; s < stations.size(); s++) {
+        StationRef* pRef = stations[s];
+        SnapStation& ss = snapStations[s];
+        ss.fileIndex = fileIndexes[pRef->harmonicsFileName.aschar()];
+        ss.recordNumber = pRef->recordNumber;
+        ss.idOffset = poolString(pool, snap.ids[s]);
+    }
+
+    SnapHeader header;
+    memcpy(header.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    header.version = SNAP_VERSION;
+    header.fileCount = files.size();
+    header.stationCount = stations.size();
+    header.poolSize = pool.size();
+
+    // Write to a temporary file and rename it, so a reader never sees
+    // a partial snapshot.
+    string tmpFile = snapFile + ".tmp";
+    FILE* out = fopen(tmpFile.c_str(), "wb");
+    if (out == NULL) {
+        return;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              fwrite(snapFiles.data(), sizeof(SnapFile), snapFiles.size(), out) == snapFiles.size() &&
+              fwrite(snapStations.data(), sizeof(SnapStation), snapStations.size(), out) == snapStations.size() &&
+              fwrite(pool.data(), 1, pool.size(), out) == pool.size();
+    ok = (fclose(out) == 0) && ok;
+
+    if (!ok || rename(tmpFile.c_str(), snapFile.c_str()) != 0) {
+        logMessage("Could not write catalog snapshot " + snapFile);
+        unlink(tmpFile.c_str());
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef _snapshot_h_
+#define _snapshot_h_
+
+#include <string>
+#include <vector>
+
+/**
+  * snapshot.h
+  * -------------------------
+  * A binary snapshot of the station ids that lets xtwsd skip reading
+  * every station record to build its id lookups.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * The parts of the catalog that are not already in libxtide's station
+ * index, and so would otherwise have to be read from every station record.
+ */
+struct CatalogSnapshot {
+    // Station ids, in the form context:stationId, by station index
+    std::vector<std::string> ids;
+};
+
+
+/**
+ * Reads the catalog snapshot (XTWSD_SNAPSHOT) into snap.  FALSE is returned
+ * if there is no snapshot, or it does not match the current harmonics
+ * files (the same files in HFILE_PATH order, each with the same size,
+ * modification time and checksum) or station index, in which
+ * case the catalog must be built from the station records.
+ */
+extern bool loadCatalogSnapshot(CatalogSnapshot& snap);
+
+
+/**
+ * Writes snap, along with the harmonics file and record number of each
+ * station in the current station index, to the catalog snapshot file.
+ */
+extern void saveCatalogSnapshot(const CatalogSnapshot& snap);
+
+#endif
@@ -0,0 +1,121 @@
+#include "sparkline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+using namespace sparkline;
+
+
+// Based on Sveinn Steinarsson's "Downsampling Time Series for Visual
+// Representation" (2013), https://github.com/sveinn-steinarsson/flot-downsample
+vector<Point> sparkline::decimate(const vector<Point>& points, size_t threshold) {
+
+    if (threshold >= points.size() || threshold < 3) {
+        return points;
+    }
+
+    vector<Point> sampled;
+    sampled.reserve(threshold);
+
+    // Always keep the first point
+    size_t a = 0;
+    sampled.push_back(points[a]);
+
+    // The first and last points are kept as-is, the rest are split into buckets
+    double bucketSize = (double) (points.size() - 2) / (threshold - 2);
+
+    for (size_t b = 0; b < threshold - 2; b++) {
+
+        // Average of the next bucket is the third corner of the triangle
+        size_t nextStart = (size_t) floor((b + 1) * bucketSize) + 1;
+        size_t nextEnd = min((size_t) floor((b + 2) * bucketSize) + 1, points.size());
+        double avgX = 0;
+        double avgY = 0;
+        for (size_t n = nextStart; n < nextEnd; n++) {
+            avgX += points[n].x;
+            avgY += points[n].y;
+        }
+        size_t nextCount = nextEnd - nextStart;
+        if (nextCount > 0) {
+            avgX /= nextCount;
+            avgY /= nextCount;
+        }
+        else {
+            avgX = points.back().x;
+            avgY = points.back().y;
+        }
+
+        // Keep the point in this bucket that forms the largest triangle
+        // with the last kept point and the next bucket's average
+        size_t start = (size_t) floor(b * bucketSize) + 1;
+        size_t end = (size_t) floor((b + 1) * bucketSize) + 1;
+        double maxArea = -1;
+        size_t chosen = start;
+        for (size_t n = start; n < end; n++) {
+            double area = fabs((points[a].x - avgX) * (points[n].y - points[a].y) -
+                               (points[a].x - points[n].x) * (avgY - points[a].y));
+            if (area > maxArea) {
+                maxArea = area;
+                chosen = n;
+            }
+        }
+
+        sampled.push_back(points[chosen]);
+        a = chosen;
+    }
+
+    // Always keep the last point
+    sampled.push_back(points.back());
+
+    return sampled;
+}
+
+
+
+string sparkline::toSvg(const vector<Point>& points, unsigned int width, unsigned int height) {
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" height=\"%u\">", width, height);
+    string svg = buf;
+
+    if (points.size() >= 2) {
+        double minX = points.front().x;
+        double maxX = points.back().x;
+        double minY = points[0].y;
+        double maxY = points[0].y;
+        for (const Point& p : points) {
+            minY = min(minY, p.y);
+            maxY = max(maxY, p.y);
+        }
+        double xScale = maxX > minX ? (width - 1) / (maxX - minX) : 0;
+        double yScale = maxY > minY ? (height - 1) / (maxY - minY) : 0;
+
+        svg += "<path fill=\"none\" stroke=\"currentColor\" d=\"";
+        for (size_t i = 0; i < points.size(); i++) {
+            // SVG's y axis points down
+            snprintf(buf, sizeof(buf), "%c%.1f,%.1f", i == 0 ? 'M' : 'L',
+                     (points[i].x - minX) * xScale, (maxY - points[i].y) * yScale);
+            svg += buf;
+        }
+        svg += "\"/>";
+    }
+
+    svg += "</svg>";
+    return svg;
+}
+
+
+
+string sparkline::toJson(const vector<Point>& points) {
+
+    string out = "[";
+    char buf[64];
+    for (size_t i = 0; i < points.size(); i++) {
+        snprintf(buf, sizeof(buf), "%s[%.0f,%.3f]", i == 0 ? "" : ",", points[i].x, points[i].y);
+        out += buf;
+    }
+    out += "]";
+    return out;
+}
@@ -0,0 +1,64 @@
+#ifndef _sparkline_h_
+#define _sparkline_h_
+
+#include <string>
+#include <vector>
+
+/**
+  * sparkline.h
+  * -------------------------
+  * Small, light weight tide graphs ("sparklines") for thumbnail widgets.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+namespace sparkline {
+
+struct Point {
+    double x;
+    double y;
+};
+
+
+/**
+ * Reduces points to (at most) threshold points using the Largest Triangle
+ * Three Buckets algorithm, which keeps the peaks and troughs that make a
+ * tide curve recognizable.  points must be sorted by x.
+ */
+extern std::vector<Point> decimate(const std::vector<Point>& points, size_t threshold);
+
+
+/**
+ * Returns a minimal SVG document of the specified size that draws points
+ * (in their own units) as a single path scaled to fill the image.
+ */
+extern std::string toSvg(const std::vector<Point>& points, unsigned int width, unsigned int height);
+
+
+/**
+ * Returns points as a compact json array of [x, y] pairs.
+ */
+extern std::string toJson(const std::vector<Point>& points);
+
+}
+
+#endif
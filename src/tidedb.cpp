@@ -0,0 +1,240 @@
+#include "tidedb.h"
+#include "diagnostics.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <map>
+
+using namespace std;
+
+
+static recursive_mutex tcdLock;
+
+// The file libtcd currently has open (empty if none). Guarded by tcdLock.
+static string openFileName;
+
+// Headers of every file we have opened, guarded by tcdLock.
+static map<string, DB_HEADER_PUBLIC> headers;
+
+
+/**
+ * Makes fileName the open database. Must be called with tcdLock held.
+ */
+static bool openDb(const string& fileName) {
+    if (openFileName == fileName) {
+        return true;
+    }
+
+    if (!openFileName.empty()) {
+        close_tide_db();
+        openFileName.clear();
+    }
+
+    countEvent(TCD_OPEN);
+    if (open_tide_db(fileName.c_str())) {
+        openFileName = fileName;
+        if (headers.count(fileName) == 0) {
+            headers[fileName] = get_tide_db_header();
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+
+TideDbSession::TideDbSession(const Dstr& harmonicsFileName) :
+    guard(tcdLock),
+    fileName(harmonicsFileName.aschar()),
+    previousFileName(openFileName) {
+
+    open = openDb(fileName);
+}
+
+
+TideDbSession::~TideDbSession() {
+    if (!previousFileName.empty() && previousFileName != openFileName) {
+        // Put things back the way an outer session expects them
+        openDb(previousFileName);
+    }
+}
+
+
+
+const DB_HEADER_PUBLIC& TideDbSession::header() {
+    if (headers.count(fileName) == 0) {
+        openDb(fileName);
+        headers[fileName] = get_tide_db_header();
+    }
+    return headers[fileName];
+}
+
+
+
+void TideDbSession::setHeader(const DB_HEADER_PUBLIC& db) {
+    headers[fileName] = db;
+}
+
+
+
+bool TideDbSession::flush() {
+    if (openFileName == fileName) {
+        // libtcd only writes its header when the database is closed
+        close_tide_db();
+        openFileName.clear();
+    }
+
+    // Closing only hands the data to the OS
+    bool synced = false;
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        synced = (fsync(fd) == 0);
+        close(fd);
+    }
+
+    headers.erase(fileName);
+    open = openDb(fileName);
+    return synced;
+}
+
+
+
+void TideDbSession::reset() {
+    lock_guard<recursive_mutex> guard(tcdLock);
+    if (!openFileName.empty()) {
+        close_tide_db();
+        openFileName.clear();
+    }
+    headers.clear();
+}
+
+
+
+ExternalTideDbSession::ExternalTideDbSession() :
+    guard(tcdLock),
+    previousFileName(openFileName) {
+
+    // Hand libtcd over in a known state. The outside code will open
+    // (and, in libxtide's case, close) whatever it needs.
+    if (!openFileName.empty()) {
+        close_tide_db();
+        openFileName.clear();
+    }
+}
+
+
+ExternalTideDbSession::~ExternalTideDbSession() {
+    if (!previousFileName.empty()) {
+        // Restore the file an outer session on this thread is using
+        openDb(previousFileName);
+    }
+}
+
+
+
+/**
+ * Returns TRUE if t is a valid offset in libtcd's [-]HHMM format
+ */
+static bool validHHMM(NV_INT32 t) {
+    return t > -4960 && t < 4960 && abs(t) % 100 < 60;
+}
+
+
+/**
+ * Returns TRUE if val is a valid index into an enum table of count entries
+ */
+static bool validEnum(long val, NV_U_INT32 count) {
+    return val >= 0 && val < (long) count;
+}
+
+
+
+bool checkTideRecord(const TIDE_RECORD& rec, const DB_HEADER_PUBLIC& db) {
+
+    bool ok = true;
+
+    if (rec.header.name[0] == '\0') {
+        diagnostic("error: the station has no name");
+        ok = false;
+    }
+    if (rec.header.latitude < -90.0 || rec.header.latitude > 90.0 ||
+        rec.header.longitude < -180.0 || rec.header.longitude > 180.0) {
+        diagnostic("error: position is out of range");
+        ok = false;
+    }
+    if (!validEnum(rec.header.tzfile, db.tzfiles)) {
+        diagnostic("error: unknown timezone");
+        ok = false;
+    }
+    if (!validEnum(rec.country, db.countries)) {
+        diagnostic("error: unknown country");
+        ok = false;
+    }
+    if (!validEnum(rec.level_units, db.level_unit_types)) {
+        diagnostic("error: unknown levelUnits");
+        ok = false;
+    }
+    if (!validEnum(rec.direction_units, db.dir_unit_types)) {
+        diagnostic("error: unknown flow.units");
+        ok = false;
+    }
+    if (rec.min_direction < 0 || rec.min_direction > 361 ||
+        rec.max_direction < 0 || rec.max_direction > 361) {
+        diagnostic("error: flow directions must be between 0 and 361");
+        ok = false;
+    }
+
+    if (rec.header.record_type == REFERENCE_STATION) {
+        if (!validEnum(rec.datum, db.datum_types)) {
+            diagnostic("error: unknown harmonics.datum");
+            ok = false;
+        }
+        if (rec.confidence > 15) {
+            diagnostic("error: harmonics.confidence must be between 0 and 15");
+            ok = false;
+        }
+        if (!validHHMM(rec.zone_offset)) {
+            diagnostic("error: harmonics.zoneOffset is not a valid HHMM offset");
+            ok = false;
+        }
+        for (NV_U_INT32 c = 0; c < db.constituents; c++) {
+            if (rec.amplitude[c] < 0.0 || rec.epoch[c] < 0.0 || rec.epoch[c] >= 360.0) {
+                diagnostic(string("error: constituent ") + get_constituent(c) +
+                           " needs an amp of at least 0 and an epoch from 0 to less than 360");
+                ok = false;
+            }
+        }
+    }
+    else if (rec.header.record_type == SUBORDINATE_STATION) {
+        if (rec.header.reference_station < 0 ||
+            rec.header.reference_station >= (NV_INT32) db.number_of_records) {
+            diagnostic("error: unknown offsets.referenceStationId");
+            ok = false;
+        }
+        if (!validHHMM(rec.min_time_add) || !validHHMM(rec.max_time_add)) {
+            diagnostic("error: offsets.minTimeAdd and offsets.maxTimeAdd must be valid HHMM offsets");
+            ok = false;
+        }
+        if (rec.min_level_multiply < 0.0 || rec.min_level_multiply > 65.535 ||
+            rec.max_level_multiply < 0.0 || rec.max_level_multiply > 65.535) {
+            diagnostic("error: offsets level multipliers must be between 0 and 65.535");
+            ok = false;
+        }
+        if ((rec.flood_begins != NULLSLACKOFFSET && !validHHMM(rec.flood_begins)) ||
+            (rec.ebb_begins != NULLSLACKOFFSET && !validHHMM(rec.ebb_begins))) {
+            diagnostic("error: offsets.floodBegins and offsets.ebbBegins must be valid HHMM offsets or 2560");
+            ok = false;
+        }
+    }
+    else {
+        diagnostic("error: unknown record type");
+        ok = false;
+    }
+
+    return ok;
+}
@@ -0,0 +1,127 @@
+#ifndef _tidedb_h_
+#define _tidedb_h_
+
+#include <mutex>
+#include <string>
+
+#include "_libxtide.h"
+
+/**
+  * tidedb.h
+  * -------------------------
+  * Shared, long lived access to the libtcd harmonics database.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * libtcd keeps one open database in global variables, so it can only be
+ * used by one thread at a time, and opening a database re-reads its header
+ * and lookup tables.  A TideDbSession gives the current thread exclusive
+ * use of libtcd with the requested file open.  The file is left open when
+ * the session ends, so the next session on the same file costs nothing
+ * more than taking a lock.
+ *
+ * Sessions may be nested on the same thread.  A nested session that opens
+ * a different file re-opens the outer session's file when it ends.
+ */
+class TideDbSession {
+
+    public:
+        explicit TideDbSession(const Dstr& harmonicsFileName);
+
+        ~TideDbSession();
+
+        /**
+         * Returns TRUE if the database was opened successfully
+         */
+        bool isOpen() const { return open; }
+
+        /**
+         * Returns the header of the open database.  Headers are read once
+         * and cached until the database is written to.
+         */
+        const DB_HEADER_PUBLIC& header();
+
+        /**
+         * Replaces the cached header with db, the header libtcd hands back
+         * from add_tide_record() and update_tide_record(), so records
+         * written later in the same session are checked against it.
+         */
+        void setHeader(const DB_HEADER_PUBLIC& db);
+
+        /**
+         * Writes any changes made through libtcd to disk, and waits for them
+         * to get there (fsync).  This must be called after adding or updating
+         * records.  Returns FALSE if the file could not be synced.
+         */
+        bool flush();
+
+        /**
+         * Closes the database and forgets every cached header.  Call this
+         * after the harmonics files have been replaced on disk.
+         */
+        static void reset();
+
+    private:
+        std::unique_lock<std::recursive_mutex> guard;
+        std::string fileName;
+        std::string previousFileName;
+        bool open;
+
+        TideDbSession(const TideDbSession&) = delete;
+        TideDbSession& operator=(const TideDbSession&) = delete;
+};
+
+
+
+/**
+ * Gives the current thread exclusive use of libtcd for code outside of
+ * xtwsd, such as libxtide's StationRef::load(), that opens and closes the
+ * database on its own.
+ */
+class ExternalTideDbSession {
+
+    public:
+        ExternalTideDbSession();
+
+        ~ExternalTideDbSession();
+
+    private:
+        std::unique_lock<std::recursive_mutex> guard;
+        std::string previousFileName;
+
+        ExternalTideDbSession(const ExternalTideDbSession&) = delete;
+        ExternalTideDbSession& operator=(const ExternalTideDbSession&) = delete;
+};
+
+
+
+/**
+ * Checks a record against the limits libtcd enforces when it is added or
+ * updated.  Each problem found is reported with diagnostic(), so it can be
+ * returned to the client instead of only being written to stderr by libtcd.
+ * db is the header of the file the record will be written to.
+ */
+extern bool checkTideRecord(const TIDE_RECORD& rec, const DB_HEADER_PUBLIC& db);
+
+#endif
@@ -0,0 +1,125 @@
+#include "trace.h"
+
+#include <cstdio>
+
+#include "accesslog.h"
+#include "xtutil.h"
+
+using namespace std;
+using namespace std::chrono;
+
+
+static const char* stageNames[TRACE_STAGE_COUNT] = {
+    "queue", "resolve", "load", "predict", "format", "build", "render", "dump"
+};
+
+static thread_local RequestTrace* pCurrentTrace = NULL;
+static thread_local TraceSpan* pCurrentSpan = NULL;
+
+
+static double toMs(steady_clock::duration time) {
+    return duration_cast<microseconds>(time).count() / 1000.0;
+}
+
+
+
+RequestTrace::RequestTrace() : started(steady_clock::now()), pPrevious(pCurrentTrace) {
+    for (int s = 0; s < TRACE_STAGE_COUNT; s++) {
+        stageTimes[s] = steady_clock::duration::zero();
+    }
+    pCurrentTrace = this;
+}
+
+
+RequestTrace::~RequestTrace() {
+    pCurrentTrace = pPrevious;
+}
+
+
+void RequestTrace::add(TraceStage stage, steady_clock::duration time) {
+    stageTimes[stage] += time;
+}
+
+
+double RequestTrace::elapsedMs() const {
+    return toMs(steady_clock::now() - started);
+}
+
+
+string RequestTrace::getServerTiming() const {
+    string timing;
+    char dur[32];
+    for (int s = 0; s < TRACE_STAGE_COUNT; s++) {
+        if (stageTimes[s] > steady_clock::duration::zero()) {
+            if (!timing.empty()) {
+                timing += ", ";
+            }
+            snprintf(dur, sizeof(dur), ";dur=%.3f", toMs(stageTimes[s]));
+            timing += stageNames[s];
+            timing += dur;
+        }
+    }
+    snprintf(dur, sizeof(dur), ";dur=%.3f", elapsedMs());
+    if (!timing.empty()) {
+        timing += ", ";
+    }
+    timing += "total";
+    timing += dur;
+    return timing;
+}
+
+
+RequestTrace* RequestTrace::current() {
+    return pCurrentTrace;
+}
+
+
+
+TraceSpan::TraceSpan(TraceStage stage) : pTrace(pCurrentTrace), stage(stage) {
+    if (pTrace != NULL) {
+        started = steady_clock::now();
+        childTime = steady_clock::duration::zero();
+        pParent = pCurrentSpan;
+        pCurrentSpan = this;
+    }
+}
+
+
+TraceSpan::~TraceSpan() {
+    if (pTrace != NULL) {
+        steady_clock::duration time = steady_clock::now() - started;
+        pTrace->add(stage, time - childTime);
+        if (pParent != NULL) {
+            pParent->childTime += time;
+        }
+        pCurrentSpan = pParent;
+    }
+}
+
+
+
+static int slowRequestMs() {
+    static int slowMs = xtutil::getEnvInt("XTWSD_SLOW_REQUEST_MS", 0);
+    return slowMs;
+}
+
+
+bool serverTimingEnabled() {
+    static bool enabled = xtutil::getEnvInt("XTWSD_SERVER_TIMING", 0) != 0;
+    return enabled;
+}
+
+
+bool tracingEnabled() {
+    return serverTimingEnabled() || slowRequestMs() > 0;
+}
+
+
+
+void logIfSlow(const RequestTrace& trace, const string& what) {
+    if (slowRequestMs() <= 0 || trace.elapsedMs() < slowRequestMs()) {
+        return;
+    }
+
+    logMessage("Slow request: " + what + " " + trace.getServerTiming());
+}
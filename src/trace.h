@@ -0,0 +1,140 @@
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <chrono>
+#include <string>
+
+/**
+  * trace.h
+  * -------------------------
+  * Per stage timing of requests, for the Server-Timing header and the
+  * slow request log.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * The stages a request's time is broken down into
+ */
+enum TraceStage {
+    TRACE_QUEUE,     // Waiting for a thread in the work pool
+    TRACE_RESOLVE,   // Translating the station id to a station index
+    TRACE_LOAD,      // Loading the station (libxtide's StationRef::load())
+    TRACE_PREDICT,   // Computing tide events
+    TRACE_FORMAT,    // Formatting timestamps
+    TRACE_BUILD,     // Building the Json document
+    TRACE_RENDER,    // Drawing graphs
+    TRACE_DUMP,      // Serializing the response body
+    TRACE_STAGE_COUNT
+};
+
+
+/**
+ * Collects the time spent in each stage by the current thread while it
+ * exists.  Create one when a request starts running, if tracing is
+ * enabled (see tracingEnabled()).  When there is no RequestTrace, TraceSpans
+ * cost no more than reading a thread local pointer.
+ */
+class RequestTrace {
+
+    public:
+        RequestTrace();
+
+        ~RequestTrace();
+
+        /**
+         * Adds time to a stage
+         */
+        void add(TraceStage stage, std::chrono::steady_clock::duration time);
+
+        /**
+         * Returns the time since the trace started, in milliseconds
+         */
+        double elapsedMs() const;
+
+        /**
+         * Returns the stages that took any time, in the format of the
+         * Server-Timing header (e.g. "load;dur=1.25, predict;dur=4.5")
+         */
+        std::string getServerTiming() const;
+
+        /**
+         * Returns the trace running on the current thread, or NULL
+         */
+        static RequestTrace* current();
+
+    private:
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::duration stageTimes[TRACE_STAGE_COUNT];
+        RequestTrace* pPrevious;
+
+        RequestTrace(const RequestTrace&) = delete;
+        RequestTrace& operator=(const RequestTrace&) = delete;
+};
+
+
+
+/**
+ * Times a block of code as one stage of the current request's trace.
+ * Spans may be nested; the time spent in an inner span is only counted
+ * for the inner span's stage.
+ */
+class TraceSpan {
+
+    public:
+        explicit TraceSpan(TraceStage stage);
+
+        ~TraceSpan();
+
+    private:
+        RequestTrace* pTrace;
+        TraceStage stage;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::duration childTime;
+        TraceSpan* pParent;
+
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+
+
+/**
+ * Returns TRUE if requests should be traced: XTWSD_SERVER_TIMING is set to
+ * 1, or a slow request threshold is set with XTWSD_SLOW_REQUEST_MS.
+ */
+extern bool tracingEnabled();
+
+
+/**
+ * Returns TRUE if a Server-Timing header should be sent (XTWSD_SERVER_TIMING)
+ */
+extern bool serverTimingEnabled();
+
+
+/**
+ * Writes the stage breakdown of trace to the slow request log if the request
+ * took longer than XTWSD_SLOW_REQUEST_MS.  what describes the request.
+ */
+extern void logIfSlow(const RequestTrace& trace, const std::string& what);
+
+#endif
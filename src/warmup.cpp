@@ -0,0 +1,196 @@
+#include "warmup.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+#include "catalog.h"
+#include "dataset.h"
+#include "predict.h"
+#include "workpool.h"
+#include "xtutil.h"
+
+using namespace std;
+
+
+static atomic<bool> warm(false);
+
+
+bool warmupComplete() {
+    return warm.load();
+}
+
+
+
+/**
+ * Returns the request target found in line, or an empty string if
+ * there isn't one.
+ */
+static string parseTarget(const string& line) {
+
+    size_t get = line.find("\"GET ");
+    if (get != string::npos) {
+        // An access log line: ... "GET /location/NOS:8722862?days=2 HTTP/1.1" ...
+        size_t start = get + 5;
+        size_t end = line.find_first_of(" \"", start);
+        return line.substr(start, end == string::npos ? string::npos : end - start);
+    }
+
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == string::npos || line[start] == '#') {
+        return "";
+    }
+    size_t end = line.find_first_of(" \t\r", start);
+    string target = line.substr(start, end == string::npos ? string::npos : end - start);
+
+    if (target[0] != '/') {
+        // A bare station id
+        target = "/location/" + target;
+    }
+    return target;
+}
+
+
+
+size_t readWarmupTargets(const string& fileName, size_t maxTargets, vector<string>& targets) {
+
+    ifstream in(fileName);
+    if (!in) {
+        return 0;
+    }
+
+    deque<string> found;
+    string line;
+    while (getline(in, line)) {
+        string target = parseTarget(line);
+        if (!target.empty()) {
+            found.push_back(target);
+            if (maxTargets > 0 && found.size() > maxTargets) {
+                found.pop_front();
+            }
+        }
+    }
+
+    targets.insert(targets.end(), found.begin(), found.end());
+    return found.size();
+}
+
+
+
+/**
+ * Requests target, the same way its resource handler would.
+ */
+static void warmTarget(const string& target) {
+
+    size_t q = target.find('?');
+    string path = target.substr(0, q);
+
+    map<string, string> params;
+    if (q != string::npos) {
+        string query = target.substr(q + 1);
+        size_t pos = 0;
+        while (pos <= query.size()) {
+            size_t amp = query.find('&', pos);
+            string pair = query.substr(pos, amp == string::npos ? string::npos : amp - pos);
+            size_t eq = pair.find('=');
+            if (eq != string::npos) {
+                params[xtutil::url_decode(pair.substr(0, eq))] = xtutil::url_decode(pair.substr(eq + 1));
+            }
+            if (amp == string::npos) {
+                break;
+            }
+            pos = amp + 1;
+        }
+    }
+
+    QueryLookup query = [&params](const char* name) {
+        auto it = params.find(name);
+        return it == params.end() ? string() : it->second;
+    };
+
+    // Split "/resource/argument"
+    size_t slash = path.find('/', 1);
+    string resource = path.substr(1, slash == string::npos ? string::npos : slash - 1);
+    string argument = slash == string::npos ? "" : xtutil::url_decode(path.substr(slash + 1));
+
+    string error;
+    try {
+        if (resource == "location") {
+            PredictionParams predict;
+            if (parsePredictionRequest(argument, query, predict, error)) {
+                if (query("start").empty()) {
+                    // Predictions of "now" are keyed by the minute, so one
+                    // made now would be of no use a minute from now.  Just
+                    // load the station.
+                    loadStation(predict.stationIndex);
+                }
+                else {
+                    getPrediction(predict);
+                }
+            }
+        }
+        else if (resource == "graph") {
+            GraphParams graph;
+            if (parseGraphRequest(argument, query, graph, error)) {
+                getGraph(graph);
+            }
+        }
+        else if (resource == "spark") {
+            SparkParams spark;
+            if (parseSparkRequest(argument, query, spark, error)) {
+                getSpark(spark);
+            }
+        }
+        else if (resource == "locations") {
+            getLocationsBody(StationTypeFilter(argument), !query("referenceOnly").empty() && query("referenceOnly") != "0");
+        }
+    }
+    catch (...) {
+        // A bad entry in the list should not stop the rest from warming
+    }
+}
+
+
+
+void warmCaches(const vector<string>& targets, unsigned int threadCount) {
+
+    auto started = chrono::steady_clock::now();
+
+    xtutil::preloadContextMap();
+
+    if (!targets.empty()) {
+        WorkPool pool("warmup", threadCount, targets.size());
+
+        mutex lock;
+        condition_variable finished;
+        size_t remaining = targets.size();
+
+        for (const string& target : targets) {
+            pool.post([&target, &lock, &finished, &remaining] {
+                {
+                    DatasetPin pin;
+                    warmTarget(target);
+                }
+
+                lock_guard<mutex> guard(lock);
+                if (--remaining == 0) {
+                    finished.notify_all();
+                }
+            });
+        }
+
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&remaining] { return remaining == 0; });
+    }
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started);
+    printf("Cache warm-up of %zu entries done in %ld ms\n", targets.size(), (long) elapsed.count());
+    fflush(stdout);
+
+    warm = true;
+}
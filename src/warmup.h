@@ -0,0 +1,66 @@
+#ifndef _warmup_h_
+#define _warmup_h_
+
+#include <string>
+#include <vector>
+
+/**
+  * warmup.h
+  * -------------------------
+  * Fills xtwsd's caches at startup so the first requests after a restart
+  * do not all pay the cost of a cold cache.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * Reads the warm-up list stored in fileName into targets, keeping only
+ * the last maxTargets entries (0 keeps them all).  Each line may be:
+ *
+ *   - a bare station id (e.g. NOS:8722862), which loads the station
+ *   - a request target (e.g. /graph/NOS:8722862?width=600)
+ *   - an access log line, from which the target of a "GET ..." is used
+ *
+ * Blank lines and lines that start with # are ignored. Returns the
+ * number of targets read.
+ */
+extern size_t readWarmupTargets(const std::string& fileName, size_t maxTargets, std::vector<std::string>& targets);
+
+
+/**
+ * Builds the context map, then computes every target in parallel on
+ * threadCount threads, leaving the results in the prediction, graph,
+ * station and /locations caches.  Graphs of "now" are warmed for the
+ * current graph bucket, which live requests share.  A /location without
+ * a start time only loads its station, since predictions of "now" are
+ * only good for the minute they are made in.  Returns once all of them are done,
+ * after which warmupComplete() returns TRUE.
+ */
+extern void warmCaches(const std::vector<std::string>& targets, unsigned int threadCount);
+
+
+/**
+ * Returns TRUE once warmCaches() has finished.
+ */
+extern bool warmupComplete();
+
+#endif
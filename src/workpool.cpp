@@ -0,0 +1,194 @@
+#include "workpool.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include "accesslog.h"
+
+using namespace std;
+
+
+enum JobState { QUEUED, RUNNING, DONE, ABANDONED };
+
+struct WorkPool::Job {
+    function<void()> work;
+
+    mutex lock;
+    condition_variable finished;
+    JobState state;
+
+    // Set by the caller once the deadline passes while the job is running
+    atomic<bool> cancelRequested;
+
+    // Set when the job itself observed cancelRequested via cancelled()
+    atomic<bool> cancelObserved;
+
+    // TRUE if nobody waits for the job (see post())
+    bool detached;
+
+    // What the job threw, if anything
+    exception_ptr error;
+
+    Job(function<void()>& w, bool detached = false) :
+        work(w), state(QUEUED), cancelRequested(false), cancelObserved(false), detached(detached) {
+    }
+};
+
+
+thread_local WorkPool::Job* WorkPool::pCurrentJob = NULL;
+
+
+WorkPool::WorkPool(const string& name, unsigned int threadCount, unsigned int maxQueued) :
+    name(name),
+    threadCount(threadCount > 0 ? threadCount : 1),
+    maxQueued(maxQueued),
+    stopping(false) {
+
+    for (unsigned int t = 0; t < this->threadCount; t++) {
+        workers.push_back(thread(&WorkPool::workerLoop, this));
+    }
+}
+
+
+WorkPool::~WorkPool() {
+    {
+        lock_guard<mutex> guard(queueLock);
+        stopping = true;
+    }
+    queueReady.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+
+size_t WorkPool::getQueueDepth() {
+    lock_guard<mutex> guard(queueLock);
+    return queue.size();
+}
+
+
+bool WorkPool::cancelled() {
+    if (pCurrentJob != NULL && pCurrentJob->cancelRequested.load()) {
+        pCurrentJob->cancelObserved = true;
+        return true;
+    }
+    return false;
+}
+
+
+WorkPool::Result WorkPool::run(function<void()> work, unsigned int deadlineMs) {
+
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(deadlineMs);
+    shared_ptr<Job> job = make_shared<Job>(work);
+
+    {
+        lock_guard<mutex> guard(queueLock);
+        if (queue.size() >= maxQueued) {
+            return REJECTED;
+        }
+        queue.push_back(job);
+    }
+    queueReady.notify_one();
+
+    unique_lock<mutex> jobGuard(job->lock);
+    if (!job->finished.wait_until(jobGuard, deadline, [&job] { return job->state == DONE; })) {
+        if (job->state == QUEUED) {
+            // Nobody has picked it up yet. Pull it out of the queue so it
+            // does not hold a slot, and mark it in case a worker already has it.
+            job->state = ABANDONED;
+            {
+                lock_guard<mutex> guard(queueLock);
+                for (auto it = queue.begin(); it != queue.end(); ++it) {
+                    if (*it == job) {
+                        queue.erase(it);
+                        break;
+                    }
+                }
+            }
+            return EXPIRED;
+        }
+
+        // Already running - ask it to stop, but we must wait for it
+        // since it may be writing into the caller's response.
+        job->cancelRequested = true;
+        job->finished.wait(jobGuard, [&job] { return job->state == DONE; });
+    }
+
+    if (job->error) {
+        rethrow_exception(job->error);
+    }
+    return job->cancelObserved ? CANCELLED : COMPLETED;
+}
+
+
+
+bool WorkPool::post(function<void()> work) {
+
+    {
+        lock_guard<mutex> guard(queueLock);
+        if (queue.size() >= maxQueued) {
+            return false;
+        }
+        queue.push_back(make_shared<Job>(work, true));
+    }
+    queueReady.notify_one();
+    return true;
+}
+
+
+
+void WorkPool::workerLoop() {
+
+    for (;;) {
+        shared_ptr<Job> job;
+        {
+            unique_lock<mutex> guard(queueLock);
+            queueReady.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                // stopping
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        {
+            lock_guard<mutex> jobGuard(job->lock);
+            if (job->state != QUEUED) {
+                // The caller gave up on this one while it sat in the queue
+                continue;
+            }
+            job->state = RUNNING;
+        }
+
+        // Never let a job take down a worker. The caller gets what it threw.
+        pCurrentJob = job.get();
+        try {
+            job->work();
+        }
+        catch (...) {
+            job->error = current_exception();
+        }
+        pCurrentJob = NULL;
+
+        if (job->detached && job->error) {
+            try {
+                rethrow_exception(job->error);
+            }
+            catch (const exception& err) {
+                logMessage("Background job in pool " + name + " failed: " + err.what());
+            }
+            catch (...) {
+                logMessage("Background job in pool " + name + " failed");
+            }
+        }
+
+        {
+            lock_guard<mutex> jobGuard(job->lock);
+            job->state = DONE;
+        }
+        job->finished.notify_all();
+    }
+}
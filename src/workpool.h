@@ -0,0 +1,123 @@
+#ifndef _workpool_h_
+#define _workpool_h_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+  * workpool.h
+  * -------------------------
+  * A fixed size pool of worker threads with a bounded job queue. Expensive
+  * request handlers are run here instead of on the web server's IO threads
+  * so that a burst of heavy requests can not starve the cheap ones.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+//  (C) 2019 Joel Kozikowski
+//
+//  This file is part of xtwsd.
+//
+//  xtwsd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  xtwsd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Foobar.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+/**
+ * A pool of worker threads fed from a bounded queue.  Callers hand a job
+ * to run() and block until it finishes, is rejected, or its deadline passes.
+ */
+class WorkPool {
+
+    public:
+        enum Result {
+            COMPLETED,  // The job ran to completion
+            REJECTED,   // The queue was full - the job was never queued
+            EXPIRED,    // The deadline passed before a worker picked up the job
+            CANCELLED   // The job noticed its deadline had passed and gave up early
+        };
+
+        WorkPool(const std::string& name, unsigned int threadCount, unsigned int maxQueued);
+
+        ~WorkPool();
+
+        /**
+         * Queues job and waits for it to finish.  If the job has not started
+         * by the time deadlineMs milliseconds have passed, it is removed from
+         * the queue and EXPIRED is returned.  A job that is already running
+         * when the deadline passes is asked to cancel (see cancelled()) and
+         * is waited on, since it may be using objects owned by the caller.
+         * If the job throws, the exception is rethrown here, on the
+         * caller's thread.
+         */
+        Result run(std::function<void()> job, unsigned int deadlineMs);
+
+
+        /**
+         * Queues job to run in the background without waiting for it.
+         * Returns FALSE if the queue is full and the job was dropped.
+         * Exceptions thrown by the job are logged.
+         */
+        bool post(std::function<void()> job);
+
+
+        /**
+         * Called from inside a running job: returns TRUE if the job's deadline
+         * has passed and it should abandon its work at the next convenient
+         * point.  Always FALSE when called outside of a pool thread.
+         */
+        static bool cancelled();
+
+
+        const std::string& getName() { return name; }
+
+        unsigned int getThreadCount() { return threadCount; }
+
+        unsigned int getMaxQueued() { return maxQueued; }
+
+        /**
+         * Returns the number of jobs currently waiting for a worker.
+         */
+        size_t getQueueDepth();
+
+    private:
+        struct Job;
+
+        std::string name;
+        unsigned int threadCount;
+        unsigned int maxQueued;
+
+        std::mutex queueLock;
+        std::condition_variable queueReady;
+        std::deque<std::shared_ptr<Job>> queue;
+        std::vector<std::thread> workers;
+        bool stopping;
+
+        // The job the current pool thread is running (if any)
+        static thread_local Job* pCurrentJob;
+
+        void workerLoop();
+
+        WorkPool(const WorkPool&) = delete;
+        WorkPool& operator=(const WorkPool&) = delete;
+};
+
+#endif
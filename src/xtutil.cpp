@@ -1,4 +1,10 @@
 #include "xtutil.h"
+#include "accesslog.h"
+#include "dataset.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "tidedb.h"
+#include "trace.h"
 
 #include <math.h>
 #include <map>
@@ -10,6 +16,9 @@
 #include <string>
 #include <ctime>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 // Distance calculation found here: https://stackoverflow.com/questions/10198985/calculating-the-distance-between-2-latitudes-and-longitudes-that-are-saved-in-a
 #define earthRadiusKm 6371.0
@@ -99,88 +108,163 @@ string xtutil::url_encode(const string &value) {
 }
 
 
+int xtutil::getEnvInt(const char* name, int defaultVal) {
+    const char* val = getenv(name);
+    if (val == NULL) {
+        return defaultVal;
+    }
+    try {
+        return stoi(val);
+    }
+    catch (...) {
+        return defaultVal;
+    }
+}
+
+
+unsigned long xtutil::dataVersion() {
+    return currentDataset()->version.load();
+}
+
+
+void xtutil::bumpDataVersion() {
+    currentDataset()->publishChanges(vector<string>());
+}
+
+
+string xtutil::stationCacheKey(int stationIndex) {
+    shared_ptr<Dataset> dataset = currentDataset();
+    string stationId = getStationId(stationIndex);
+    if (stationId.empty()) {
+        // Stations without an id are still cached by index
+        stationId = "#" + to_string(stationIndex);
+    }
+    bool isReference = dataset->stations()[stationIndex]->isReferenceStation;
+
+    string key = stationId;
+    key += ":v";
+    key += to_string(dataset->stationVersion(stationId, isReference));
+    return key;
+}
+
+
+string xtutil::url_decode(const string &value) {
+    string decoded;
+    for (size_t i = 0; i < value.size(); i++) {
+        char c = value[i];
+        if (c == '+') {
+            decoded += ' ';
+        }
+        else if (c == '%' && i + 2 < value.size() && isxdigit((unsigned char) value[i+1]) && isxdigit((unsigned char) value[i+2])) {
+            decoded += (char) stoi(value.substr(i+1, 2), nullptr, 16);
+            i += 2;
+        }
+        else {
+            decoded += c;
+        }
+    }
+    return decoded;
+}
+
+
+string xtutil::makeETag(const string& body) {
+    // 64 bit FNV-1a hash
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : body) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+
+    char tag[24];
+    snprintf(tag, sizeof(tag), "\"%016llx\"", (unsigned long long) hash);
+    return tag;
+}
+
+
 string xtutil::toString(Timestamp& ts, const Dstr& timezone) {
+   TraceSpan span(TRACE_FORMAT);
    Dstr dstr;
    ts.print(dstr, timezone);
    return string(dstr.aschar());
 }
 
 
-static map<string, int>* pContextMap = NULL;;
-static map<int, string>* pIndexMap = NULL;
+/**
+ * Returns the current dataset, building its id lookups first if
+ * necessary.
+ */
+static shared_ptr<Dataset> datasetWithIds() {
 
-map<string, int>* getContextMap() {
-    if (pContextMap == NULL) {
-        fflush(stderr);
-        std::cerr << "Building context map...";
-        fflush(stderr);
+    shared_ptr<Dataset> dataset = currentDataset();
+    if (dataset->hasIds()) {
+        return dataset;
+    }
 
-        TIDE_RECORD rec;
+    // Build the lookups without holding the dataset's lock so a thread
+    // that already has the tide database locked can never deadlock with us.
+    StationIds* pNewIds = new StationIds();
 
-        pContextMap = new map<string, int>();
-        pIndexMap = new map<int, string>();
+    StationIndex& stations = dataset->stations();
 
-        StationIndex& stations = Global::stationIndex();
+    CatalogSnapshot snap;
+    if (loadCatalogSnapshot(snap)) {
+        logMessage("Using catalog snapshot.");
+    }
+    else {
+        logMessage("Building context map...");
+
+        TIDE_RECORD rec;
+
+        snap.ids.resize(stations.size());
         for (int s = 0; s < stations.size(); s++) {
             StationRef*  pRef = stations[s];
-            if (open_tide_db(pRef->harmonicsFileName.aschar())) {
+            TideDbSession session(pRef->harmonicsFileName);
+            if (session.isOpen()) {
+                countEvent(TCD_READ);
                 if (read_tide_record(pRef->recordNumber, &rec) >= 0) {
                     string key = rec.station_id_context;
                     key += ":";
                     key += rec.station_id;
-                    (*pContextMap)[key] = s;
-                    (*pIndexMap)[s] = key;
+                    snap.ids[s] = key;
                 }
             }
         }
 
-        std::cerr << "Done." << std::endl;
-        fflush(stderr);
+        saveCatalogSnapshot(snap);
 
+        logMessage("Context map built.");
     }
-    return pContextMap;
-}
-
-
 
-void xtutil::invalidateContextMap() {
-
-    if (pContextMap != NULL) {
-        delete pContextMap;
-        pContextMap = NULL;
-        delete pIndexMap;
-        pIndexMap = NULL;
+    for (int s = 0; s < (int) snap.ids.size(); s++) {
+        if (!snap.ids[s].empty()) {
+            pNewIds->byId[snap.ids[s]] = s;
+            pNewIds->byIndex[s] = snap.ids[s];
+        }
     }
+
+    // If another thread finished first, its lookups are kept
+    dataset->setIds(shared_ptr<const StationIds>(pNewIds));
+    return dataset;
 }
 
 
 
-int xtutil::getStationIndex(const Dstr &harmonicsFileName, const uint32_t hFileRecordNumber) {
+void xtutil::preloadContextMap() {
+    datasetWithIds();
+}
 
-   StationIndex& stations = Global::stationIndex();
 
-    for (int s = 0; s < stations.size(); s++) {
-        StationRef*  pRef = stations[s];
-        if (pRef->harmonicsFileName == harmonicsFileName &&
-            pRef->recordNumber == hFileRecordNumber) {
-              return s;
-        }
-    }
 
-    return -1;
+int xtutil::getStationIndex(const Dstr &harmonicsFileName, const uint32_t hFileRecordNumber) {
+    return currentDataset()->recordStation(harmonicsFileName, hFileRecordNumber);
 }
 
 
 string* pEmptystr = new string();
 
 const string& xtutil::getStationId(int stationNdx) {
-    getContextMap();
-    try {
-        return pIndexMap->at(stationNdx);
-    }
-    catch (...) {
-        return *pEmptystr;
-    }
+    const string* pStationId = datasetWithIds()->stationId(stationNdx);
+    return (pStationId != NULL) ? *pStationId : *pEmptystr;
 }
 
 
@@ -201,14 +285,7 @@ int xtutil::getStationIndex(const string& stationId) {
     std::size_t found = stationId.find(":");
     if (found != std::string::npos) {
         // This is in the format of context::stationId.
-        map<string, int>* pMap = getContextMap();
-        try {
-            return pMap->at(stationId);
-        }
-        catch (...) {
-            // Key not found - return -1
-            return -1;
-        }
+        return datasetWithIds()->idStation(stationId);
     }
     else {
         // Is it a valid number?
@@ -224,6 +301,6 @@ int xtutil::getStationIndex(const string& stationId) {
 
 
 bool xtutil::stationIndexValid(int internalId) {
-    StationIndex& stations = Global::stationIndex();
+    StationIndex& stations = currentStations();
     return internalId >= 0 && internalId < stations.size();
 }
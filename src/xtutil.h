@@ -49,6 +49,20 @@ extern std::string url_encode(const std::string &value);
 
 
 
+/**
+ * Decodes a URL encoded value (%XX escapes and '+' for space)
+ */
+extern std::string url_decode(const std::string &value);
+
+
+
+/**
+ * Returns a (quoted) HTTP entity tag for the specified response body
+ */
+extern std::string makeETag(const std::string& body);
+
+
+
 /**
  * Converts the specified xtide Timestamp object to a string
  */
@@ -110,10 +124,42 @@ extern bool stationIndexValid(int stationNdx);
 
 
 /**
- * Invalidates the context map so it will be re-read. This
- * should be called whenever a new record is added to the database.
+ * Returns the integer value of the specified environment variable, or
+ * defaultVal if it is not set or is not a number.
+ */
+extern int getEnvInt(const char* name, int defaultVal);
+
+
+
+/**
+ * Returns the current version of the harmonics data. The version changes
+ * every time a station is added or updated, so it can be made part of
+ * a cache key to keep stale results from being served.
+ */
+extern unsigned long dataVersion();
+
+
+/**
+ * Marks the harmonics data as changed.
+ */
+extern void bumpDataVersion();
+
+
+/**
+ * Returns a key for caching results computed from the specified station:
+ * its station id and the data version in which it last changed.  Unlike
+ * dataVersion(), the key stays the same when other stations are added
+ * or updated.
+ */
+extern std::string stationCacheKey(int stationIndex);
+
+
+
+/**
+ * Builds the context map (used to translate station Ids to station indexes)
+ * now, rather than waiting for the first request that needs it.
  */
-extern void invalidateContextMap();
+extern void preloadContextMap();
 
 
 }
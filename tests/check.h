@@ -0,0 +1,39 @@
+#ifndef _check_h_
+#define _check_h_
+
+#include <cstdio>
+
+/**
+  * check.h
+  * -------------------------
+  * What the unit tests need to report failures: CHECK() prints each
+  * condition that does not hold, and checkResult() turns the count into
+  * the test program's exit code for ctest.
+  * -------------------------
+  * @author Joel Kozikowski
+  */
+
+static int checkFailures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+
+/**
+ * Prints a summary for testName and returns the exit code for main()
+ */
+static int checkResult(const char* testName) {
+    if (checkFailures > 0) {
+        printf("%s: %d check(s) failed\n", testName, checkFailures);
+        return 1;
+    }
+    printf("%s: all checks passed\n", testName);
+    return 0;
+}
+
+#endif
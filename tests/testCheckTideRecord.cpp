@@ -0,0 +1,179 @@
+#include <cstring>
+#include <string>
+
+#include "../src/_libxtide.h"
+#include "../src/diagnostics.h"
+#include "../src/tidedb.h"
+#include "check.h"
+
+using namespace std;
+
+
+/**
+ * Returns a header with a few entries in each table and no constituents
+ */
+static DB_HEADER_PUBLIC testHeader() {
+    DB_HEADER_PUBLIC db;
+    memset(&db, 0, sizeof(db));
+    db.number_of_records = 5;
+    db.constituents = 0;
+    db.level_unit_types = 5;
+    db.dir_unit_types = 3;
+    db.tzfiles = 10;
+    db.countries = 10;
+    db.datum_types = 10;
+    return db;
+}
+
+
+static TIDE_RECORD referenceStation() {
+    TIDE_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    strcpy(rec.header.name, "Test reference station");
+    rec.header.record_type = REFERENCE_STATION;
+    rec.header.reference_station = -1;
+    rec.header.latitude = 26.71;
+    rec.header.longitude = -78.99;
+    rec.header.tzfile = 1;
+    rec.country = 1;
+    rec.level_units = 1;
+    rec.direction_units = 0;
+    rec.min_direction = 361;
+    rec.max_direction = 361;
+    rec.datum = 1;
+    rec.confidence = 10;
+    rec.zone_offset = -500;
+    return rec;
+}
+
+
+static TIDE_RECORD subordinateStation() {
+    TIDE_RECORD rec = referenceStation();
+    strcpy(rec.header.name, "Test subordinate station");
+    rec.header.record_type = SUBORDINATE_STATION;
+    rec.header.reference_station = 2;
+    rec.min_time_add = 130;
+    rec.max_time_add = -45;
+    rec.min_level_multiply = 1.0;
+    rec.max_level_multiply = 0.9;
+    rec.flood_begins = NULLSLACKOFFSET;
+    rec.ebb_begins = NULLSLACKOFFSET;
+    return rec;
+}
+
+
+/**
+ * Returns TRUE if rec is rejected with a message containing expected
+ */
+static bool rejected(const TIDE_RECORD& rec, const DB_HEADER_PUBLIC& db, const string& expected) {
+    DiagnosticCapture diagnostics;
+    bool ok = checkTideRecord(rec, db);
+    return !ok && diagnostics.getCapture().find(expected) != string::npos;
+}
+
+
+
+static void testValid() {
+    DB_HEADER_PUBLIC db = testHeader();
+    DiagnosticCapture diagnostics;
+    CHECK(checkTideRecord(referenceStation(), db));
+    CHECK(checkTideRecord(subordinateStation(), db));
+    CHECK(!diagnostics.hasErrors());
+}
+
+
+static void testRejects() {
+    DB_HEADER_PUBLIC db = testHeader();
+    TIDE_RECORD rec;
+
+    rec = referenceStation();
+    rec.header.name[0] = '\0';
+    CHECK(rejected(rec, db, "no name"));
+
+    rec = referenceStation();
+    rec.header.latitude = 91.0;
+    CHECK(rejected(rec, db, "position"));
+
+    rec = referenceStation();
+    rec.header.longitude = -180.5;
+    CHECK(rejected(rec, db, "position"));
+
+    rec = referenceStation();
+    rec.header.tzfile = 10;
+    CHECK(rejected(rec, db, "timezone"));
+
+    rec = referenceStation();
+    rec.country = -1;
+    CHECK(rejected(rec, db, "country"));
+
+    rec = referenceStation();
+    rec.level_units = 5;
+    CHECK(rejected(rec, db, "levelUnits"));
+
+    rec = referenceStation();
+    rec.direction_units = 3;
+    CHECK(rejected(rec, db, "flow.units"));
+
+    rec = referenceStation();
+    rec.max_direction = 362;
+    CHECK(rejected(rec, db, "flow directions"));
+
+    rec = referenceStation();
+    rec.datum = 10;
+    CHECK(rejected(rec, db, "harmonics.datum"));
+
+    rec = referenceStation();
+    rec.confidence = 16;
+    CHECK(rejected(rec, db, "harmonics.confidence"));
+
+    rec = referenceStation();
+    rec.zone_offset = 160;
+    CHECK(rejected(rec, db, "harmonics.zoneOffset"));
+
+    rec = subordinateStation();
+    rec.min_time_add = 75;
+    CHECK(rejected(rec, db, "minTimeAdd"));
+
+    rec = subordinateStation();
+    rec.max_level_multiply = 70.0;
+    CHECK(rejected(rec, db, "multipliers"));
+
+    rec = subordinateStation();
+    rec.flood_begins = 5000;
+    CHECK(rejected(rec, db, "floodBegins"));
+
+    rec = referenceStation();
+    rec.header.record_type = (TIDE_RECORD_TYPE) 0;
+    CHECK(rejected(rec, db, "record type"));
+}
+
+
+static void testReferenceRecord() {
+    // A subordinate station must refer to a record that exists.  Records
+    // added earlier in a batch count once the header has been updated.
+    DB_HEADER_PUBLIC db = testHeader();
+    TIDE_RECORD rec = subordinateStation();
+
+    rec.header.reference_station = 5;
+    CHECK(rejected(rec, db, "referenceStationId"));
+
+    db.number_of_records = 6;
+    DiagnosticCapture diagnostics;
+    CHECK(checkTideRecord(rec, db));
+
+    rec.header.reference_station = -1;
+    CHECK(rejected(rec, db, "referenceStationId"));
+}
+
+
+
+int main() {
+
+    printf("Starting testCheckTideRecord.cpp...\n");
+
+    testValid();
+    testRejects();
+    testReferenceRecord();
+
+    return checkResult("testCheckTideRecord");
+}
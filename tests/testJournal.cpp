@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../src/dataset.h"
+#include "../src/harmwriter.h"
+#include "../src/xtutil.h"
+#include "check.h"
+
+using namespace std;
+
+
+/**
+ * Returns the definition of a small reference station with the specified id
+ */
+static json testStation(const string& stationId) {
+    json j = json::parse(R"=====(
+    {
+        "name": "xtwsd journal test",
+        "referenceStation": true,
+        "type": "tide",
+        "country": "Bahamas",
+        "timezone": ":America/New_York",
+        "levelUnits": "feet",
+        "position": { "lat": 26.71, "long": -78.99 },
+        "harmonics": {
+            "confidence": 10,
+            "datum": "Mean Lower Low Water",
+            "datumOffset": 1.47,
+            "zoneOffset": 0,
+            "constituents": [
+                { "name": "M2", "amp": 1.329, "epoch": 10.6 },
+                { "name": "S2", "amp": 0.23, "epoch": 36.6 }
+            ]
+        },
+        "source": { "name": "xtwsd", "context": "XTWSDTEST" }
+    }
+    )=====");
+    j["source"]["stationId"] = stationId;
+    return j;
+}
+
+
+static void writeJournal(const string& journalFile, const string& contents) {
+    ofstream journal(journalFile, ios::trunc);
+    journal << contents;
+}
+
+
+static long fileSize(const string& fileName) {
+    struct stat st;
+    return (stat(fileName.c_str(), &st) == 0) ? (long) st.st_size : -1;
+}
+
+
+
+/**
+ * Reading the journal needs no database
+ */
+static void testReadJournal(const string& journalFile) {
+
+    vector<json> list;
+    writeJournal(journalFile, "");
+    CHECK(HarmonicsWriter::readJournal(journalFile, list) == 0);
+    CHECK(list.empty());
+
+    // A torn last line is dropped quietly
+    list.clear();
+    writeJournal(journalFile, testStation("READ1").dump() + "\n{\"name\": \"torn");
+    CHECK(HarmonicsWriter::readJournal(journalFile, list) == 0);
+    CHECK(list.size() == 1);
+
+    // A bad line in the middle is skipped, and everything after it is kept
+    list.clear();
+    writeJournal(journalFile, testStation("READ1").dump() + "\n" +
+                              "{\"name\": \"torn\n" +
+                              testStation("READ2").dump() + "\n" +
+                              "not json at all\n" +
+                              testStation("READ3").dump() + "\n");
+    CHECK(HarmonicsWriter::readJournal(journalFile, list) == 2);
+    CHECK(list.size() == 3);
+    CHECK(list.size() == 3 && list[2]["source"]["stationId"] == "READ3");
+
+    // ...and a torn tail after a bad middle line is still just dropped
+    list.clear();
+    writeJournal(journalFile, "[1, 2\n" + testStation("READ1").dump() + "\n{\"name");
+    CHECK(HarmonicsWriter::readJournal(journalFile, list) == 1);
+    CHECK(list.size() == 1);
+
+    // Blank lines are not definitions
+    list.clear();
+    writeJournal(journalFile, "\n" + testStation("READ1").dump() + "\n\n");
+    CHECK(HarmonicsWriter::readJournal(journalFile, list) == 0);
+    CHECK(list.size() == 1);
+}
+
+
+
+int main() {
+
+    printf("Starting testJournal.cpp...\n");
+
+    char dir[] = "/tmp/xtwsd-journal-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        printf("testJournal: could not create a temporary directory\n");
+        return 1;
+    }
+    string harmonicsFile = string(dir) + "/harmonics.tcd";
+    string journalFile = string(dir) + "/harmonics.tcd.journal";
+
+    testReadJournal(journalFile);
+
+    // Replaying writes to the database, so work on a copy of the first
+    // harmonics file in HFILE_PATH.
+    const char* hfilePath = getenv("HFILE_PATH");
+    if (hfilePath == NULL) {
+        printf("testJournal: HFILE_PATH is not set - replay tests skipped\n");
+        unlink(journalFile.c_str());
+        rmdir(dir);
+        return checkResult("testJournal");
+    }
+    string sourceFile = hfilePath;
+    sourceFile = sourceFile.substr(0, sourceFile.find(':'));
+    {
+        ifstream in(sourceFile, ios::binary);
+        ofstream out(harmonicsFile, ios::binary);
+        out << in.rdbuf();
+    }
+    setenv("HFILE_PATH", harmonicsFile.c_str(), 1);
+    setenv("XTWSD_SNAPSHOT", "", 1);
+
+    // An empty journal has nothing to replay
+    writeJournal(journalFile, "");
+    {
+        HarmonicsWriter writer(journalFile);
+        CHECK(writer.replay() == 0);
+    }
+
+    // A definition left behind by a crash is written on the next start.
+    // The torn line after it was never synced, so it is ignored.
+    size_t stationCount = currentStations().size();
+    writeJournal(journalFile, testStation("JOURNAL1").dump() + "\n{\"name\": \"torn");
+    {
+        HarmonicsWriter writer(journalFile);
+        CHECK(writer.replay() == 1);
+    }
+    CHECK(fileSize(journalFile) == 0);
+    CHECK(currentStations().size() == stationCount + 1);
+    CHECK(xtutil::stationIndexValid(xtutil::getStationIndex("XTWSDTEST:JOURNAL1")));
+
+    // Replaying a definition that already made it into the database is
+    // harmless: the add fails as a duplicate.
+    writeJournal(journalFile, testStation("JOURNAL1").dump() + "\n");
+    {
+        HarmonicsWriter writer(journalFile);
+        CHECK(writer.replay() == 1);
+    }
+    CHECK(fileSize(journalFile) == 0);
+    CHECK(currentStations().size() == stationCount + 1);
+
+    // A damaged line in the middle does not hide the definitions after it,
+    // and a definition of the wrong type does not stop the replay.
+    writeJournal(journalFile, string("{\"name\": 5, \"id\": 1}\n") +
+                              "garbage\n" +
+                              testStation("JOURNAL2").dump() + "\n");
+    {
+        HarmonicsWriter writer(journalFile);
+        CHECK(writer.replay() == 2);
+    }
+    CHECK(currentStations().size() == stationCount + 2);
+    CHECK(xtutil::stationIndexValid(xtutil::getStationIndex("XTWSDTEST:JOURNAL2")));
+
+    unlink(journalFile.c_str());
+    unlink(harmonicsFile.c_str());
+    rmdir(dir);
+
+    return checkResult("testJournal");
+}
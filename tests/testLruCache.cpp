@@ -0,0 +1,120 @@
+#include <string>
+
+#include "../src/lrucache.h"
+#include "check.h"
+
+using namespace std;
+
+
+static void testEviction() {
+    // The least recently used value goes first
+    LruCache<int> cache(3);
+    cache.put("a", 1);
+    cache.put("b", 2);
+    cache.put("c", 3);
+
+    int val = 0;
+    CHECK(cache.get("a", val) && val == 1);
+
+    cache.put("d", 4);
+    CHECK(cache.size() == 3);
+    CHECK(!cache.contains("b"));
+    CHECK(cache.contains("a"));
+    CHECK(cache.contains("c"));
+    CHECK(cache.contains("d"));
+}
+
+
+static void testReplace() {
+    // Replacing a value counts as using it
+    LruCache<int> cache(2);
+    cache.put("a", 1);
+    cache.put("b", 2);
+    cache.put("a", 10);
+    cache.put("c", 3);
+
+    int val = 0;
+    CHECK(cache.get("a", val) && val == 10);
+    CHECK(!cache.contains("b"));
+    CHECK(cache.size() == 2);
+}
+
+
+static void testContains() {
+    // contains() does not move a key up the line
+    LruCache<int> cache(2);
+    cache.put("a", 1);
+    cache.put("b", 2);
+    CHECK(cache.contains("a"));
+    cache.put("c", 3);
+    CHECK(!cache.contains("a"));
+}
+
+
+static void testCounts() {
+    LruCache<int> cache(2);
+    cache.put("a", 1);
+
+    int val;
+    cache.get("a", val);
+    cache.get("a", val);
+    cache.get("b", val);
+    CHECK(cache.getHits() == 2);
+    CHECK(cache.getMisses() == 1);
+
+    cache.erase("a");
+    CHECK(cache.size() == 0);
+    CHECK(!cache.get("a", val));
+}
+
+
+static void testDisabled() {
+    // A cache of size zero holds nothing
+    LruCache<int> cache(0);
+    cache.put("a", 1);
+    CHECK(cache.size() == 0);
+}
+
+
+
+static void testBytes() {
+    // Values are evicted until the bytes fit, however few entries there are
+    LruCache<int> cache(10, 100);
+    cache.put("a", 1, 40);
+    cache.put("b", 2, 40);
+    CHECK(cache.getBytes() == 80);
+    cache.put("c", 3, 40);
+    CHECK(!cache.contains("a"));
+    CHECK(cache.size() == 2);
+    CHECK(cache.getBytes() == 80);
+
+    // Replacing a value counts its new size
+    cache.put("b", 20, 10);
+    CHECK(cache.getBytes() == 50);
+
+    // A value too big for the whole cache is not kept, and evicts nothing
+    cache.put("d", 4, 101);
+    CHECK(!cache.contains("d"));
+    CHECK(cache.size() == 2);
+
+    cache.erase("c");
+    CHECK(cache.getBytes() == 10);
+    cache.clear();
+    CHECK(cache.getBytes() == 0);
+}
+
+
+
+int main() {
+
+    printf("Starting testLruCache.cpp...\n");
+
+    testEviction();
+    testReplace();
+    testContains();
+    testCounts();
+    testDisabled();
+    testBytes();
+
+    return checkResult("testLruCache");
+}
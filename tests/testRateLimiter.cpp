@@ -0,0 +1,94 @@
+#include <chrono>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "../src/ratelimit.h"
+#include "check.h"
+
+using namespace std;
+
+
+static void testBurst() {
+    // A client may make burst requests at once, and is then turned away
+    RateLimiter limiter(60, 5);
+    for (int r = 0; r < 5; r++) {
+        CHECK(limiter.admit("10.0.0.1") == 0);
+    }
+    unsigned int retryAfter = limiter.admit("10.0.0.1");
+    CHECK(retryAfter >= 1 && retryAfter <= 2);
+}
+
+
+static void testRetryAfter() {
+    // The wait is rounded up to whole seconds
+    RateLimiter limiter(1, 1);
+    CHECK(limiter.admit("10.0.0.1") == 0);
+    unsigned int retryAfter = limiter.admit("10.0.0.1");
+    CHECK(retryAfter >= 59 && retryAfter <= 60);
+}
+
+
+static void testRefill() {
+    // 6000 a minute is a token every 10ms
+    RateLimiter limiter(6000, 2);
+    CHECK(limiter.admit("10.0.0.1") == 0);
+    CHECK(limiter.admit("10.0.0.1") == 0);
+    CHECK(limiter.admit("10.0.0.1") > 0);
+
+    this_thread::sleep_for(chrono::milliseconds(25));
+    CHECK(limiter.admit("10.0.0.1") == 0);
+}
+
+
+static void testClients() {
+    // Each client has a bucket of its own
+    RateLimiter limiter(60, 2);
+    CHECK(limiter.admit("10.0.0.1") == 0);
+    CHECK(limiter.admit("10.0.0.1") == 0);
+    CHECK(limiter.admit("10.0.0.1") > 0);
+
+    for (int c = 2; c < 100; c++) {
+        CHECK(limiter.admit("10.0.0." + to_string(c)) == 0);
+    }
+}
+
+
+static void testClientAddress() {
+    set<string> none;
+    set<string> proxies = { "10.0.0.1", "10.0.0.2", "::1" };
+
+    // The port is left off
+    CHECK(clientAddress("192.168.1.5:50312", "", none) == "192.168.1.5");
+    CHECK(clientAddress("[2001:db8::5]:50312", "", none) == "2001:db8::5");
+    CHECK(clientAddress("2001:db8::5:50312", "", none) == "2001:db8::5");
+
+    // X-Forwarded-For is only believed from a trusted proxy...
+    CHECK(clientAddress("192.168.1.5:50312", "172.16.0.9", none) == "192.168.1.5");
+    CHECK(clientAddress("192.168.1.5:50312", "172.16.0.9", proxies) == "192.168.1.5");
+    CHECK(clientAddress("10.0.0.1:50312", "172.16.0.9", proxies) == "172.16.0.9");
+    CHECK(clientAddress("::1:50312", "172.16.0.9:4711", proxies) == "172.16.0.9");
+    CHECK(clientAddress("10.0.0.1:50312", "2001:db8::9", proxies) == "2001:db8::9");
+    CHECK(clientAddress("10.0.0.1:50312", "[2001:db8::9]:4711", proxies) == "2001:db8::9");
+
+    // ...and only up to the first address a trusted proxy did not write
+    CHECK(clientAddress("10.0.0.1:50312", "1.2.3.4, 172.16.0.9, 10.0.0.2", proxies) == "172.16.0.9");
+    CHECK(clientAddress("10.0.0.1:50312", "10.0.0.2,10.0.0.1", proxies) == "10.0.0.2");
+    CHECK(clientAddress("10.0.0.1:50312", " , ", proxies) == "10.0.0.1");
+    CHECK(clientAddress("10.0.0.1:50312", "", proxies) == "10.0.0.1");
+}
+
+
+
+int main() {
+
+    printf("Starting testRateLimiter.cpp...\n");
+
+    testBurst();
+    testRetryAfter();
+    testRefill();
+    testClients();
+    testClientAddress();
+
+    return checkResult("testRateLimiter");
+}
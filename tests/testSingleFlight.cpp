@@ -0,0 +1,85 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../src/singleflight.h"
+#include "check.h"
+
+using namespace std;
+
+
+static void testCoalescing() {
+    // Callers that arrive while the first one is computing share its result
+    SingleFlight<int> flight;
+    atomic<int> computed(0);
+    promise<void> release;
+    shared_future<void> released = release.get_future().share();
+
+    auto compute = [&computed, released] {
+        computed++;
+        released.wait();
+        return 42;
+    };
+
+    vector<future<int>> results;
+    for (int c = 0; c < 8; c++) {
+        results.push_back(async(launch::async, [&flight, compute] {
+            return flight.run("NOS:8722862", compute);
+        }));
+    }
+
+    // Give the callers time to join the one in flight
+    for (int wait = 0; wait < 100 && flight.size() == 0; wait++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    this_thread::sleep_for(chrono::milliseconds(100));
+    release.set_value();
+
+    for (auto& result : results) {
+        CHECK(result.get() == 42);
+    }
+    CHECK(computed == 1);
+    CHECK(flight.size() == 0);
+}
+
+
+static void testDistinctKeys() {
+    SingleFlight<int> flight;
+    CHECK(flight.run("a", [] { return 1; }) == 1);
+    CHECK(flight.run("b", [] { return 2; }) == 2);
+
+    // Nothing is remembered once the work is done
+    CHECK(flight.run("a", [] { return 3; }) == 3);
+}
+
+
+static void testException() {
+    // Every waiter gets the exception, and the key can be tried again
+    SingleFlight<int> flight;
+    bool caught = false;
+    try {
+        flight.run("a", []() -> int { throw runtime_error("failed"); });
+    }
+    catch (const runtime_error&) {
+        caught = true;
+    }
+    CHECK(caught);
+    CHECK(flight.size() == 0);
+    CHECK(flight.run("a", [] { return 4; }) == 4);
+}
+
+
+
+int main() {
+
+    printf("Starting testSingleFlight.cpp...\n");
+
+    testCoalescing();
+    testDistinctKeys();
+    testException();
+
+    return checkResult("testSingleFlight");
+}
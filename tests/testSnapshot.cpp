@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "../src/_libxtide.h"
+#include "../src/dataset.h"
+#include "../src/snapshot.h"
+#include "check.h"
+
+using namespace std;
+using namespace libxtide;
+
+
+static string dir;
+
+
+static void writeFile(const string& fileName, const string& contents) {
+    ofstream out(fileName, ios::binary | ios::trunc);
+    out << contents;
+}
+
+
+/**
+ * Rewrites fileName with contents, keeping its modification time
+ */
+static void rewriteKeepingTime(const string& fileName, const string& contents) {
+    struct stat st;
+    stat(fileName.c_str(), &st);
+    writeFile(fileName, contents);
+
+    struct utimbuf times;
+    times.actime = st.st_atime;
+    times.modtime = st.st_mtime;
+    utime(fileName.c_str(), &times);
+}
+
+
+/**
+ * Returns a dataset of three stations, two from harmonics file a and one
+ * from b.  The snapshot only looks at their files and record numbers.
+ */
+static shared_ptr<Dataset> testDataset(int firstRecord = 0) {
+    Dstr fileA((dir + "/a.tcd").c_str());
+    Dstr fileB((dir + "/b.tcd").c_str());
+
+    StationIndex* pStations = new StationIndex();
+    pStations->push_back(new StationRef(fileA, firstRecord, "Station 1", Coordinates(26.7, -79.0), ":UTC", true, false));
+    pStations->push_back(new StationRef(fileA, 1, "Station 2", Coordinates(26.8, -79.1), ":UTC", false, false));
+    pStations->push_back(new StationRef(fileB, 0, "Station 3", Coordinates(26.9, -79.2), ":UTC", true, false));
+    pStations->setRootStationIndexIndices();
+    return make_shared<Dataset>(pStations, true);
+}
+
+
+static CatalogSnapshot testSnapshot() {
+    CatalogSnapshot snap;
+    snap.ids = { "TEST:1", "TEST:2", "TEST:3" };
+    return snap;
+}
+
+
+static void testRoundTrip() {
+    DatasetPin pin(testDataset());
+    CatalogSnapshot saved = testSnapshot();
+    saveCatalogSnapshot(saved);
+
+    CatalogSnapshot loaded;
+    CHECK(loadCatalogSnapshot(loaded));
+    CHECK(loaded.ids == saved.ids);
+}
+
+
+static void testFileChanged() {
+    DatasetPin pin(testDataset());
+    CatalogSnapshot snap;
+
+    // Same size and time, different contents: caught by the checksum
+    saveCatalogSnapshot(testSnapshot());
+    rewriteKeepingTime(dir + "/a.tcd", "harmonics A, version 2");
+    CHECK(!loadCatalogSnapshot(snap));
+    CHECK(snap.ids.empty());
+
+    // Different size
+    saveCatalogSnapshot(testSnapshot());
+    writeFile(dir + "/b.tcd", "harmonics B, a good deal longer than before");
+    CHECK(!loadCatalogSnapshot(snap));
+
+    saveCatalogSnapshot(testSnapshot());
+    CHECK(loadCatalogSnapshot(snap));
+}
+
+
+static void testStationsChanged() {
+    // A snapshot of a different station index is not used
+    {
+        DatasetPin pin(testDataset());
+        saveCatalogSnapshot(testSnapshot());
+    }
+
+    DatasetPin pin(testDataset(5));
+    CatalogSnapshot snap;
+    CHECK(!loadCatalogSnapshot(snap));
+}
+
+
+static void testFileOrderChanged() {
+    // The same files in a different HFILE_PATH order are a different catalog
+    DatasetPin pin(testDataset());
+    setenv("HFILE_PATH", (dir + "/b.tcd:" + dir + "/a.tcd").c_str(), 1);
+    saveCatalogSnapshot(testSnapshot());
+
+    CatalogSnapshot snap;
+    CHECK(loadCatalogSnapshot(snap));
+
+    setenv("HFILE_PATH", (dir + "/a.tcd:" + dir + "/b.tcd").c_str(), 1);
+    CHECK(!loadCatalogSnapshot(snap));
+    unsetenv("HFILE_PATH");
+}
+
+
+static void testDisabled() {
+    DatasetPin pin(testDataset());
+    setenv("XTWSD_SNAPSHOT", "", 1);
+    CatalogSnapshot snap;
+    CHECK(!loadCatalogSnapshot(snap));
+    setenv("XTWSD_SNAPSHOT", (dir + "/catalog.snapshot").c_str(), 1);
+}
+
+
+
+int main() {
+
+    printf("Starting testSnapshot.cpp...\n");
+
+    char tmp[] = "/tmp/xtwsd-snapshot-XXXXXX";
+    if (mkdtemp(tmp) == NULL) {
+        printf("testSnapshot: could not create a temporary directory\n");
+        return 1;
+    }
+    dir = tmp;
+    writeFile(dir + "/a.tcd", "harmonics A, version 1");
+    writeFile(dir + "/b.tcd", "harmonics B");
+    setenv("XTWSD_SNAPSHOT", (dir + "/catalog.snapshot").c_str(), 1);
+
+    testRoundTrip();
+    testFileChanged();
+    testStationsChanged();
+    testFileOrderChanged();
+    testDisabled();
+
+    unlink((dir + "/catalog.snapshot").c_str());
+    unlink((dir + "/a.tcd").c_str());
+    unlink((dir + "/b.tcd").c_str());
+    rmdir(dir.c_str());
+
+    return checkResult("testSnapshot");
+}
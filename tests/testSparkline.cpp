@@ -0,0 +1,85 @@
+#include <cmath>
+#include <vector>
+
+#include "../src/sparkline.h"
+#include "check.h"
+
+using namespace std;
+using namespace sparkline;
+
+
+/**
+ * Returns a day of six minute tide levels: two highs and two lows
+ */
+static vector<Point> tideCurve() {
+    vector<Point> points;
+    for (int n = 0; n < 240; n++) {
+        double hours = n / 10.0;
+        Point p = { hours, 2.0 * sin(hours * 2 * M_PI / 12.42) };
+        points.push_back(p);
+    }
+    return points;
+}
+
+
+static bool sortedByX(const vector<Point>& points) {
+    for (size_t p = 1; p < points.size(); p++) {
+        if (points[p].x <= points[p - 1].x) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void testThreshold() {
+    vector<Point> points = tideCurve();
+    vector<Point> sampled = decimate(points, 40);
+
+    CHECK(sampled.size() == 40);
+    CHECK(sortedByX(sampled));
+
+    // The ends are always kept
+    CHECK(sampled.front().x == points.front().x);
+    CHECK(sampled.back().x == points.back().x);
+}
+
+
+static void testPeaks() {
+    // The highs and lows survive decimation
+    vector<Point> points = tideCurve();
+    vector<Point> sampled = decimate(points, 30);
+
+    double maxY = -10;
+    double minY = 10;
+    for (const Point& p : sampled) {
+        maxY = max(maxY, p.y);
+        minY = min(minY, p.y);
+    }
+    CHECK(maxY > 1.95);
+    CHECK(minY < -1.95);
+}
+
+
+static void testUnchanged() {
+    // Nothing to do if there are already few enough points, or the
+    // threshold is too small to split into buckets
+    vector<Point> points = tideCurve();
+    CHECK(decimate(points, points.size()).size() == points.size());
+    CHECK(decimate(points, 1000).size() == points.size());
+    CHECK(decimate(points, 2).size() == points.size());
+    CHECK(decimate(vector<Point>(), 10).empty());
+}
+
+
+
+int main() {
+
+    printf("Starting testSparkline.cpp...\n");
+
+    testThreshold();
+    testPeaks();
+    testUnchanged();
+
+    return checkResult("testSparkline");
+}
@@ -0,0 +1,120 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+
+#include "../src/workpool.h"
+#include "check.h"
+
+using namespace std;
+
+
+/**
+ * Keeps the only worker of a pool busy until release() is called
+ */
+class BusyWorker {
+
+    public:
+        explicit BusyWorker(WorkPool& pool) : releaseSignal(released.get_future().share()) {
+            shared_future<void> signal = releaseSignal;
+            promise<void>* pStarted = &started;
+            pool.post([signal, pStarted] {
+                pStarted->set_value();
+                signal.wait();
+            });
+            started.get_future().wait();
+        }
+
+        void release() { released.set_value(); }
+
+    private:
+        promise<void> started;
+        promise<void> released;
+        shared_future<void> releaseSignal;
+};
+
+
+
+static void testCompleted() {
+    WorkPool pool("test", 2, 4);
+    int result = 0;
+    CHECK(pool.run([&result] { result = 42; }, 1000) == WorkPool::COMPLETED);
+    CHECK(result == 42);
+}
+
+
+static void testExpired() {
+    // A job still waiting in the queue when its deadline passes is
+    // dropped without running.
+    WorkPool pool("test", 1, 4);
+    BusyWorker busy(pool);
+
+    atomic<bool> ran(false);
+    CHECK(pool.run([&ran] { ran = true; }, 50) == WorkPool::EXPIRED);
+    CHECK(pool.getQueueDepth() == 0);
+
+    busy.release();
+    CHECK(pool.run([] {}, 1000) == WorkPool::COMPLETED);
+    CHECK(!ran);
+}
+
+
+static void testOverflow() {
+    // Once maxQueued jobs are waiting, more are turned away right away
+    WorkPool pool("test", 1, 1);
+    BusyWorker busy(pool);
+
+    CHECK(pool.post([] {}));
+    CHECK(pool.getQueueDepth() == 1);
+    CHECK(!pool.post([] {}));
+
+    auto started = chrono::steady_clock::now();
+    CHECK(pool.run([] {}, 1000) == WorkPool::REJECTED);
+    CHECK(chrono::steady_clock::now() - started < chrono::milliseconds(500));
+
+    busy.release();
+}
+
+
+static void testCancelled() {
+    // A job that is running when its deadline passes is asked to stop
+    WorkPool pool("test", 1, 4);
+    CHECK(!WorkPool::cancelled());
+    WorkPool::Result result = pool.run([] {
+        while (!WorkPool::cancelled()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }, 50);
+    CHECK(result == WorkPool::CANCELLED);
+}
+
+
+static void testException() {
+    // What a job throws is rethrown to the caller, and the worker survives
+    WorkPool pool("test", 1, 4);
+    bool caught = false;
+    try {
+        pool.run([] { throw runtime_error("failed"); }, 1000);
+    }
+    catch (const runtime_error& err) {
+        caught = (string(err.what()) == "failed");
+    }
+    CHECK(caught);
+    CHECK(pool.run([] {}, 1000) == WorkPool::COMPLETED);
+}
+
+
+
+int main() {
+
+    printf("Starting testWorkPool.cpp...\n");
+
+    testCompleted();
+    testExpired();
+    testOverflow();
+    testCancelled();
+    testException();
+
+    return checkResult("testWorkPool");
+}